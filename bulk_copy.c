@@ -102,15 +102,39 @@ bulk_copy_emu_for(bulk_copy_data * data)
 }
 
 
-void
-bulk_copy_validate(bulk_copy_data* data)
+static noinline void
+bulk_copy_validate_worker(long begin, long end, va_list args)
 {
-    for (long i = 0; i < data->n; ++i) {
-        if (data->dst[i] != 1) {
-            LOG("VALIDATION ERROR: c[%li] == %li (supposed to be 1)\n", i, data->dst[i]);
+    long * dst = va_arg(args, long*);
+    long * checksum = va_arg(args, long*);
+    long local_sum = 0;
+    for (long i = begin; i < end; ++i) {
+        if (dst[i] != 1) {
+            LOG_ERROR("VALIDATION ERROR: c[%li] == %li (supposed to be 1)\n", i, dst[i]);
             exit(1);
         }
+        local_sum += dst[i];
     }
+    REMOTE_ADD(checksum, local_sum);
+}
+
+static noinline void
+bulk_copy_validate_local(long * dst, long n, long * checksum)
+{
+    emu_local_for(0, n, LOCAL_GRAIN(n),
+        bulk_copy_validate_worker, dst, checksum
+    );
+}
+
+// Check the destination array in parallel on the nodelet that owns it
+// Returns the sum of all elements
+long
+bulk_copy_validate(bulk_copy_data* data)
+{
+    long checksum = 0;
+    cilk_spawn_at(data->dst) bulk_copy_validate_local(data->dst, data->n, &checksum);
+    cilk_sync;
+    return checksum;
 }
 
 void bulk_copy_run(
@@ -182,7 +206,11 @@ int main(int argc, char** argv)
     }
 #ifndef NO_VALIDATE
     LOG("Validating results...");
-    bulk_copy_validate(&data);
+    hooks_region_begin("validate");
+    long checksum = bulk_copy_validate(&data);
+    hooks_set_attr_i64("checksum", checksum);
+    hooks_region_end();
+    runtime_assert(checksum == data.n, "Checksum does not match");
     LOG("OK\n");
 #endif
 
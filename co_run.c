@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+#include <emu_c_utils/emu_c_utils.h>
+
+#include "common.h"
+#include "rng.h"
+#include "nodelet_timing.h"
+
+/*
+ * Goal: Measure how much two kernels slow each other down when they share the machine.
+ * Each kernel runs on a range of nodelets, using its own memory on those nodelets:
+ * - stream    - C = A + B over a chunk of three arrays on each nodelet
+ * - chase     - follows a random cycle through a chunk on each nodelet, so most steps migrate
+ * - scatter   - copies the chunk on the first nodelet to every other nodelet in the range
+ * - ping_pong - each thread migrates back and forth between its nodelet and the next one in the range
+ * Every trial runs kernel A alone, then kernel B alone, then both at once, and reports the slowdown of each kernel.
+ * Both kernels do a fixed amount of work, so whichever finishes last runs alone for the rest of the co-run.
+ */
+
+typedef enum kernel_type {
+    KERNEL_STREAM,
+    KERNEL_CHASE,
+    KERNEL_SCATTER,
+    KERNEL_PING_PONG,
+} kernel_type;
+
+static const char * kernel_names[] = { "stream", "chase", "scatter", "ping_pong" };
+
+typedef struct co_kernel {
+    long type;
+    // Range of nodelets the kernel runs on
+    long first_nlet;
+    long num_nlets;
+    // Elements (or steps) per nodelet
+    long m;
+    long threads_per_nlet;
+    // Striped array, holds a pointer to the chunk on each nodelet in the range
+    long ** chunks;
+} co_kernel;
+
+typedef struct co_run_data {
+    co_kernel kernels[2];
+} co_run_data;
+
+replicated co_run_data data;
+
+static long
+parse_kernel(const char * name)
+{
+    for (long i = 0; i < (long)(sizeof(kernel_names) / sizeof(kernel_names[0])); ++i) {
+        if (!strcmp(name, kernel_names[i])) { return i; }
+    }
+    return -1;
+}
+
+static long
+chunk_words(long type, long m)
+{
+    return type == KERNEL_STREAM ? 3 * m : m;
+}
+
+void
+co_kernel_init(co_run_data * data, long idx, long type, long first_nlet, long num_nlets, long n, long num_threads)
+{
+    co_kernel * k = &data->kernels[idx];
+    long m = n / num_nlets;
+    long threads_per_nlet = num_threads / num_nlets;
+    if (threads_per_nlet < 1) { threads_per_nlet = 1; }
+    if (threads_per_nlet > m) { threads_per_nlet = m; }
+    mw_replicated_init(&k->type, type);
+    mw_replicated_init(&k->first_nlet, first_nlet);
+    mw_replicated_init(&k->num_nlets, num_nlets);
+    mw_replicated_init(&k->m, m);
+    mw_replicated_init(&k->threads_per_nlet, threads_per_nlet);
+
+    long ** chunks = (long**)mw_malloc1dlong(NODELETS());
+    runtime_assert(chunks != NULL, "Failed to allocate chunk pointers");
+    mw_replicated_init((long*)&k->chunks, (long)chunks);
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        chunks[nlet] = NULL;
+    }
+    for (long i = 0; i < num_nlets; ++i) {
+        long nlet = first_nlet + i;
+        chunks[nlet] = mw_localmalloc(chunk_words(type, m) * sizeof(long), &chunks[nlet]);
+        runtime_assert(chunks[nlet] != NULL, "Failed to allocate chunk");
+    }
+
+    // Fill in the inputs, which never change
+    long total = num_nlets * m;
+    if (type == KERNEL_STREAM) {
+        for (long i = 0; i < num_nlets; ++i) {
+            long * chunk = chunks[first_nlet + i];
+            for (long j = 0; j < m; ++j) {
+                chunk[j] = 1;
+                chunk[m + j] = 2;
+            }
+        }
+    } else if (type == KERNEL_CHASE) {
+        // Sattolo's algorithm generates a random permutation with a single cycle
+        long * next = malloc(total * sizeof(long));
+        runtime_assert(next != NULL, "Failed to allocate temporary array");
+        for (long i = 0; i < total; ++i) { next[i] = i; }
+        for (long i = total - 1; i > 0; --i) {
+            long j = rng_below(rng_at(0, first_nlet, i), i);
+            long tmp = next[i]; next[i] = next[j]; next[j] = tmp;
+        }
+        for (long i = 0; i < total; ++i) {
+            chunks[first_nlet + i / m][i % m] = next[i];
+        }
+        free(next);
+    } else if (type == KERNEL_SCATTER) {
+        long * src = chunks[first_nlet];
+        for (long j = 0; j < m; ++j) { src[j] = j; }
+    }
+}
+
+void
+co_kernel_deinit(co_run_data * data, long idx)
+{
+    co_kernel * k = &data->kernels[idx];
+    for (long i = 0; i < k->num_nlets; ++i) {
+        mw_localfree(k->chunks[k->first_nlet + i]);
+    }
+    mw_free(k->chunks);
+}
+
+// Clears the outputs before each run
+void
+co_kernel_reset(co_run_data * data, long idx)
+{
+    co_kernel * k = &data->kernels[idx];
+    for (long i = 0; i < k->num_nlets; ++i) {
+        long * chunk = k->chunks[k->first_nlet + i];
+        if (k->type == KERNEL_STREAM) {
+            memset(chunk + 2 * k->m, 0, k->m * sizeof(long));
+        } else if (k->type == KERNEL_SCATTER && i > 0) {
+            memset(chunk, 0, k->m * sizeof(long));
+        }
+    }
+}
+
+// Runs on nodelet nlet, which is the i'th nodelet in the kernel's range
+static noinline void
+thread_worker(long idx, long i, long t)
+{
+    // Resolves to the local copy of the replicated kernel description
+    co_kernel * k = &data.kernels[idx];
+    long nlet = k->first_nlet + i;
+    long m = k->m;
+    long per_thread = m / k->threads_per_nlet;
+    long begin = t * per_thread;
+    long end = t == k->threads_per_nlet - 1 ? m : begin + per_thread;
+    long * chunk = k->chunks[nlet];
+
+    if (k->type == KERNEL_STREAM) {
+        long * a = chunk;
+        long * b = chunk + m;
+        long * c = chunk + 2 * m;
+        for (long j = begin; j < end; ++j) {
+            c[j] = a[j] + b[j];
+        }
+    } else if (k->type == KERNEL_CHASE) {
+        long g = i * m + begin;
+        for (long step = begin; step < end; ++step) {
+            long * next_chunk = k->chunks[k->first_nlet + g / m];
+            g = next_chunk[g % m];
+        }
+        if (g < 0) { LOG("%li\n", g); }
+    } else if (k->type == KERNEL_SCATTER) {
+        if (i > 0) {
+            long * src = k->chunks[k->first_nlet];
+            memcpy(chunk + begin, src + begin, (end - begin) * sizeof(long));
+        }
+    } else if (k->type == KERNEL_PING_PONG) {
+        volatile long * here = (volatile long *)&k->chunks[nlet];
+        volatile long * there = (volatile long *)&k->chunks[k->first_nlet + (i + 1) % k->num_nlets];
+        long sum = 0;
+        for (long j = begin; j < end; ++j) {
+            sum += *there;
+            sum += *here;
+        }
+        if (sum == -1) { LOG("%li\n", sum); }
+    }
+}
+
+static noinline void
+nodelet_worker(long idx, long i)
+{
+    long threads_per_nlet = data.kernels[idx].threads_per_nlet;
+    for (long t = 0; t < threads_per_nlet; ++t) {
+        cilk_spawn thread_worker(idx, i, t);
+    }
+    cilk_sync;
+}
+
+// Runs one kernel to completion, returns the elapsed time in ms
+noinline double
+co_kernel_run(long idx)
+{
+    co_kernel * k = &data.kernels[idx];
+    long start = timing_now();
+    for (long i = 0; i < k->num_nlets; ++i) {
+        cilk_spawn_at(&k->chunks[k->first_nlet + i]) nodelet_worker(idx, i);
+    }
+    cilk_sync;
+    return (timing_now() - start) / TIMING_TICKS_PER_MS;
+}
+
+static noinline void
+co_kernel_run_into(long idx, double * time_ms)
+{
+    *time_ms = co_kernel_run(idx);
+}
+
+bool
+co_kernel_validate(co_run_data * data, long idx)
+{
+    co_kernel * k = &data->kernels[idx];
+    for (long i = 0; i < k->num_nlets; ++i) {
+        long * chunk = k->chunks[k->first_nlet + i];
+        for (long j = 0; j < k->m; ++j) {
+            if (k->type == KERNEL_STREAM && chunk[2 * k->m + j] != 3) { return false; }
+            if (k->type == KERNEL_SCATTER && chunk[j] != j) { return false; }
+        }
+    }
+    return true;
+}
+
+void
+co_run_run(co_run_data * data, long num_trials)
+{
+    const char * name_a = kernel_names[data->kernels[0].type];
+    const char * name_b = kernel_names[data->kernels[1].type];
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        double solo_ms[2], co_ms[2];
+
+        for (long idx = 0; idx < 2; ++idx) {
+            co_kernel_reset(data, idx);
+            hooks_set_attr_str("kernel", kernel_names[data->kernels[idx].type]);
+            hooks_region_begin("solo");
+            solo_ms[idx] = co_kernel_run(idx);
+            hooks_region_end();
+        }
+
+        co_kernel_reset(data, 0);
+        co_kernel_reset(data, 1);
+        hooks_set_attr_str("kernel", "both");
+        hooks_region_begin("co_run");
+        cilk_spawn co_kernel_run_into(0, &co_ms[0]);
+        co_kernel_run_into(1, &co_ms[1]);
+        cilk_sync;
+        hooks_set_attr_f64("slowdown_a", solo_ms[0] == 0 ? 0 : co_ms[0] / solo_ms[0]);
+        hooks_set_attr_f64("slowdown_b", solo_ms[1] == 0 ? 0 : co_ms[1] / solo_ms[1]);
+        hooks_region_end();
+
+        LOG("A (%s): solo %3.3f ms, co-run %3.3f ms, slowdown %3.2fx\n",
+            name_a, solo_ms[0], co_ms[0], solo_ms[0] == 0 ? 0 : co_ms[0] / solo_ms[0]);
+        LOG("B (%s): solo %3.3f ms, co-run %3.3f ms, slowdown %3.2fx\n",
+            name_b, solo_ms[1], co_ms[1], solo_ms[1] == 0 ? 0 : co_ms[1] / solo_ms[1]);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* kernel_a;
+        const char* kernel_b;
+        const char* placement;
+        long log2_num_elements;
+        long num_threads;
+        long num_trials;
+    } args;
+
+    if (argc != 7) {
+        LOG("Usage: %s kernel_a kernel_b placement log2_num_elements num_threads num_trials\n", argv[0]);
+        exit(1);
+    } else {
+        args.kernel_a = argv[1];
+        args.kernel_b = argv[2];
+        args.placement = argv[3];
+        args.log2_num_elements = atol(argv[4]);
+        args.num_threads = atol(argv[5]);
+        args.num_trials = atol(argv[6]);
+
+        if (parse_kernel(args.kernel_a) < 0) { LOG("Kernel %s not implemented!\n", args.kernel_a); exit(1); }
+        if (parse_kernel(args.kernel_b) < 0) { LOG("Kernel %s not implemented!\n", args.kernel_b); exit(1); }
+        if (args.log2_num_elements <= 0) { LOG("log2_num_elements must be > 0"); exit(1); }
+        if (args.num_threads <= 0) { LOG("num_threads must be > 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+    }
+
+    // Nodelet ranges of the two kernels
+    long first_a, num_a, first_b, num_b;
+    if (!strcmp(args.placement, "disjoint")) {
+        runtime_assert(NODELETS() >= 2, "disjoint placement needs at least two nodelets");
+        first_a = 0; num_a = NODELETS() / 2;
+        first_b = num_a; num_b = NODELETS() - num_a;
+    } else if (!strcmp(args.placement, "overlap")) {
+        first_a = 0; num_a = NODELETS();
+        first_b = 0; num_b = NODELETS();
+    } else {
+        LOG("Placement %s not implemented!\n", args.placement);
+        exit(1);
+    }
+
+    long n = 1L << args.log2_num_elements;
+    runtime_assert(n >= NODELETS(), "Need at least one element per nodelet");
+
+    hooks_set_attr_str("kernel_a", args.kernel_a);
+    hooks_set_attr_str("kernel_b", args.kernel_b);
+    hooks_set_attr_str("placement", args.placement);
+    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
+    hooks_set_attr_i64("num_threads", args.num_threads);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+
+    LOG("Initializing %s on nodelets %li-%li and %s on nodelets %li-%li with %li elements each\n",
+        args.kernel_a, first_a, first_a + num_a - 1, args.kernel_b, first_b, first_b + num_b - 1, n);
+    co_kernel_init(&data, 0, parse_kernel(args.kernel_a), first_a, num_a, n, args.num_threads);
+    co_kernel_init(&data, 1, parse_kernel(args.kernel_b), first_b, num_b, n, args.num_threads);
+
+    co_run_run(&data, args.num_trials);
+
+#ifndef NO_VALIDATE
+    LOG("Validating results...");
+    hooks_region_begin("validate");
+    bool ok = co_kernel_validate(&data, 0) && co_kernel_validate(&data, 1);
+    hooks_region_end();
+    runtime_assert(ok, "Validation failed");
+    LOG("OK\n");
+#endif
+
+    co_kernel_deinit(&data, 0);
+    co_kernel_deinit(&data, 1);
+    return 0;
+}
@@ -1,7 +1,13 @@
 #pragma once
 
-// Logging macro. Flush right away since Emu hardware usually doesn't
-#define LOG(...) fprintf(stdout, __VA_ARGS__); fflush(stdout);
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logging.h"
+
+// Logging macro, see logging.h for when the output is flushed
+#define LOG(...) LOG_INFO(__VA_ARGS__)
 
 // HACK so we can compile with old toolchain
 #ifndef cilk_spawn_at
@@ -12,7 +18,97 @@
 static inline void
 runtime_assert(bool condition, const char* message) {
     if (!condition) {
-        LOG("ERROR: %s\n", message);
+        LOG_ERROR("ERROR: %s\n", message);
         exit(1);
     }
 }
+
+// Removes argv[i] (and the following n-1 entries) from the command line
+static inline void
+remove_args(int * argc, char ** argv, int i, int n)
+{
+    for (int j = i; j + n <= *argc; ++j) {
+        argv[j] = argv[j + n];
+    }
+    *argc -= n;
+}
+
+// Looks for "--name" on the command line. If present, removes it and returns true.
+// Lets the benchmarks with positional arguments accept optional flags.
+static inline bool
+take_flag(int * argc, char ** argv, const char * name)
+{
+    for (int i = 1; i < *argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1] == '-' && !strcmp(argv[i] + 2, name)) {
+            remove_args(argc, argv, i, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Looks for "--name value" or "--name=value" on the command line.
+// If present, removes it and returns the value, otherwise returns default_value.
+static inline long
+take_long_option(int * argc, char ** argv, const char * name, long default_value)
+{
+    size_t len = strlen(name);
+    for (int i = 1; i < *argc; ++i) {
+        const char * arg = argv[i];
+        if (arg[0] != '-' || arg[1] != '-' || strncmp(arg + 2, name, len)) { continue; }
+        if (arg[2 + len] == '=') {
+            long value = atol(arg + 3 + len);
+            remove_args(argc, argv, i, 1);
+            return value;
+        } else if (arg[2 + len] == '\0') {
+            runtime_assert(i + 1 < *argc, "Missing value for option");
+            long value = atol(argv[i + 1]);
+            remove_args(argc, argv, i, 2);
+            return value;
+        }
+    }
+    return default_value;
+}
+
+// Same as take_long_option, for floating-point values
+static inline double
+take_double_option(int * argc, char ** argv, const char * name, double default_value)
+{
+    size_t len = strlen(name);
+    for (int i = 1; i < *argc; ++i) {
+        const char * arg = argv[i];
+        if (arg[0] != '-' || arg[1] != '-' || strncmp(arg + 2, name, len)) { continue; }
+        if (arg[2 + len] == '=') {
+            double value = atof(arg + 3 + len);
+            remove_args(argc, argv, i, 1);
+            return value;
+        } else if (arg[2 + len] == '\0') {
+            runtime_assert(i + 1 < *argc, "Missing value for option");
+            double value = atof(argv[i + 1]);
+            remove_args(argc, argv, i, 2);
+            return value;
+        }
+    }
+    return default_value;
+}
+
+// Same as take_long_option, for strings. The result points into argv.
+static inline const char *
+take_string_option(int * argc, char ** argv, const char * name, const char * default_value)
+{
+    size_t len = strlen(name);
+    for (int i = 1; i < *argc; ++i) {
+        const char * arg = argv[i];
+        if (arg[0] != '-' || arg[1] != '-' || strncmp(arg + 2, name, len)) { continue; }
+        if (arg[2 + len] == '=') {
+            remove_args(argc, argv, i, 1);
+            return arg + 3 + len;
+        } else if (arg[2 + len] == '\0') {
+            runtime_assert(i + 1 < *argc, "Missing value for option");
+            const char * value = argv[i + 1];
+            remove_args(argc, argv, i, 2);
+            return value;
+        }
+    }
+    return default_value;
+}
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+#include <emu_c_utils/emu_c_utils.h>
+
+#include "common.h"
+#include "datagen.h"
+
+/*
+ * Goal: Measure how fast the generators in datagen.h fill an array of 2^log2_num_elements elements,
+ * with each element written from the nodelet that owns it. The layout is one of:
+ * - local   - a single array on nodelet 0
+ * - striped - mw_malloc1dlong, element i is on nodelet i % NODELETS()
+ * - chunked - emu_chunked_array, one contiguous chunk per nodelet
+ * The rmat generator fills two arrays (sources and destinations).
+ */
+
+typedef enum datagen_layout {
+    LAYOUT_LOCAL,
+    LAYOUT_STRIPED,
+    LAYOUT_CHUNKED,
+} datagen_layout;
+
+typedef struct datagen_data {
+    long layout;
+    long n;
+    long num_arrays;
+    // For the local and striped layouts
+    long * arrays[2];
+    emu_chunked_array chunked[2];
+    datagen_spec specs[2];
+} datagen_data;
+
+replicated datagen_data data;
+
+void
+datagen_data_init(datagen_data * data, long layout, long n, long num_arrays, const datagen_spec * specs)
+{
+    data->layout = layout;
+    data->n = n;
+    data->num_arrays = num_arrays;
+    for (long a = 0; a < num_arrays; ++a) {
+        data->specs[a] = specs[a];
+        switch (layout) {
+            case LAYOUT_LOCAL:
+                data->arrays[a] = mw_localmalloc(n * sizeof(long), data);
+                runtime_assert(data->arrays[a] != NULL, "Failed to allocate array");
+                break;
+            case LAYOUT_STRIPED:
+                data->arrays[a] = mw_malloc1dlong(n);
+                runtime_assert(data->arrays[a] != NULL, "Failed to allocate array");
+                break;
+            case LAYOUT_CHUNKED:
+                emu_chunked_array_replicated_init(&data->chunked[a], n, sizeof(long));
+                break;
+        }
+    }
+
+#ifdef __le64__
+    // The workers read the specs from their own nodelet's copy, so replicate everything to all other nodelets
+    data = mw_get_nth(data, 0);
+    for (long i = 1; i < NODELETS(); ++i) {
+        datagen_data * remote_data = mw_get_nth(data, i);
+        memcpy(remote_data, data, sizeof(datagen_data));
+    }
+#endif
+}
+
+void
+datagen_data_deinit(datagen_data * data)
+{
+    for (long a = 0; a < data->num_arrays; ++a) {
+        switch (data->layout) {
+            case LAYOUT_LOCAL: mw_localfree(data->arrays[a]); break;
+            case LAYOUT_STRIPED: mw_free(data->arrays[a]); break;
+            case LAYOUT_CHUNKED: emu_chunked_array_replicated_deinit(&data->chunked[a]); break;
+        }
+    }
+}
+
+void
+datagen_fill(datagen_data * data)
+{
+    for (long a = 0; a < data->num_arrays; ++a) {
+        switch (data->layout) {
+            case LAYOUT_LOCAL: datagen_fill_local(data->arrays[a], data->n, &data->specs[a]); break;
+            case LAYOUT_STRIPED: datagen_fill_striped(data->arrays[a], data->n, &data->specs[a]); break;
+            case LAYOUT_CHUNKED: datagen_fill_chunked(&data->chunked[a], &data->specs[a]); break;
+        }
+    }
+}
+
+void
+datagen_run(datagen_data * data, const char * name, long num_trials)
+{
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        hooks_region_begin(name);
+        datagen_fill(data);
+        double time_ms = hooks_region_end();
+        long elements = data->n * data->num_arrays;
+        double elements_per_second = time_ms == 0 ? 0 : elements / (time_ms / 1000);
+        LOG("%3.2f M elements/s, %3.2f MB/s\n",
+            elements_per_second / 1000000, elements_per_second * sizeof(long) / 1000000);
+    }
+}
+
+// Totals kept by the validation workers
+enum { CHECK_SUM, CHECK_FINGERPRINT, CHECK_COUNT, CHECK_TOTALS };
+
+// Checks element i == x, where prev is element i - 1 (only read for sorted_runs), and adds it to the totals
+static inline void
+datagen_check_element(const datagen_spec * spec, long i, long x, long prev, unsigned long * totals)
+{
+    if (x < 0 || x >= spec->range + spec->run_length) {
+        LOG_ERROR("VALIDATION ERROR: element %li == %li is out of range\n", i, x);
+        exit(1);
+    }
+    if (spec->type == DATAGEN_SORTED_RUNS && i % spec->run_length != 0 && x <= prev) {
+        LOG_ERROR("VALIDATION ERROR: element %li is out of order within its run\n", i);
+        exit(1);
+    }
+    totals[CHECK_SUM] += x;
+    // Zero when the values are a permutation of the indices (and almost surely not otherwise)
+    totals[CHECK_FINGERPRINT] += rng_hash(x) - rng_hash(i);
+    // zipf counts the most frequent value, nearly_sorted the elements that moved
+    totals[CHECK_COUNT] += spec->type == DATAGEN_ZIPF ? x == 0 : x != i;
+}
+
+static inline void
+datagen_add_totals(long * totals, unsigned long * local_totals)
+{
+    for (long t = 0; t < CHECK_TOTALS; ++t) {
+        REMOTE_ADD(&totals[t], (long)local_totals[t]);
+    }
+}
+
+static void
+datagen_validate_local_worker(long begin, long end, va_list args)
+{
+    long * array = va_arg(args, long*);
+    datagen_spec spec = *va_arg(args, const datagen_spec*);
+    long * totals = va_arg(args, long*);
+    unsigned long local_totals[CHECK_TOTALS] = {0};
+    for (long i = begin; i < end; ++i) {
+        long prev = spec.type == DATAGEN_SORTED_RUNS && i > 0 ? array[i - 1] : 0;
+        datagen_check_element(&spec, i, array[i], prev, local_totals);
+    }
+    datagen_add_totals(totals, local_totals);
+}
+
+static void
+datagen_validate_striped_worker(long * array, long begin, long end, va_list args)
+{
+    datagen_spec spec = *va_arg(args, const datagen_spec*);
+    long * totals = va_arg(args, long*);
+    unsigned long local_totals[CHECK_TOTALS] = {0};
+    const long nodelets = NODELETS();
+    for (long i = begin; i < end; i += nodelets) {
+        // The previous element is on another nodelet
+        long prev = spec.type == DATAGEN_SORTED_RUNS && i > 0 ? array[i - 1] : 0;
+        datagen_check_element(&spec, i, array[i], prev, local_totals);
+    }
+    datagen_add_totals(totals, local_totals);
+}
+
+static void
+datagen_validate_chunked_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    datagen_spec spec = *va_arg(args, const datagen_spec*);
+    long * totals = va_arg(args, long*);
+    unsigned long local_totals[CHECK_TOTALS] = {0};
+    long * a = emu_chunked_array_index(array, begin);
+    for (long i = begin; i < end; ++i) {
+        long prev = 0;
+        if (spec.type == DATAGEN_SORTED_RUNS && i > 0) {
+            prev = i > begin ? a[i - 1 - begin] : *(long*)emu_chunked_array_index(array, i - 1);
+        }
+        datagen_check_element(&spec, i, a[i - begin], prev, local_totals);
+    }
+    datagen_add_totals(totals, local_totals);
+}
+
+// Probability of a zipf value being 0, i.e. 1 / (sum of k^-s over [1, range]).
+// The tail of the sum is approximated by its integral.
+static double
+datagen_zipf_p0(const datagen_spec * spec)
+{
+    long head = spec->range < 1024 ? spec->range : 1024;
+    double sum = 0;
+    for (long k = 1; k <= head; ++k) { sum += datagen_zipf_h(spec->zipf_s, k); }
+    if (head < spec->range) {
+        sum += datagen_zipf_h_integral(spec->zipf_s, spec->range + 0.5)
+            - datagen_zipf_h_integral(spec->zipf_s, head + 0.5);
+    }
+    return 1 / sum;
+}
+
+// Checks that count is within 5 standard deviations of a binomial(n, p) draw
+static void
+datagen_check_count(const char * what, long count, long n, double p)
+{
+    double expected = n * p;
+    double tolerance = 5 * sqrt(n * p * (1 - p)) + 1;
+    LOG("%3.2f%% of the elements are %s (expected %3.2f%%)\n", 100.0 * count / n, what, 100 * p);
+    if (fabs(count - expected) > tolerance) {
+        LOG_ERROR("VALIDATION ERROR: %li elements are %s, expected %3.0f +- %3.0f\n", count, what, expected, tolerance);
+        exit(1);
+    }
+}
+
+// Checks every element in parallel on the nodelet that owns it, plus a property of each generator.
+// Returns the sum of all elements.
+long
+datagen_validate(datagen_data * data)
+{
+    long n = data->n;
+    long checksum = 0;
+    for (long a = 0; a < data->num_arrays; ++a) {
+        datagen_spec * spec = &data->specs[a];
+        long totals[CHECK_TOTALS] = {0};
+        switch (data->layout) {
+            case LAYOUT_LOCAL:
+                emu_local_for(0, n, LOCAL_GRAIN_MIN(n, 256), datagen_validate_local_worker, data->arrays[a], spec, totals);
+                break;
+            case LAYOUT_STRIPED:
+                emu_1d_array_apply(data->arrays[a], n, GLOBAL_GRAIN_MIN(n, 256),
+                    datagen_validate_striped_worker, spec, totals);
+                break;
+            case LAYOUT_CHUNKED:
+                emu_chunked_array_apply(&data->chunked[a], GLOBAL_GRAIN_MIN(n, 256),
+                    datagen_validate_chunked_worker, spec, totals);
+                break;
+        }
+        checksum += totals[CHECK_SUM];
+        switch (spec->type) {
+            case DATAGEN_ZIPF:
+                datagen_check_count("zero", totals[CHECK_COUNT], n, datagen_zipf_p0(spec));
+                break;
+            case DATAGEN_NEARLY_SORTED:
+                // A replaced element keeps its place with probability 1/n
+                datagen_check_count("out of place", totals[CHECK_COUNT], n, spec->disorder * (1 - 1.0 / n));
+                break;
+            case DATAGEN_PERMUTATION:
+                // Sum of all integers from 0 to n-1 (n is a power of two)
+                if (totals[CHECK_SUM] != (n / 2) * (n - 1) || totals[CHECK_FINGERPRINT] != 0) {
+                    LOG_ERROR("VALIDATION ERROR: values are not a permutation of [0, %li)\n", n);
+                    exit(1);
+                }
+                break;
+        }
+    }
+    return checksum;
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* generator;
+        const char* layout;
+        long log2_num_elements;
+        long num_trials;
+        long seed;
+        long log2_range;
+        double zipf_exponent;
+        long run_length;
+        double disorder;
+        long rmat_scale;
+    } args;
+
+    // Optional flags first, so the positional arguments are all that's left
+    args.seed = take_long_option(&argc, argv, "seed", 0);
+    args.log2_range = take_long_option(&argc, argv, "log2_range", -1);
+    args.zipf_exponent = take_double_option(&argc, argv, "zipf_exponent", 1.0);
+    args.run_length = take_long_option(&argc, argv, "run_length", 1024);
+    args.disorder = take_double_option(&argc, argv, "disorder", 0.01);
+    args.rmat_scale = take_long_option(&argc, argv, "rmat_scale", -1);
+
+    if (argc != 5) {
+        LOG("Usage: %s generator layout log2_num_elements num_trials [--seed S] [--log2_range R] "
+            "[--zipf_exponent E] [--run_length L] [--disorder D] [--rmat_scale K]\n", argv[0]);
+        exit(1);
+    } else {
+        args.generator = argv[1];
+        args.layout = argv[2];
+        args.log2_num_elements = atol(argv[3]);
+        args.num_trials = atol(argv[4]);
+
+        if (args.log2_num_elements <= 0) { LOG("log2_num_elements must be > 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+    }
+
+    long layout;
+    if (!strcmp(args.layout, "local")) {
+        layout = LAYOUT_LOCAL;
+    } else if (!strcmp(args.layout, "striped")) {
+        layout = LAYOUT_STRIPED;
+    } else if (!strcmp(args.layout, "chunked")) {
+        layout = LAYOUT_CHUNKED;
+    } else {
+        LOG("Layout %s not implemented!\n", args.layout);
+        exit(1);
+    }
+
+    long n = 1L << args.log2_num_elements;
+    // By default values range over the number of elements, and R-MAT has 16 edges per vertex
+    long range = args.log2_range >= 0 ? 1L << args.log2_range : n;
+    long rmat_scale = args.rmat_scale > 0 ? args.rmat_scale
+        : (args.log2_num_elements > 4 ? args.log2_num_elements - 4 : 1);
+
+    datagen_spec specs[2];
+    long num_arrays = 1;
+    if (!strcmp(args.generator, "uniform")) {
+        specs[0] = datagen_uniform(args.seed, 0, range);
+    } else if (!strcmp(args.generator, "zipf")) {
+        specs[0] = datagen_zipf(args.seed, 0, range, args.zipf_exponent);
+        hooks_set_attr_f64("zipf_exponent", args.zipf_exponent);
+    } else if (!strcmp(args.generator, "rmat")) {
+        specs[0] = datagen_rmat(args.seed, 0, rmat_scale, 0.57, 0.19, 0.19, false);
+        specs[1] = datagen_rmat(args.seed, 0, rmat_scale, 0.57, 0.19, 0.19, true);
+        num_arrays = 2;
+        hooks_set_attr_i64("rmat_scale", rmat_scale);
+    } else if (!strcmp(args.generator, "sorted_runs")) {
+        specs[0] = datagen_sorted_runs(args.seed, 0, args.run_length);
+        hooks_set_attr_i64("run_length", args.run_length);
+    } else if (!strcmp(args.generator, "nearly_sorted")) {
+        specs[0] = datagen_nearly_sorted(args.seed, 0, n, args.disorder);
+        hooks_set_attr_f64("disorder", args.disorder);
+    } else if (!strcmp(args.generator, "permutation")) {
+        specs[0] = datagen_permutation(args.seed, 0, n);
+    } else {
+        LOG("Generator %s not implemented!\n", args.generator);
+        exit(1);
+    }
+
+    hooks_set_attr_str("generator", args.generator);
+    hooks_set_attr_str("layout", args.layout);
+    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
+    hooks_set_attr_i64("seed", args.seed);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+
+    LOG("Initializing %li %s array(s) with %li elements each (%li MiB total)\n",
+        num_arrays, args.layout, n, (num_arrays * n * sizeof(long)) / (1024*1024));
+    datagen_data_init(&data, layout, n, num_arrays, specs);
+
+    LOG("Generating %s data\n", args.generator);
+    datagen_run(&data, args.generator, args.num_trials);
+
+#ifndef NO_VALIDATE
+    LOG("Validating results...");
+    hooks_region_begin("validate");
+    long checksum = datagen_validate(&data);
+    hooks_set_attr_i64("checksum", checksum);
+    hooks_region_end();
+    LOG("OK\n");
+#endif
+
+    datagen_data_deinit(&data);
+    return 0;
+}
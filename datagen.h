@@ -0,0 +1,319 @@
+#pragma once
+
+#include <math.h>
+#include <stdarg.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+#include "rng.h"
+
+/*
+ * Parallel synthetic data generation.
+ *
+ * A datagen_spec describes a column of n values. Every value is computed from its index alone (see rng.h),
+ * so the fill functions write each element from the nodelet that owns it, in parallel, and the result doesn't
+ * depend on the layout or the number of threads:
+ *  - uniform        - integers in [0, range)
+ *  - zipf           - integers in [0, range), where value k has probability proportional to 1 / (k + 1)^s
+ *                     (rejection-inversion sampling, Hormann and Derflinger 1996)
+ *  - rmat           - the sources or destinations of an R-MAT edge list with 2^scale vertices. Generate both from
+ *                     the same seed and stream to get the pairs.
+ *  - sorted_runs    - runs of run_length ascending values, each starting at a random value
+ *  - nearly_sorted  - 0, 1, 2, ... with each element replaced by a random one in [0, n) with probability disorder
+ *  - permutation    - a random permutation of [0, n), from a Feistel network with cycle walking
+ *
+ *     datagen_spec spec = datagen_zipf(seed, 0, 1000, 1.2);
+ *     datagen_fill_chunked(&array, &spec);
+ *
+ * The workers dereference the spec pointer wherever they run, so a spec in a replicated struct must be copied
+ * to every nodelet first.
+ */
+
+// Random numbers available to each element, for the generators that need a variable number of them
+#define DATAGEN_DRAWS_LOG2 6
+#define DATAGEN_FEISTEL_ROUNDS 4
+
+typedef enum datagen_type {
+    DATAGEN_UNIFORM,
+    DATAGEN_ZIPF,
+    DATAGEN_RMAT_SRC,
+    DATAGEN_RMAT_DST,
+    DATAGEN_SORTED_RUNS,
+    DATAGEN_NEARLY_SORTED,
+    DATAGEN_PERMUTATION,
+} datagen_type;
+
+typedef struct datagen_spec {
+    long type;
+    unsigned long seed;
+    unsigned long stream;
+    // Values are in [0, range)
+    long range;
+    // zipf
+    double zipf_s;
+    double zipf_h_x1;
+    double zipf_h_n;
+    double zipf_s_test;
+    // rmat
+    long rmat_scale;
+    double rmat_a, rmat_b, rmat_c;
+    // sorted_runs
+    long run_length;
+    // nearly_sorted
+    double disorder;
+    // permutation
+    long feistel_half_bits;
+    unsigned long feistel_keys[DATAGEN_FEISTEL_ROUNDS];
+} datagen_spec;
+
+static inline datagen_spec
+datagen_spec_init(long type, unsigned long seed, unsigned long stream, long range)
+{
+    datagen_spec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.type = type;
+    spec.seed = seed;
+    spec.stream = stream;
+    spec.range = range;
+    return spec;
+}
+
+static inline datagen_spec
+datagen_uniform(unsigned long seed, unsigned long stream, long range)
+{
+    runtime_assert(range > 0, "datagen: range must be > 0");
+    return datagen_spec_init(DATAGEN_UNIFORM, seed, stream, range);
+}
+
+// expm1(x) / x, accurate near 0
+static inline double
+datagen_helper1(double x)
+{
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x / 2 * (1 + x / 3);
+}
+
+// log1p(x) / x, accurate near 0
+static inline double
+datagen_helper2(double x)
+{
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x / 3);
+}
+
+static inline double
+datagen_zipf_h(double s, double x)
+{
+    return exp(-s * log(x));
+}
+
+static inline double
+datagen_zipf_h_integral(double s, double x)
+{
+    double log_x = log(x);
+    return datagen_helper1((1 - s) * log_x) * log_x;
+}
+
+static inline double
+datagen_zipf_h_integral_inverse(double s, double x)
+{
+    double t = x * (1 - s);
+    if (t < -1) { t = -1; }
+    return exp(datagen_helper2(t) * x);
+}
+
+static inline datagen_spec
+datagen_zipf(unsigned long seed, unsigned long stream, long range, double s)
+{
+    runtime_assert(range > 0, "datagen: range must be > 0");
+    runtime_assert(s > 0, "datagen: zipf exponent must be > 0");
+    datagen_spec spec = datagen_spec_init(DATAGEN_ZIPF, seed, stream, range);
+    spec.zipf_s = s;
+    spec.zipf_h_x1 = datagen_zipf_h_integral(s, 1.5) - 1;
+    spec.zipf_h_n = datagen_zipf_h_integral(s, range + 0.5);
+    spec.zipf_s_test = 2 - datagen_zipf_h_integral_inverse(s, datagen_zipf_h_integral(s, 2.5) - datagen_zipf_h(s, 2));
+    return spec;
+}
+
+// Quadrant probabilities a, b, c (d is the rest), Graph500 uses 0.57, 0.19, 0.19
+static inline datagen_spec
+datagen_rmat(unsigned long seed, unsigned long stream, long scale, double a, double b, double c, bool dst)
+{
+    runtime_assert(scale > 0 && scale < (1L << DATAGEN_DRAWS_LOG2), "datagen: rmat scale out of range");
+    runtime_assert(a >= 0 && b >= 0 && c >= 0 && a + b + c <= 1, "datagen: invalid rmat probabilities");
+    datagen_spec spec = datagen_spec_init(dst ? DATAGEN_RMAT_DST : DATAGEN_RMAT_SRC, seed, stream, 1L << scale);
+    spec.rmat_scale = scale;
+    spec.rmat_a = a;
+    spec.rmat_b = b;
+    spec.rmat_c = c;
+    return spec;
+}
+
+static inline datagen_spec
+datagen_sorted_runs(unsigned long seed, unsigned long stream, long run_length)
+{
+    runtime_assert(run_length > 0, "datagen: run_length must be > 0");
+    // Leave room for the run to count up from its random start
+    datagen_spec spec = datagen_spec_init(DATAGEN_SORTED_RUNS, seed, stream, 1L << 62);
+    spec.run_length = run_length;
+    return spec;
+}
+
+static inline datagen_spec
+datagen_nearly_sorted(unsigned long seed, unsigned long stream, long n, double disorder)
+{
+    runtime_assert(n > 0, "datagen: n must be > 0");
+    datagen_spec spec = datagen_spec_init(DATAGEN_NEARLY_SORTED, seed, stream, n);
+    spec.disorder = disorder;
+    return spec;
+}
+
+static inline datagen_spec
+datagen_permutation(unsigned long seed, unsigned long stream, long n)
+{
+    runtime_assert(n > 0, "datagen: n must be > 0");
+    datagen_spec spec = datagen_spec_init(DATAGEN_PERMUTATION, seed, stream, n);
+    // The network permutes [0, 2^(2 * half_bits)), which is less than 4n, so cycle walking takes < 4 steps on average
+    long bits = 0;
+    while ((1L << bits) < n) { ++bits; }
+    spec.feistel_half_bits = (bits + 1) / 2;
+    for (long r = 0; r < DATAGEN_FEISTEL_ROUNDS; ++r) {
+        spec.feistel_keys[r] = rng_at(seed, stream, r);
+    }
+    return spec;
+}
+
+static inline long
+datagen_zipf_value(const datagen_spec * spec, long i)
+{
+    rng_state rand_state;
+    rng_init(&rand_state, spec->seed, spec->stream);
+    rng_skip(&rand_state, (unsigned long)i << DATAGEN_DRAWS_LOG2);
+    long k = 1;
+    // Accepts more than 90% of the draws, running out is all but impossible
+    for (long attempt = 0; attempt < (1L << DATAGEN_DRAWS_LOG2); ++attempt) {
+        double u = spec->zipf_h_n + rng_double(rng_next(&rand_state)) * (spec->zipf_h_x1 - spec->zipf_h_n);
+        double x = datagen_zipf_h_integral_inverse(spec->zipf_s, u);
+        k = (long)(x + 0.5);
+        if (k < 1) { k = 1; } else if (k > spec->range) { k = spec->range; }
+        if (k - x <= spec->zipf_s_test
+            || u >= datagen_zipf_h_integral(spec->zipf_s, k + 0.5) - datagen_zipf_h(spec->zipf_s, k)) {
+            break;
+        }
+    }
+    return k - 1;
+}
+
+static inline long
+datagen_rmat_value(const datagen_spec * spec, long i)
+{
+    rng_state rand_state;
+    rng_init(&rand_state, spec->seed, spec->stream);
+    rng_skip(&rand_state, (unsigned long)i << DATAGEN_DRAWS_LOG2);
+    long src = 0, dst = 0;
+    for (long level = 0; level < spec->rmat_scale; ++level) {
+        double r = rng_double(rng_next(&rand_state));
+        long src_bit = r >= spec->rmat_a + spec->rmat_b;
+        long dst_bit = (r >= spec->rmat_a && r < spec->rmat_a + spec->rmat_b) || r >= spec->rmat_a + spec->rmat_b + spec->rmat_c;
+        src = (src << 1) | src_bit;
+        dst = (dst << 1) | dst_bit;
+    }
+    return spec->type == DATAGEN_RMAT_SRC ? src : dst;
+}
+
+// Permutes [0, 2^(2 * feistel_half_bits)) with a Feistel network, using rng_hash() as the round function
+static inline unsigned long
+datagen_feistel(const datagen_spec * spec, unsigned long x)
+{
+    unsigned long half_mask = (1UL << spec->feistel_half_bits) - 1;
+    unsigned long left = x >> spec->feistel_half_bits;
+    unsigned long right = x & half_mask;
+    for (long r = 0; r < DATAGEN_FEISTEL_ROUNDS; ++r) {
+        unsigned long next = left ^ (rng_hash(right ^ spec->feistel_keys[r]) & half_mask);
+        left = right;
+        right = next;
+    }
+    return (left << spec->feistel_half_bits) | right;
+}
+
+// Value of the i'th element
+static inline long
+datagen_value(const datagen_spec * spec, long i)
+{
+    switch (spec->type) {
+        case DATAGEN_UNIFORM:
+            return rng_below(rng_at(spec->seed, spec->stream, i), spec->range);
+        case DATAGEN_ZIPF:
+            return datagen_zipf_value(spec, i);
+        case DATAGEN_RMAT_SRC:
+        case DATAGEN_RMAT_DST:
+            return datagen_rmat_value(spec, i);
+        case DATAGEN_SORTED_RUNS: {
+            long run = i / spec->run_length;
+            return rng_below(rng_at(spec->seed, spec->stream, run), spec->range) + i % spec->run_length;
+        }
+        case DATAGEN_NEARLY_SORTED: {
+            unsigned long r[2];
+            rng_block(spec->seed, spec->stream, i, r);
+            return rng_double(r[0]) < spec->disorder ? (long)rng_below(r[1], spec->range) : i;
+        }
+        case DATAGEN_PERMUTATION: {
+            // Cycle walking keeps the bijection within [0, n)
+            unsigned long x = datagen_feistel(spec, i);
+            while (x >= (unsigned long)spec->range) { x = datagen_feistel(spec, x); }
+            return x;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Workers copy the spec, so the loop doesn't migrate back to the caller's stack
+
+static noinline void
+datagen_local_worker(long begin, long end, va_list args)
+{
+    long * array = va_arg(args, long*);
+    datagen_spec spec = *va_arg(args, const datagen_spec*);
+    for (long i = begin; i < end; ++i) {
+        array[i] = datagen_value(&spec, i);
+    }
+}
+
+static noinline void
+datagen_striped_worker(long * array, long begin, long end, va_list args)
+{
+    datagen_spec spec = *va_arg(args, const datagen_spec*);
+    const long nodelets = NODELETS();
+    for (long i = begin; i < end; i += nodelets) {
+        array[i] = datagen_value(&spec, i);
+    }
+}
+
+static noinline void
+datagen_chunked_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    datagen_spec spec = *va_arg(args, const datagen_spec*);
+    long * a = emu_chunked_array_index(array, begin);
+    for (long i = 0; i < end - begin; ++i) {
+        a[i] = datagen_value(&spec, begin + i);
+    }
+}
+
+// Fills n elements of an array on one nodelet
+static inline void
+datagen_fill_local(long * array, long n, const datagen_spec * spec)
+{
+    emu_local_for(0, n, LOCAL_GRAIN_MIN(n, 256), datagen_local_worker, array, spec);
+}
+
+// Fills n elements of a striped array (mw_malloc1dlong)
+static inline void
+datagen_fill_striped(long * array, long n, const datagen_spec * spec)
+{
+    emu_1d_array_apply(array, n, GLOBAL_GRAIN_MIN(n, 256), datagen_striped_worker, spec);
+}
+
+// Fills every element of a chunked array of longs
+static inline void
+datagen_fill_chunked(emu_chunked_array * array, const datagen_spec * spec)
+{
+    emu_chunked_array_apply(array, GLOBAL_GRAIN_MIN(array->num_elements, 256), datagen_chunked_worker, spec);
+}
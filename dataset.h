@@ -0,0 +1,339 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#ifndef __le64__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "common.h"
+
+/*
+ * Binary datasets, so benchmarks can run on real inputs instead of synthesizing them at startup.
+ *
+ * A dataset file (written by dataset.py) is a header, a table of sections, and the data of each section.
+ * Every section is a column of fixed-size little-endian elements, starting at a multiple of header.alignment
+ * so the file can be mapped and read in aligned blocks:
+ *
+ *     dataset_header   magic "EMUDSET1", version, num_sections, alignment
+ *     dataset_section  x num_sections
+ *     padding, section 0 data, padding, section 1 data, ...
+ *
+ * A graph is stored in CSR form as two linked sections: DATASET_CSR_OFFSETS holds num_vertices + 1 offsets
+ * into DATASET_CSR_INDICES, which holds the destination of each edge. Both have 8-byte elements.
+ *
+ * dataset_load() reads a section into an emu_chunked_array. Each nodelet reads the part of the file that
+ * belongs in its own chunk, straight into local memory, so nodelet 0 never stages the whole file.
+ * The dataset is read on every nodelet, so if it lives in a replicated struct, copy it to every nodelet first.
+ * Within a nodelet the chunk is split between readers_per_nodelet threads. The read modes are:
+ *  - stream - fopen/fread, in blocks of DATASET_BLOCK_BYTES (the only mode on Emu hardware)
+ *  - pread  - pread on a shared file descriptor (native only)
+ *  - mmap   - memcpy from a read-only mapping of the whole file (native only)
+ * Native builds need _XOPEN_SOURCE >= 500 for pread(), defined before the first #include.
+ */
+
+#define DATASET_VERSION 1
+#define DATASET_MAX_SECTIONS 16
+#define DATASET_NAME_BYTES 48
+#define DATASET_PATH_BYTES 1024
+#ifndef DATASET_BLOCK_BYTES
+#define DATASET_BLOCK_BYTES (1L << 20)
+#endif
+
+static const char dataset_magic[8] = "EMUDSET1";
+
+typedef enum dataset_kind {
+    DATASET_COLUMN,
+    DATASET_CSR_OFFSETS,
+    DATASET_CSR_INDICES,
+} dataset_kind;
+
+typedef enum dataset_read_mode {
+    DATASET_READ_STREAM,
+    DATASET_READ_PREAD,
+    DATASET_READ_MMAP,
+} dataset_read_mode;
+
+typedef struct dataset_header {
+    char magic[8];
+    long version;
+    long num_sections;
+    // Every section starts at a multiple of this many bytes
+    long alignment;
+} dataset_header;
+
+typedef struct dataset_section {
+    char name[DATASET_NAME_BYTES];
+    long kind;
+    long element_size;
+    long num_elements;
+    // Byte offset of the first element in the file
+    long offset;
+    // The other half of a CSR pair, or -1
+    long link;
+    long reserved;
+} dataset_section;
+
+// Everything a reader needs to get at the file, copied to each nodelet
+typedef struct dataset_source {
+    char path[DATASET_PATH_BYTES];
+    long mode;
+    // Native only
+    int fd;
+    const char * map;
+} dataset_source;
+
+typedef struct dataset {
+    dataset_source source;
+    long file_bytes;
+    dataset_header header;
+    dataset_section sections[DATASET_MAX_SECTIONS];
+} dataset;
+
+static inline const char *
+dataset_mode_name(long mode)
+{
+    switch (mode) {
+        case DATASET_READ_STREAM: return "stream";
+        case DATASET_READ_PREAD: return "pread";
+        case DATASET_READ_MMAP: return "mmap";
+        default: return "unknown";
+    }
+}
+
+// Returns the read mode with this name, or -1
+static inline long
+dataset_parse_mode(const char * name)
+{
+    for (long mode = DATASET_READ_STREAM; mode <= DATASET_READ_MMAP; ++mode) {
+        if (!strcmp(name, dataset_mode_name(mode))) { return mode; }
+    }
+    return -1;
+}
+
+// Checks the section table against itself and the size of the file
+static inline bool
+dataset_check_sections(dataset * ds)
+{
+    for (long s = 0; s < ds->header.num_sections; ++s) {
+        dataset_section * section = &ds->sections[s];
+        section->name[DATASET_NAME_BYTES - 1] = '\0';
+        long size = section->element_size;
+        if (size != 1 && size != 2 && size != 4 && size != 8) {
+            LOG_ERROR("Section %s has unsupported element size %li\n", section->name, size);
+            return false;
+        }
+        // Data starts after the section table, and the size is checked without overflowing
+        long data_begin = sizeof(dataset_header) + ds->header.num_sections * sizeof(dataset_section);
+        if (section->num_elements <= 0 || section->offset < data_begin || section->offset > ds->file_bytes
+            || section->offset % ds->header.alignment != 0
+            || section->num_elements > (ds->file_bytes - section->offset) / size) {
+            LOG_ERROR("Section %s is empty, misaligned or outside the data of the file\n", section->name);
+            return false;
+        }
+        if (section->kind == DATASET_COLUMN) { continue; }
+        long link = section->link;
+        long other_kind = section->kind == DATASET_CSR_OFFSETS ? DATASET_CSR_INDICES : DATASET_CSR_OFFSETS;
+        if (section->kind != DATASET_CSR_OFFSETS && section->kind != DATASET_CSR_INDICES) {
+            LOG_ERROR("Section %s has unknown kind %li\n", section->name, section->kind);
+            return false;
+        }
+        if (size != 8 || link < 0 || link >= ds->header.num_sections
+            || ds->sections[link].kind != other_kind || ds->sections[link].link != s) {
+            LOG_ERROR("CSR section %s must have 8-byte elements and a matching link\n", section->name);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads the header and section table. Returns false if the file is missing or malformed.
+static inline bool
+dataset_open(dataset * ds, const char * path, long mode)
+{
+    memset(ds, 0, sizeof(dataset));
+    ds->source.fd = -1;
+    ds->source.mode = mode;
+    if (strlen(path) >= DATASET_PATH_BYTES) {
+        LOG_ERROR("Dataset path is too long\n");
+        return false;
+    }
+    strcpy(ds->source.path, path);
+#ifdef __le64__
+    if (mode != DATASET_READ_STREAM) {
+        LOG_ERROR("Only the stream read mode is supported on Emu hardware\n");
+        return false;
+    }
+#endif
+
+    FILE * f = fopen(path, "rb");
+    if (f == NULL) {
+        LOG_ERROR("Failed to open dataset %s\n", path);
+        return false;
+    }
+    bool ok = fread(&ds->header, sizeof(dataset_header), 1, f) == 1
+        && !memcmp(ds->header.magic, dataset_magic, sizeof(dataset_magic))
+        && ds->header.version == DATASET_VERSION
+        && ds->header.num_sections > 0 && ds->header.num_sections <= DATASET_MAX_SECTIONS
+        && ds->header.alignment >= 8 && (ds->header.alignment & (ds->header.alignment - 1)) == 0
+        && fread(ds->sections, sizeof(dataset_section), ds->header.num_sections, f)
+            == (size_t)ds->header.num_sections
+        && fseek(f, 0, SEEK_END) == 0;
+    ds->file_bytes = ok ? ftell(f) : 0;
+    fclose(f);
+    if (!ok) {
+        LOG_ERROR("%s is not a version %i dataset with at most %i sections\n",
+            path, DATASET_VERSION, DATASET_MAX_SECTIONS);
+        return false;
+    }
+    if (!dataset_check_sections(ds)) { return false; }
+
+#ifndef __le64__
+    if (mode == DATASET_READ_PREAD || mode == DATASET_READ_MMAP) {
+        ds->source.fd = open(path, O_RDONLY);
+        if (ds->source.fd < 0) {
+            LOG_ERROR("Failed to open dataset %s\n", path);
+            return false;
+        }
+    }
+    if (mode == DATASET_READ_MMAP) {
+        void * map = mmap(NULL, ds->file_bytes, PROT_READ, MAP_SHARED, ds->source.fd, 0);
+        if (map == MAP_FAILED) {
+            LOG_ERROR("Failed to map dataset %s\n", path);
+            close(ds->source.fd);
+            return false;
+        }
+        ds->source.map = map;
+    }
+#endif
+    return true;
+}
+
+static inline void
+dataset_close(dataset * ds)
+{
+#ifndef __le64__
+    if (ds->source.map) { munmap((void*)ds->source.map, ds->file_bytes); }
+    if (ds->source.fd >= 0) { close(ds->source.fd); }
+#endif
+    ds->source.map = NULL;
+    ds->source.fd = -1;
+}
+
+// Returns the index of the section with this name, or -1
+static inline long
+dataset_find(dataset * ds, const char * name)
+{
+    for (long s = 0; s < ds->header.num_sections; ++s) {
+        if (!strcmp(ds->sections[s].name, name)) { return s; }
+    }
+    return -1;
+}
+
+// Reads bytes [offset, offset + bytes) of the file into dst, one block at a time
+static inline bool
+dataset_read(const dataset_source * source, long offset, char * dst, long bytes)
+{
+    switch (source->mode) {
+        case DATASET_READ_STREAM: {
+            FILE * f = fopen(source->path, "rb");
+            if (f == NULL) { return false; }
+            bool ok = fseek(f, offset, SEEK_SET) == 0;
+            for (long done = 0; ok && done < bytes; done += DATASET_BLOCK_BYTES) {
+                size_t len = bytes - done < DATASET_BLOCK_BYTES ? bytes - done : DATASET_BLOCK_BYTES;
+                ok = fread(dst + done, 1, len, f) == len;
+            }
+            fclose(f);
+            return ok;
+        }
+#ifndef __le64__
+        case DATASET_READ_PREAD: {
+            long done = 0;
+            while (done < bytes) {
+                size_t len = bytes - done < DATASET_BLOCK_BYTES ? bytes - done : DATASET_BLOCK_BYTES;
+                ssize_t got = pread(source->fd, dst + done, len, offset + done);
+                if (got <= 0) { return false; }
+                done += got;
+            }
+            return true;
+        }
+        case DATASET_READ_MMAP:
+            memcpy(dst, source->map + offset, bytes);
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+static void
+dataset_reader(const dataset_source * source, long offset, char * dst, long bytes, long * errors)
+{
+    if (!dataset_read(source, offset, dst, bytes)) {
+        REMOTE_ADD(errors, 1);
+    }
+}
+
+// Runs on the nodelet that owns [begin, end) of the array
+static void
+dataset_load_nodelet(const dataset_source * remote_source, const dataset_section * remote_section,
+    emu_chunked_array * array, long begin, long end, long readers, long * errors)
+{
+    // Copy the source here, so the readers don't migrate back to nodelet 0 for every access
+    dataset_source source = *remote_source;
+    dataset_section section = *remote_section;
+    long n = end - begin;
+    for (long r = 0; r < readers; ++r) {
+        long first = begin + r * n / readers;
+        long last = begin + (r + 1) * n / readers;
+        if (first == last) { continue; }
+        cilk_spawn dataset_reader(&source,
+            section.offset + first * section.element_size,
+            (char*)emu_chunked_array_index(array, first),
+            (last - first) * section.element_size,
+            errors);
+    }
+    cilk_sync;
+}
+
+// Allocates a chunked array with room for a section
+static inline void
+dataset_alloc(dataset * ds, long s, emu_chunked_array * array)
+{
+    emu_chunked_array_replicated_init(array, ds->sections[s].num_elements, ds->sections[s].element_size);
+}
+
+// Reads a section into an array from dataset_alloc(). Returns false if any read failed.
+static inline bool
+dataset_load(dataset * ds, long s, emu_chunked_array * array, long readers_per_nodelet)
+{
+    long n = ds->sections[s].num_elements;
+    long chunk = 1L << array->log2_elements_per_chunk;
+    long errors = 0;
+    for (long begin = 0; begin < n; begin += chunk) {
+        long end = begin + chunk < n ? begin + chunk : n;
+        cilk_spawn_at(emu_chunked_array_index(array, begin)) dataset_load_nodelet(
+            &ds->source, &ds->sections[s], array, begin, end, readers_per_nodelet, &errors);
+    }
+    cilk_sync;
+    return errors == 0;
+}
+
+// Element i of a loaded section, as a long
+static inline long
+dataset_get(emu_chunked_array * array, long i)
+{
+    void * p = emu_chunked_array_index(array, i);
+    switch (array->element_size) {
+        case 1: return *(signed char*)p;
+        case 2: return *(short*)p;
+        case 4: return *(int*)p;
+        default: return *(long*)p;
+    }
+}
@@ -0,0 +1,149 @@
+#!/usr/bin/env python2.7
+
+"""
+Writes dataset files for the dataset_load benchmark (the format is described in dataset.h).
+
+Usage:
+    dataset.py edges <edge_list> <output>             CSR graph from a text edge list ("src dst" per line)
+    dataset.py random <output> <log2_num_elements> [num_columns]
+                                                      Columns of random 64-bit integers
+    dataset.py info <dataset>                         Print the section table
+
+Lines of the edge list that start with '#' or '%' are comments, so SNAP and Matrix Market edge lists work
+as they are. Vertex ids are used as given, the number of vertices is the largest id + 1.
+"""
+
+import os
+import sys
+import struct
+from array import array
+
+MAGIC = b"EMUDSET1"
+VERSION = 1
+MAX_SECTIONS = 16
+NAME_BYTES = 48
+ALIGNMENT = 4096
+
+COLUMN, CSR_OFFSETS, CSR_INDICES = range(3)
+KIND_NAMES = ["column", "csr_offsets", "csr_indices"]
+
+HEADER = struct.Struct("<8sqqq")
+SECTION = struct.Struct("<{}sqqqqqq".format(NAME_BYTES))
+
+def int64_array(values=()):
+    """An array of 8-byte integers, whichever type code that is on this Python"""
+    for code in ["q", "l"]:
+        try:
+            a = array(code)
+        except ValueError:
+            continue
+        if a.itemsize == 8:
+            a.extend(values)
+            return a
+    raise RuntimeError("No 8-byte array type")
+
+def align(offset):
+    return (offset + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+
+def write_dataset(path, sections):
+    """Write a dataset. sections is a list of (name, kind, link, data) with data an int64_array."""
+    assert 0 < len(sections) <= MAX_SECTIONS
+    offsets = []
+    offset = align(HEADER.size + SECTION.size * len(sections))
+    for name, kind, link, data in sections:
+        assert len(name) < NAME_BYTES and len(data) > 0
+        offsets.append(offset)
+        offset = align(offset + len(data) * data.itemsize)
+
+    # Write to a temporary file and rename it into place, so readers never see a partial dataset
+    tmp_path = path + ".tmp"
+    with open(tmp_path, "wb") as f:
+        f.write(HEADER.pack(MAGIC, VERSION, len(sections), ALIGNMENT))
+        for (name, kind, link, data), offset in zip(sections, offsets):
+            f.write(SECTION.pack(name.encode("ascii"), kind, data.itemsize, len(data), offset, link, 0))
+        for (name, kind, link, data), offset in zip(sections, offsets):
+            f.seek(offset)
+            if sys.byteorder != "little":
+                data = array(data.typecode, data)
+                data.byteswap()
+            data.tofile(f)
+    os.rename(tmp_path, path)
+
+def read_sections(path):
+    """Returns the section table of a dataset as a list of dicts"""
+    with open(path, "rb") as f:
+        magic, version, num_sections, alignment = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC or version != VERSION:
+            raise ValueError("{} is not a version {} dataset".format(path, VERSION))
+        sections = []
+        for _ in range(num_sections):
+            name, kind, element_size, num_elements, offset, link, _ = SECTION.unpack(f.read(SECTION.size))
+            sections.append({
+                "name" : name.rstrip(b"\0").decode("ascii"),
+                "kind" : kind,
+                "element_size" : element_size,
+                "num_elements" : num_elements,
+                "offset" : offset,
+                "link" : link,
+            })
+        return sections
+
+def csr_from_edges(path):
+    """Builds CSR offsets and indices from a text edge list, with a counting sort on the source vertex"""
+    src = int64_array()
+    dst = int64_array()
+    with open(path) as f:
+        for line in f:
+            if not line.strip() or line[0] in "#%":
+                continue
+            fields = line.split()
+            src.append(int(fields[0]))
+            dst.append(int(fields[1]))
+    if len(src) == 0:
+        raise ValueError("{} has no edges".format(path))
+    num_vertices = max(max(src), max(dst)) + 1
+
+    offsets = int64_array([0] * (num_vertices + 1))
+    for s in src:
+        offsets[s + 1] += 1
+    for v in range(num_vertices):
+        offsets[v + 1] += offsets[v]
+    cursor = int64_array(offsets[:-1])
+    indices = int64_array([0] * len(src))
+    for s, d in zip(src, dst):
+        indices[cursor[s]] = d
+        cursor[s] += 1
+    return offsets, indices
+
+def random_column(n):
+    """n random 64-bit integers"""
+    data = int64_array()
+    if hasattr(data, "frombytes"):
+        data.frombytes(os.urandom(n * 8))
+    else:
+        data.fromstring(os.urandom(n * 8))
+    return data
+
+def main():
+    if len(sys.argv) >= 4 and sys.argv[1] == "edges":
+        offsets, indices = csr_from_edges(sys.argv[2])
+        write_dataset(sys.argv[3], [
+            ("graph.offsets", CSR_OFFSETS, 1, offsets),
+            ("graph.indices", CSR_INDICES, 0, indices),
+        ])
+        print("Wrote {} vertices and {} edges to {}".format(len(offsets) - 1, len(indices), sys.argv[3]))
+    elif len(sys.argv) >= 4 and sys.argv[1] == "random":
+        n = 1 << int(sys.argv[3])
+        num_columns = int(sys.argv[4]) if len(sys.argv) > 4 else 1
+        write_dataset(sys.argv[2], [("col{}".format(c), COLUMN, -1, random_column(n)) for c in range(num_columns)])
+        print("Wrote {} columns of {} elements to {}".format(num_columns, n, sys.argv[2]))
+    elif len(sys.argv) == 3 and sys.argv[1] == "info":
+        for s in read_sections(sys.argv[2]):
+            print("{name}: {kind_name}, {num_elements} x {element_size} bytes at {offset}".format(
+                kind_name=KIND_NAMES[s["kind"]] if 0 <= s["kind"] < len(KIND_NAMES) else "unknown", **s))
+    else:
+        print(__doc__)
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
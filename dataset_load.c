@@ -0,0 +1,220 @@
+#ifndef __le64__
+// For pread() with -std=c11
+#define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+#include <emu_c_utils/emu_c_utils.h>
+
+#include "common.h"
+#include "dataset.h"
+
+/*
+ * Goal: Measure how fast a dataset file (see dataset.h and dataset.py) can be loaded into distributed arrays.
+ * Each section is read into an emu_chunked_array, with every nodelet reading its own chunk from the file.
+ */
+
+typedef struct dataset_load_data {
+    dataset ds;
+    long readers_per_nodelet;
+    // Sections to load, and the array each one goes into
+    long num_loaded;
+    long loaded[DATASET_MAX_SECTIONS];
+    emu_chunked_array arrays[DATASET_MAX_SECTIONS];
+} dataset_load_data;
+
+replicated dataset_load_data data;
+
+// dataset_load() reads the source and section table on every nodelet, so copy them from nodelet 0
+void
+dataset_load_replicate(dataset_load_data * data)
+{
+#ifdef __le64__
+    data = mw_get_nth(data, 0);
+    for (long i = 1; i < NODELETS(); ++i) {
+        dataset_load_data * remote_data = mw_get_nth(data, i);
+        memcpy(remote_data, data, sizeof(dataset_load_data));
+    }
+#endif
+}
+
+long
+dataset_load_bytes(dataset_load_data * data)
+{
+    long bytes = 0;
+    for (long i = 0; i < data->num_loaded; ++i) {
+        dataset_section * section = &data->ds.sections[data->loaded[i]];
+        bytes += section->num_elements * section->element_size;
+    }
+    return bytes;
+}
+
+void
+dataset_load_run(dataset_load_data * data, long num_trials)
+{
+    long bytes = dataset_load_bytes(data);
+    hooks_set_attr_i64("bytes", bytes);
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        hooks_region_begin("load");
+        bool ok = true;
+        for (long i = 0; i < data->num_loaded; ++i) {
+            ok = dataset_load(&data->ds, data->loaded[i], &data->arrays[i], data->readers_per_nodelet) && ok;
+        }
+        double time_ms = hooks_region_end();
+        runtime_assert(ok, "Failed to read dataset");
+        double bytes_per_second = time_ms == 0 ? 0 : bytes / (time_ms / 1000);
+        LOG("%3.2f MB/s\n", bytes_per_second / (1000000));
+    }
+}
+
+// Compares a loaded section with a serial read of the file
+bool
+dataset_validate_section(dataset * ds, long s, emu_chunked_array * array)
+{
+    dataset_section * section = &ds->sections[s];
+    FILE * f = fopen(ds->source.path, "rb");
+    runtime_assert(f != NULL, "Failed to open dataset for validation");
+    char * buffer = malloc(DATASET_BLOCK_BYTES);
+    runtime_assert(buffer != NULL, "Failed to allocate validation buffer");
+    bool ok = fseek(f, section->offset, SEEK_SET) == 0;
+    long per_block = DATASET_BLOCK_BYTES / section->element_size;
+    for (long begin = 0; ok && begin < section->num_elements; begin += per_block) {
+        long end = begin + per_block < section->num_elements ? begin + per_block : section->num_elements;
+        ok = fread(buffer, section->element_size, end - begin, f) == (size_t)(end - begin);
+        for (long i = begin; ok && i < end; ++i) {
+            if (memcmp(emu_chunked_array_index(array, i),
+                buffer + (i - begin) * section->element_size, section->element_size)) {
+                LOG_ERROR("VALIDATION ERROR: element %li of section %s doesn't match the file\n", i, section->name);
+                ok = false;
+            }
+        }
+    }
+    free(buffer);
+    fclose(f);
+    return ok;
+}
+
+// Checks that a CSR graph is well formed: offsets run from 0 to the number of edges, and edges point at vertices
+bool
+dataset_validate_csr(emu_chunked_array * offsets, emu_chunked_array * indices)
+{
+    long num_vertices = offsets->num_elements - 1;
+    long num_edges = indices->num_elements;
+    if (dataset_get(offsets, 0) != 0 || dataset_get(offsets, num_vertices) != num_edges) {
+        LOG_ERROR("VALIDATION ERROR: CSR offsets don't span the %li edges\n", num_edges);
+        return false;
+    }
+    for (long v = 0; v < num_vertices; ++v) {
+        if (dataset_get(offsets, v + 1) < dataset_get(offsets, v)) {
+            LOG_ERROR("VALIDATION ERROR: CSR offsets decrease at vertex %li\n", v);
+            return false;
+        }
+    }
+    for (long e = 0; e < num_edges; ++e) {
+        long dst = dataset_get(indices, e);
+        if (dst < 0 || dst >= num_vertices) {
+            LOG_ERROR("VALIDATION ERROR: edge %li points at vertex %li\n", e, dst);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+dataset_load_validate(dataset_load_data * data)
+{
+    for (long i = 0; i < data->num_loaded; ++i) {
+        if (!dataset_validate_section(&data->ds, data->loaded[i], &data->arrays[i])) { return false; }
+    }
+    for (long i = 0; i < data->num_loaded; ++i) {
+        dataset_section * section = &data->ds.sections[data->loaded[i]];
+        if (section->kind != DATASET_CSR_OFFSETS) { continue; }
+        for (long j = 0; j < data->num_loaded; ++j) {
+            if (data->loaded[j] != section->link) { continue; }
+            if (!dataset_validate_csr(&data->arrays[i], &data->arrays[j])) { return false; }
+            LOG("Section %s is a valid CSR graph\n", section->name);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* mode;
+        const char* path;
+        long num_trials;
+        long readers_per_nodelet;
+        const char* section;
+    } args;
+
+    args.readers_per_nodelet = take_long_option(&argc, argv, "readers_per_nodelet", 1);
+    args.section = take_string_option(&argc, argv, "section", NULL);
+
+    if (argc != 4) {
+        LOG("Usage: %s mode path num_trials [--readers_per_nodelet R] [--section name]\n", argv[0]);
+        exit(1);
+    } else {
+        args.mode = argv[1];
+        args.path = argv[2];
+        args.num_trials = atol(argv[3]);
+
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+        if (args.readers_per_nodelet <= 0) { LOG("readers_per_nodelet must be > 0"); exit(1); }
+    }
+
+    long mode = dataset_parse_mode(args.mode);
+    if (mode < 0) {
+        LOG("Mode %s not implemented!\n", args.mode);
+        exit(1);
+    }
+
+    hooks_set_attr_str("mode", args.mode);
+    hooks_set_attr_str("dataset", args.path);
+    hooks_set_attr_i64("readers_per_nodelet", args.readers_per_nodelet);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+
+    if (!dataset_open(&data.ds, args.path, mode)) { exit(1); }
+    data.readers_per_nodelet = args.readers_per_nodelet;
+    data.num_loaded = 0;
+    for (long s = 0; s < data.ds.header.num_sections; ++s) {
+        dataset_section * section = &data.ds.sections[s];
+        if (args.section && strcmp(section->name, args.section)) { continue; }
+        LOG("Section %s: %li elements of %li bytes\n", section->name, section->num_elements, section->element_size);
+        data.loaded[data.num_loaded++] = s;
+    }
+    if (data.num_loaded == 0) {
+        LOG("Dataset %s has no section named %s\n", args.path, args.section);
+        exit(1);
+    }
+
+    LOG("Allocating arrays for %li MiB\n", dataset_load_bytes(&data) / (1024*1024));
+    for (long i = 0; i < data.num_loaded; ++i) {
+        dataset_alloc(&data.ds, data.loaded[i], &data.arrays[i]);
+    }
+    dataset_load_replicate(&data);
+
+    LOG("Loading %s with %s reads\n", args.path, args.mode);
+    dataset_load_run(&data, args.num_trials);
+
+#ifndef NO_VALIDATE
+    LOG("Validating results...");
+    hooks_region_begin("validate");
+    bool ok = dataset_load_validate(&data);
+    hooks_region_end();
+    runtime_assert(ok, "Validation failed");
+    LOG("OK\n");
+#endif
+
+    for (long i = 0; i < data.num_loaded; ++i) {
+        emu_chunked_array_replicated_deinit(&data.arrays[i]);
+    }
+    dataset_close(&data.ds);
+    return 0;
+}
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+#include <emu_c_utils/emu_c_utils.h>
+
+#include "common.h"
+#include "rng.h"
+#include "nodelet_timing.h"
+#include "occupancy.h"
+
+/*
+ * Goal: Measure stream compaction (filter), which writes a variable amount of output.
+ * Each element of a chunked input array passes the predicate with probability selectivity.
+ * Strategies for placing the output:
+ * - atomic_cursor     - one output cursor on nodelet 0, every match bumps it with an atomic add
+ * - prefix_sum        - each thread filters into its own local buffer, then the counts are prefix-summed
+ *                       and each thread copies its buffer to its offset in the output (preserves order)
+ * - per_nodelet_chunk - each nodelet appends to its own output chunk with a local cursor
+ */
+
+// Values are uniform in [0, VALUE_RANGE), elements below the threshold pass
+#define VALUE_RANGE 1000000L
+
+enum filter_mode {
+    ATOMIC_CURSOR,
+    PREFIX_SUM,
+    PER_NODELET_CHUNK
+};
+
+typedef struct filter_data {
+    emu_chunked_array array_in;
+    emu_chunked_array array_out;
+    long ** in;
+    long ** out;
+    long n;
+    long num_threads;
+    long grain;
+    long threshold;
+    long mode;
+    // atomic_cursor: number of elements written to the output
+    long cursor;
+    // per_nodelet_chunk: number of elements written to each output chunk (striped)
+    long * nodelet_cursors;
+    // prefix_sum: one buffer per thread, allocated next to its part of the input
+    long ** buffers;
+    // prefix_sum: number of matches of each thread, then its offset in the output,
+    // followed by the total (striped)
+    long * counts;
+} filter_data;
+
+replicated filter_data data;
+
+// #define INDEX(PTR, BLOCK, I) (PTR[I/BLOCK][I%BLOCK])
+#define INDEX(PTR, BLOCK, I) (PTR[I >> PRIORITY(BLOCK)][I&(BLOCK-1)])
+
+static noinline void
+init_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    long * a = emu_chunked_array_index(array, begin);
+    for (long i = 0; i < end - begin; ++i) {
+        a[i] = rng_below(rng_at(0, 0, begin + i), VALUE_RANGE);
+    }
+}
+
+void
+filter_init(filter_data * data, enum filter_mode mode, long n, long num_threads, long threshold)
+{
+    data->n = n;
+    data->num_threads = num_threads;
+    // Keep each thread within one chunk, and the thread ranges aligned to the grain,
+    // so a thread's buffer can be found from the start of its range
+    long block_sz = n / NODELETS();
+    long grain = n / num_threads > 0 ? n / num_threads : 1;
+    if (grain > block_sz) { grain = block_sz; }
+    data->grain = 1L << PRIORITY(grain);
+    data->threshold = threshold;
+    data->mode = mode;
+    data->cursor = 0;
+    emu_chunked_array_replicated_init(&data->array_in, n, sizeof(long));
+    data->in = (long**)data->array_in.data;
+    // Big enough for every element to pass
+    emu_chunked_array_replicated_init(&data->array_out, n, sizeof(long));
+    data->out = (long**)data->array_out.data;
+    data->nodelet_cursors = mw_malloc1dlong(NODELETS());
+    runtime_assert(data->nodelet_cursors != NULL, "Failed to allocate cursors");
+
+    data->buffers = NULL;
+    data->counts = NULL;
+    if (mode == PREFIX_SUM) {
+        long num_buffers = n / data->grain;
+        data->buffers = (long**)mw_malloc1dlong(num_buffers);
+        data->counts = mw_malloc1dlong(num_buffers + 1);
+        runtime_assert(data->buffers && data->counts, "Failed to allocate per-thread buffers");
+        for (long t = 0; t < num_buffers; ++t) {
+            // Each buffer lives on the same nodelet as the part of the input it filters
+            data->buffers[t] = mw_localmalloc(data->grain * sizeof(long),
+                emu_chunked_array_index(&data->array_in, t * data->grain));
+            runtime_assert(data->buffers[t] != NULL, "Failed to allocate per-thread buffer");
+        }
+    }
+
+#ifdef __le64__
+    // Replicate pointers to all other nodelets
+    data = mw_get_nth(data, 0);
+    for (long i = 1; i < NODELETS(); ++i) {
+        filter_data * remote_data = mw_get_nth(data, i);
+        memcpy(remote_data, data, sizeof(filter_data));
+    }
+#endif
+
+    emu_chunked_array_apply(&data->array_in, GLOBAL_GRAIN(n), init_worker);
+}
+
+void
+filter_deinit(filter_data * data)
+{
+    if (data->mode == PREFIX_SUM) {
+        long num_buffers = data->n / data->grain;
+        for (long t = 0; t < num_buffers; ++t) {
+            mw_localfree(data->buffers[t]);
+        }
+        mw_free(data->buffers);
+        mw_free(data->counts);
+    }
+    mw_free(data->nodelet_cursors);
+    emu_chunked_array_replicated_deinit(&data->array_in);
+    emu_chunked_array_replicated_deinit(&data->array_out);
+}
+
+void
+filter_reset(filter_data * data)
+{
+    *(long*)mw_get_nth(&data->cursor, 0) = 0;
+    for (long i = 0; i < NODELETS(); ++i) {
+        data->nodelet_cursors[i] = 0;
+    }
+}
+
+static noinline void
+atomic_cursor_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    long nlet = nodelet_timer_leaf_begin();
+    filter_data * data = va_arg(args, filter_data *);
+    long * cursor = mw_get_nth(&data->cursor, 0);
+    long block_sz = data->n / NODELETS();
+    long * in = emu_chunked_array_index(array, begin);
+    for (long i = 0; i < end - begin; ++i) {
+        long value = in[i];
+        if (value < data->threshold) {
+            long pos = ATOMIC_ADDMS(cursor, 1);
+            INDEX(data->out, block_sz, pos) = value;
+        }
+    }
+    nodelet_timer_leaf_end(nlet);
+}
+
+void
+filter_atomic_cursor(filter_data * data)
+{
+    emu_chunked_array_apply(&data->array_in, data->grain,
+        atomic_cursor_worker, data
+    );
+}
+
+static noinline void
+buffer_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    long nlet = nodelet_timer_leaf_begin();
+    filter_data * data = va_arg(args, filter_data *);
+    long t = begin / data->grain;
+    long * buffer = data->buffers[t];
+    long * in = emu_chunked_array_index(array, begin);
+    long count = 0;
+    for (long i = 0; i < end - begin; ++i) {
+        long value = in[i];
+        buffer[count] = value;
+        // Branch-free append, the write is always local
+        count += value < data->threshold;
+    }
+    data->counts[t] = count;
+    nodelet_timer_leaf_end(nlet);
+}
+
+static noinline void
+copy_out_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    long nlet = nodelet_timer_leaf_begin();
+    filter_data * data = va_arg(args, filter_data *);
+    long t = begin / data->grain;
+    long * buffer = data->buffers[t];
+    long offset = data->counts[t];
+    long count = data->counts[t + 1] - offset;
+    long block_sz = data->n / NODELETS();
+    for (long i = 0; i < count; ++i) {
+        long j = offset + i;
+        INDEX(data->out, block_sz, j) = buffer[i];
+    }
+    nodelet_timer_leaf_end(nlet);
+}
+
+void
+filter_prefix_sum(filter_data * data)
+{
+    // Filter into the per-thread buffers
+    emu_chunked_array_apply(&data->array_in, data->grain,
+        buffer_worker, data
+    );
+    // Exclusive scan of the counts, there is one per thread so this is short
+    long num_buffers = data->n / data->grain;
+    long total = 0;
+    for (long t = 0; t < num_buffers; ++t) {
+        long count = data->counts[t];
+        data->counts[t] = total;
+        total += count;
+    }
+    data->counts[num_buffers] = total;
+    *(long*)mw_get_nth(&data->cursor, 0) = total;
+    // Copy each buffer to its offset in the output
+    emu_chunked_array_apply(&data->array_in, data->grain,
+        copy_out_worker, data
+    );
+}
+
+static noinline void
+per_nodelet_chunk_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    long nlet = nodelet_timer_leaf_begin();
+    filter_data * data = va_arg(args, filter_data *);
+    long block_sz = data->n / NODELETS();
+    // The output chunk and cursor for the nodelet that holds this part of the input
+    long chunk = begin / block_sz;
+    long * out = data->out[chunk];
+    long * cursor = &data->nodelet_cursors[chunk];
+    long * in = emu_chunked_array_index(array, begin);
+    for (long i = 0; i < end - begin; ++i) {
+        long value = in[i];
+        if (value < data->threshold) {
+            out[ATOMIC_ADDMS(cursor, 1)] = value;
+        }
+    }
+    nodelet_timer_leaf_end(nlet);
+}
+
+void
+filter_per_nodelet_chunk(filter_data * data)
+{
+    emu_chunked_array_apply(&data->array_in, data->grain,
+        per_nodelet_chunk_worker, data
+    );
+}
+
+// Number of elements in the output
+long
+filter_output_count(filter_data * data)
+{
+    if (data->mode == PER_NODELET_CHUNK) {
+        long count = 0;
+        for (long i = 0; i < NODELETS(); ++i) { count += data->nodelet_cursors[i]; }
+        return count;
+    }
+    return *(long*)mw_get_nth(&data->cursor, 0);
+}
+
+static noinline void
+expected_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    filter_data * data = va_arg(args, filter_data *);
+    long * count = va_arg(args, long*);
+    long * sum = va_arg(args, long*);
+    long * in = emu_chunked_array_index(array, begin);
+    long local_count = 0, local_sum = 0;
+    for (long i = 0; i < end - begin; ++i) {
+        if (in[i] < data->threshold) {
+            local_count += 1;
+            local_sum += in[i];
+        }
+    }
+    REMOTE_ADD(count, local_count);
+    REMOTE_ADD(sum, local_sum);
+}
+
+// Check the number and sum of the elements in the output, returns the sum
+long
+filter_validate(filter_data * data)
+{
+    long expected_count = 0, expected_sum = 0;
+    emu_chunked_array_apply(&data->array_in, GLOBAL_GRAIN_MIN(data->n, 64),
+        expected_worker, data, &expected_count, &expected_sum
+    );
+    long count = filter_output_count(data);
+    if (count != expected_count) {
+        LOG_ERROR("VALIDATION ERROR: %li elements in output (supposed to be %li)\n", count, expected_count);
+        exit(1);
+    }
+    long block_sz = data->n / NODELETS();
+    long sum = 0;
+    if (data->mode == PER_NODELET_CHUNK) {
+        for (long c = 0; c < NODELETS(); ++c) {
+            for (long i = 0; i < data->nodelet_cursors[c]; ++i) { sum += data->out[c][i]; }
+        }
+    } else {
+        for (long i = 0; i < count; ++i) { sum += INDEX(data->out, block_sz, i); }
+    }
+    if (sum != expected_sum) {
+        LOG_ERROR("VALIDATION ERROR: sum of output is %li (supposed to be %li)\n", sum, expected_sum);
+        exit(1);
+    }
+    return sum;
+}
+
+void filter_run(
+    filter_data * data,
+    const char * name,
+    void (*benchmark)(filter_data *),
+    long num_trials)
+{
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        filter_reset(data);
+        nodelet_timer_reset();
+        hooks_region_begin(name);
+        nodelet_timer_start();
+        OCCUPANCY_RUN(benchmark(data));
+        double time_ms = hooks_region_end();
+        long count = filter_output_count(data);
+        double in_bytes_per_second = time_ms == 0 ? 0 :
+            (data->n * sizeof(long)) / (time_ms/1000);
+        double out_bytes_per_second = time_ms == 0 ? 0 :
+            (count * sizeof(long)) / (time_ms/1000);
+        LOG("%3.2f MB/s in, %3.2f MB/s out (%li elements passed)\n",
+            in_bytes_per_second / (1000000), out_bytes_per_second / (1000000), count);
+        nodelet_timer_report(NODELETS());
+        occupancy_report();
+#ifndef NO_VALIDATE
+        hooks_region_begin("validate");
+        long checksum = filter_validate(data);
+        hooks_set_attr_i64("checksum", checksum);
+        hooks_region_end();
+#endif
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* mode;
+        double selectivity;
+        long log2_num_elements;
+        long num_threads;
+        long num_trials;
+    } args;
+
+    if (argc != 6) {
+        LOG("Usage: %s mode selectivity log2_num_elements num_threads num_trials\n", argv[0]);
+        exit(1);
+    } else {
+        args.mode = argv[1];
+        args.selectivity = atof(argv[2]);
+        args.log2_num_elements = atol(argv[3]);
+        args.num_threads = atol(argv[4]);
+        args.num_trials = atol(argv[5]);
+
+        if (args.selectivity < 0 || args.selectivity > 100) { LOG("selectivity must be a percentage"); exit(1); }
+        if (args.log2_num_elements <= 0) { LOG("log2_num_elements must be > 0"); exit(1); }
+        if (args.num_threads <= 0) { LOG("num_threads must be > 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+    }
+
+    enum filter_mode mode;
+    if (!strcmp(args.mode, "atomic_cursor")) {
+        mode = ATOMIC_CURSOR;
+    } else if (!strcmp(args.mode, "prefix_sum")) {
+        mode = PREFIX_SUM;
+    } else if (!strcmp(args.mode, "per_nodelet_chunk")) {
+        mode = PER_NODELET_CHUNK;
+    } else {
+        LOG("Mode %s not implemented!\n", args.mode);
+        exit(1);
+    }
+
+    long n = 1L << args.log2_num_elements;
+    runtime_assert(n >= NODELETS(), "Need at least one element per nodelet");
+    long threshold = (long)(args.selectivity / 100.0 * VALUE_RANGE);
+
+    hooks_set_attr_str("mode", args.mode);
+    hooks_set_attr_f64("selectivity", args.selectivity);
+    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
+    hooks_set_attr_i64("num_threads", args.num_threads);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+    hooks_set_attr_i64("num_bytes_per_element", sizeof(long));
+
+    LOG("Initializing arrays with %li elements each (%li MiB)\n", n, (n * sizeof(long)) / (1024*1024));
+    filter_init(&data, mode, n, args.num_threads, threshold);
+    nodelet_timer_init();
+    occupancy_init();
+
+    LOG("Filtering with %s, %3.1f%% selectivity\n", args.mode, args.selectivity);
+
+    #define RUN_BENCHMARK(X) filter_run(&data, args.mode, X, args.num_trials)
+
+    if (mode == ATOMIC_CURSOR) {
+        RUN_BENCHMARK(filter_atomic_cursor);
+    } else if (mode == PREFIX_SUM) {
+        RUN_BENCHMARK(filter_prefix_sum);
+    } else {
+        RUN_BENCHMARK(filter_per_nodelet_chunk);
+    }
+
+    filter_deinit(&data);
+    nodelet_timer_deinit();
+    occupancy_deinit();
+    return 0;
+}
@@ -65,6 +65,74 @@ def pass_args(arg_names):
     """Generate a template for a command line"""
     return "\n".join("--{0} {{{0}}} \\".format(a) for a in arg_names)
 
+def scaling_flags(args):
+    """Command line flags for weak-scaling (per_nodelet) and nodelet-count (num_nodelets) sweeps"""
+    flags = []
+    if args.get("per_nodelet", False):
+        flags.append("--per_nodelet")
+    if "num_nodelets" in args:
+        flags.append("--num_nodelets {}".format(args["num_nodelets"]))
+    return " ".join(flags)
+
+def snapshot_flags(args, local_config):
+    """Command line flags for the pointer_chase shuffle seed and index snapshots (native only)"""
+    flags = []
+    if "seed" in args:
+        flags.append("--seed {}".format(args["seed"]))
+    if local_config["platform"] == "native" and "snapshot_dir" in local_config:
+        flags.append("--snapshot_dir {}".format(local_config["snapshot_dir"]))
+    return " ".join(flags)
+
+def find_flags(args):
+    """Command line flags for global_find"""
+    flags = []
+    if args.get("any_of", False):
+        flags.append("--any_of")
+    if "poll_interval" in args:
+        flags.append("--poll_interval {}".format(args["poll_interval"]))
+    return " ".join(flags)
+
+def limit_flags(args):
+    """Command line flags for thread_limit"""
+    flags = []
+    if "contexts_per_nodelet" in args:
+        flags.append("--contexts_per_nodelet {}".format(args["contexts_per_nodelet"]))
+    if "max_factor" in args:
+        flags.append("--max_factor {}".format(args["max_factor"]))
+    return " ".join(flags)
+
+def stack_flags(args):
+    """Command line flags for the spawn_rate call depth and stack frame size"""
+    flags = []
+    for name in ["call_depth", "frame_bytes", "num_migrations"]:
+        if name in args:
+            flags.append("--{} {}".format(name, args[name]))
+    return " ".join(flags)
+
+def datagen_flags(args):
+    """Command line flags for the datagen generator parameters"""
+    flags = []
+    for name in ["seed", "log2_range", "zipf_exponent", "run_length", "disorder", "rmat_scale"]:
+        if name in args:
+            flags.append("--{} {}".format(name, args[name]))
+    return " ".join(flags)
+
+def load_flags(args):
+    """Command line flags for dataset_load"""
+    flags = []
+    for name in ["readers_per_nodelet", "section"]:
+        if name in args:
+            flags.append("--{} {}".format(name, args[name]))
+    return " ".join(flags)
+
+def multinode_flags(args):
+    """Command line flags for the emulated node count and size of multinode"""
+    flags = []
+    for name in ["num_nodes", "nodelets_per_node"]:
+        if name in args:
+            flags.append("--{} {}".format(name, args[name]))
+    return " ".join(flags)
+
 def generate_script(args, script_dir, out_dir, local_config, no_redirect, no_algs):
     """Generate a script to run the experiment specified by the independent variables in args"""
 
@@ -84,7 +152,29 @@ def generate_script(args, script_dir, out_dir, local_config, no_redirect, no_alg
         # Additional result files can be created here
         "outdir" : out_dir,
         # All other program output goes here
-        "logfile" : "/dev/stderr" if no_redirect else "{0}/{1}.log".format(out_dir, str(args))
+        "logfile" : "/dev/stderr" if no_redirect else "{0}/{1}.log".format(out_dir, str(args)),
+        # Optional weak/strong scaling flags
+        "scaling_flags" : scaling_flags(args),
+        # Optional number of replicated levels for tree_lookup
+        "tree_flags" : "--replicated_levels {}".format(args["replicated_levels"]) if "replicated_levels" in args else "",
+        # Optional linear step for the ping_pong thread sweep
+        "sweep_flags" : "--step {}".format(args["step"]) if "step" in args else "",
+        # Optional any_of flag and poll interval for global_find
+        "find_flags" : find_flags(args),
+        # Optional thread context count and maximum oversubscription for thread_limit
+        "limit_flags" : limit_flags(args),
+        # Optional call depth, stack frame size and migration count for spawn_rate
+        "stack_flags" : stack_flags(args),
+        # Optional seed and snapshot directory for pointer_chase
+        "snapshot_flags" : snapshot_flags(args, local_config),
+        # Optional generator parameters for datagen
+        "datagen_flags" : datagen_flags(args),
+        # Dataset file for dataset_load, relative to dataset_dir
+        "dataset_path" : os.path.join(local_config.get("dataset_dir", "."), args.get("dataset", "")),
+        # Optional reader count and section for dataset_load
+        "load_flags" : load_flags(args),
+        # Optional node count and nodelets per node for multinode
+        "multinode_flags" : multinode_flags(args),
     })
 
     # Add params from local_config
@@ -136,18 +226,98 @@ def generate_script(args, script_dir, out_dir, local_config, no_redirect, no_alg
         -o {outdir}/{name} \\
         -- {exe} \\"""
 
-    if args.benchmark in ["local_stream", "global_stream", "global_stream_1d", "local_stream_cxx"]:
+    if args.benchmark in ["local_stream", "local_stream_cxx"]:
         # Generate the benchmark command line
         template += """
         {spawn_mode} {log2_num_elements} {num_threads} 1 \\
         &>> $LOGFILE
         """
+    elif args.benchmark in ["global_stream", "global_stream_1d", "global_reduce"]:
+        # Generate the benchmark command line
+        template += """
+        {spawn_mode} {log2_num_elements} {num_threads} 1 {scaling_flags} \\
+        &>> $LOGFILE
+        """
     elif args.benchmark in ["global_stream_cxx"]:
         # Generate the benchmark command line
         template += """
         {spawn_mode} {layout} {log2_num_elements} {num_threads} 1 \\
         &>> $LOGFILE
         """
+    elif args.benchmark == "replicated_lookup":
+        # Generate the benchmark command line
+        template += """
+        {mode} {log2_table_size} {log2_num_elements} {num_threads} 1 \\
+        --lookups_per_element {lookups_per_element} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "tree_lookup":
+        # Generate the benchmark command line
+        template += """
+        {mode} {fanout} {num_levels} {log2_num_lookups} {num_threads} 1 {tree_flags} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "skip_list":
+        # Generate the benchmark command line
+        template += """
+        {mode} {log2_num_keys} {log2_num_ops} {num_threads} 1 \\
+        --insert_percent {insert_percent} --skew {skew} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "global_find":
+        # Generate the benchmark command line
+        template += """
+        {mode} {layout} {target} {log2_num_elements} {num_threads} 1 {find_flags} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "filter":
+        # Generate the benchmark command line
+        template += """
+        {mode} {selectivity} {log2_num_elements} {num_threads} 1 \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "ping_pong":
+        # Generate the benchmark command line
+        template += """
+        {mode} {log2_num_migrations} {num_threads} 1 {sweep_flags} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "co_run":
+        # Generate the benchmark command line
+        template += """
+        {kernel_a} {kernel_b} {placement} {log2_num_elements} {num_threads} 1 \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "datagen":
+        # Generate the benchmark command line
+        template += """
+        {generator} {layout} {log2_num_elements} 1 {datagen_flags} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "dataset_load":
+        # Generate the benchmark command line
+        template += """
+        {mode} {dataset_path} 1 {load_flags} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "multinode":
+        # Generate the benchmark command line
+        template += """
+        {mode} {log2_num_elements} {num_threads} 1 {multinode_flags} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "spawn_rate":
+        # Generate the benchmark command line
+        template += """
+        {mode} {log2_num_elements} {num_threads} 1 {stack_flags} \\
+        &>> $LOGFILE
+        """
+    elif args.benchmark == "thread_limit":
+        # Generate the benchmark command line
+        template += """
+        {mode} {log2_work} 1 {limit_flags} \\
+        &>> $LOGFILE
+        """
     elif args.benchmark == "pointer_chase":
         # Generate the benchmark command line
         template += """
@@ -157,6 +327,8 @@ def generate_script(args, script_dir, out_dir, local_config, no_redirect, no_alg
         --spawn_mode {spawn_mode} \\
         --sort_mode {sort_mode} \\
         --num_trials {num_trials} \\
+        {scaling_flags} \\
+        {snapshot_flags} \\
         &>> $LOGFILE
         """
 
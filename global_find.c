@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+
+#include "common.h"
+
+#include <emu_c_utils/emu_c_utils.h>
+#include "nodelet_timing.h"
+#include "occupancy.h"
+
+/*
+ * Goal: Measure how quickly thousands of threads can be stopped once one of them finds the answer.
+ * Searches an array of zeros for the single element set to one, with the target placed at the beginning,
+ * middle or end of the array, or absent. find_first returns the lowest matching index, any_of stops at
+ * the first match found by any thread.
+ * Each nodelet runs a recursive spawn tree over its part of the array. Cancellation modes:
+ * - no_cancel       - every thread scans its whole range (baseline)
+ * - single_flag     - threads poll a flag on nodelet 0 every poll_interval elements
+ * - replicated_flag - threads poll the copy of a replicated flag on their own nodelet, the finder writes every copy
+ * - spawn_check     - Cilk-style cancellation: the local flag is only checked at spawn points,
+ *                     so no new work starts after the target is found, but running leaves finish their range
+ */
+
+enum layout {
+    CHUNKED,
+    STRIPED
+};
+
+enum cancel_mode {
+    NO_CANCEL,
+    SINGLE_FLAG,
+    REPLICATED_FLAG,
+    SPAWN_CHECK
+};
+
+typedef struct global_find_data {
+    emu_chunked_array array;
+    // Chunked layout: chunk i holds elements [i * per_nodelet, (i+1) * per_nodelet)
+    long ** chunks;
+    // Striped layout: nodelet i holds elements i, i + NODELETS(), ...
+    long * striped;
+    long layout;
+    long n;
+    long per_nodelet;
+    long grain;
+    // Index of the element to find, -1 if absent
+    long target;
+    long cancel_mode;
+    long any_of;
+    long poll_interval;
+    // Lowest index found so far, LONG_MAX if none
+    long found;
+    // Number of elements scanned on each nodelet (striped)
+    long * scanned;
+} global_find_data;
+
+replicated global_find_data data;
+
+static inline long *
+element_ptr(global_find_data * data, long nlet, long p)
+{
+    if (data->layout == CHUNKED) {
+        return &data->chunks[nlet][p];
+    } else {
+        return &data->striped[p * NODELETS() + nlet];
+    }
+}
+
+static inline long
+global_index(global_find_data * data, long nlet, long p)
+{
+    if (data->layout == CHUNKED) {
+        return nlet * data->per_nodelet + p;
+    } else {
+        return p * NODELETS() + nlet;
+    }
+}
+
+// Flag read by the polling threads
+static inline long *
+flag_ptr(global_find_data * data)
+{
+    if (data->cancel_mode == SINGLE_FLAG) {
+        return mw_get_nth(&data->found, 0);
+    } else {
+        return mw_get_nth(&data->found, NODE_ID());
+    }
+}
+
+// Should a thread that is about to look at index i give up?
+static inline bool
+should_stop(global_find_data * data, long i)
+{
+    long found = *flag_ptr(data);
+    return data->any_of ? found != LONG_MAX : found < i;
+}
+
+static void
+report_found(global_find_data * data, long i)
+{
+    atomic_min_long(mw_get_nth(&data->found, 0), i);
+    if (data->cancel_mode == REPLICATED_FLAG || data->cancel_mode == SPAWN_CHECK) {
+        for (long nlet = 1; nlet < NODELETS(); ++nlet) {
+            atomic_min_long(mw_get_nth(&data->found, nlet), i);
+        }
+    }
+}
+
+static noinline void
+find_leaf(global_find_data * data, long nlet, long begin, long end)
+{
+    long timer_nlet = nodelet_timer_leaf_begin();
+    bool poll = data->cancel_mode == SINGLE_FLAG || data->cancel_mode == REPLICATED_FLAG;
+    long interval = poll ? data->poll_interval : end - begin;
+    long p = begin;
+    while (p < end) {
+        if (poll && should_stop(data, global_index(data, nlet, p))) { break; }
+        long stop = p + interval < end ? p + interval : end;
+        for (; p < stop; ++p) {
+            if (*element_ptr(data, nlet, p) == 1) { break; }
+        }
+        if (p < stop) {
+            report_found(data, global_index(data, nlet, p));
+            // Everything after this in the range has a higher index
+            p += 1;
+            break;
+        }
+    }
+    REMOTE_ADD(&data->scanned[nlet], p - begin);
+    nodelet_timer_leaf_end(timer_nlet);
+}
+
+static noinline void
+find_tree(global_find_data * data, long nlet, long begin, long end)
+{
+    for (;;) {
+        if (data->cancel_mode == SPAWN_CHECK && should_stop(data, global_index(data, nlet, begin))) { return; }
+        long count = end - begin;
+        if (count <= data->grain) { break; }
+        long mid = begin + count / 2;
+        cilk_spawn find_tree(data, nlet, mid, end);
+        end = mid;
+    }
+    find_leaf(data, nlet, begin, end);
+}
+
+noinline void
+global_find_run_search(global_find_data * data)
+{
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        cilk_spawn_at(element_ptr(data, nlet, 0)) find_tree(data, nlet, 0, data->per_nodelet);
+    }
+    cilk_sync;
+}
+
+void
+replicated_init_ptr(long ** ptr, long * val)
+{
+    mw_replicated_init((long*)ptr, (long)val);
+}
+
+static void
+clear_worker(long * array, long begin, long end, va_list args)
+{
+    const long nodelets = NODELETS();
+    for (long i = begin; i < end; i += nodelets) {
+        array[i] = 0;
+    }
+}
+
+static noinline void
+clear_chunked_worker(emu_chunked_array * array, long begin, long end, va_list args)
+{
+    long * a = emu_chunked_array_index(array, begin);
+    for (long i = 0; i < end - begin; ++i) {
+        a[i] = 0;
+    }
+}
+
+void
+global_find_init(global_find_data * data, enum layout layout, long n, long num_threads, long target,
+    enum cancel_mode cancel_mode, bool any_of, long poll_interval)
+{
+    mw_replicated_init(&data->layout, layout);
+    mw_replicated_init(&data->n, n);
+    mw_replicated_init(&data->per_nodelet, n / NODELETS());
+    mw_replicated_init(&data->grain, n / num_threads > 0 ? n / num_threads : 1);
+    mw_replicated_init(&data->target, target);
+    mw_replicated_init(&data->cancel_mode, cancel_mode);
+    mw_replicated_init(&data->any_of, any_of);
+    mw_replicated_init(&data->poll_interval, poll_interval);
+    replicated_init_ptr(&data->scanned, mw_malloc1dlong(NODELETS()));
+    runtime_assert(data->scanned != NULL, "Failed to allocate counters");
+
+    if (layout == CHUNKED) {
+        emu_chunked_array_replicated_init(&data->array, n, sizeof(long));
+        replicated_init_ptr((long**)&data->chunks, (long*)data->array.data);
+        replicated_init_ptr(&data->striped, NULL);
+        emu_chunked_array_apply(&data->array, GLOBAL_GRAIN(n), clear_chunked_worker);
+    } else {
+        replicated_init_ptr((long**)&data->chunks, NULL);
+        replicated_init_ptr(&data->striped, mw_malloc1dlong(n));
+        runtime_assert(data->striped != NULL, "Failed to allocate array");
+        emu_1d_array_apply(data->striped, n, GLOBAL_GRAIN(n), clear_worker);
+    }
+    if (target >= 0) {
+        long nlet, p;
+        if (layout == CHUNKED) {
+            nlet = target / data->per_nodelet;
+            p = target % data->per_nodelet;
+        } else {
+            nlet = target % NODELETS();
+            p = target / NODELETS();
+        }
+        *element_ptr(data, nlet, p) = 1;
+    }
+}
+
+void
+global_find_deinit(global_find_data * data)
+{
+    if (data->layout == CHUNKED) {
+        emu_chunked_array_replicated_deinit(&data->array);
+    } else {
+        mw_free(data->striped);
+    }
+    mw_free(data->scanned);
+}
+
+void
+global_find_reset(global_find_data * data)
+{
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        *(long*)mw_get_nth(&data->found, nlet) = LONG_MAX;
+        data->scanned[nlet] = 0;
+    }
+}
+
+void
+global_find_run(global_find_data * data, const char * name, long num_trials)
+{
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        global_find_reset(data);
+        nodelet_timer_reset();
+        hooks_region_begin(name);
+        nodelet_timer_start();
+        OCCUPANCY_RUN(global_find_run_search(data));
+        double time_ms = hooks_region_end();
+
+        long found = *(long*)mw_get_nth(&data->found, 0);
+        long scanned = 0;
+        for (long nlet = 0; nlet < NODELETS(); ++nlet) { scanned += data->scanned[nlet]; }
+#ifndef NO_VALIDATE
+        long expected = data->target < 0 ? LONG_MAX : data->target;
+        if (found != expected) {
+            LOG_ERROR("VALIDATION ERROR: found %li (supposed to be %li)\n", found, expected);
+            exit(1);
+        }
+#endif
+        double bytes_per_second = time_ms == 0 ? 0 :
+            (scanned * sizeof(long)) / (time_ms/1000);
+        LOG("%3.2f MB/s, scanned %3.2f%% of the array\n",
+            bytes_per_second / (1000000), 100.0 * scanned / data->n);
+        nodelet_timer_report(NODELETS());
+        occupancy_report();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* mode;
+        const char* layout;
+        const char* target;
+        long log2_num_elements;
+        long num_threads;
+        long num_trials;
+        bool any_of;
+        long poll_interval;
+    } args;
+
+    args.any_of = take_flag(&argc, argv, "any_of");
+    args.poll_interval = take_long_option(&argc, argv, "poll_interval", 64);
+
+    if (argc != 7) {
+        LOG("Usage: %s mode layout target log2_num_elements num_threads num_trials [--any_of] [--poll_interval K]\n", argv[0]);
+        exit(1);
+    } else {
+        args.mode = argv[1];
+        args.layout = argv[2];
+        args.target = argv[3];
+        args.log2_num_elements = atol(argv[4]);
+        args.num_threads = atol(argv[5]);
+        args.num_trials = atol(argv[6]);
+
+        if (args.log2_num_elements <= 0) { LOG("log2_num_elements must be > 0"); exit(1); }
+        if (args.num_threads <= 0) { LOG("num_threads must be > 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+        if (args.poll_interval <= 0) { LOG("poll_interval must be > 0"); exit(1); }
+    }
+
+    enum cancel_mode cancel_mode;
+    if (!strcmp(args.mode, "no_cancel")) {
+        cancel_mode = NO_CANCEL;
+    } else if (!strcmp(args.mode, "single_flag")) {
+        cancel_mode = SINGLE_FLAG;
+    } else if (!strcmp(args.mode, "replicated_flag")) {
+        cancel_mode = REPLICATED_FLAG;
+    } else if (!strcmp(args.mode, "spawn_check")) {
+        cancel_mode = SPAWN_CHECK;
+    } else {
+        LOG("Mode %s not implemented!\n", args.mode);
+        exit(1);
+    }
+
+    enum layout layout;
+    if (!strcmp(args.layout, "chunked")) {
+        layout = CHUNKED;
+    } else if (!strcmp(args.layout, "striped")) {
+        layout = STRIPED;
+    } else {
+        LOG("Layout %s not implemented!\n", args.layout);
+        exit(1);
+    }
+
+    long n = 1L << args.log2_num_elements;
+    runtime_assert(n >= NODELETS(), "Need at least one element per nodelet");
+    long target;
+    if (!strcmp(args.target, "begin")) {
+        target = 0;
+    } else if (!strcmp(args.target, "middle")) {
+        target = n / 2;
+    } else if (!strcmp(args.target, "end")) {
+        target = n - 1;
+    } else if (!strcmp(args.target, "absent")) {
+        target = -1;
+    } else {
+        LOG("Target %s not implemented!\n", args.target);
+        exit(1);
+    }
+
+    hooks_set_attr_str("mode", args.mode);
+    hooks_set_attr_str("layout", args.layout);
+    hooks_set_attr_str("target", args.target);
+    hooks_set_attr_i64("any_of", args.any_of);
+    hooks_set_attr_i64("poll_interval", args.poll_interval);
+    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
+    hooks_set_attr_i64("num_threads", args.num_threads);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+    hooks_set_attr_i64("num_bytes_per_element", sizeof(long));
+
+    LOG("Initializing %s array with %li elements (%li MiB)\n",
+        args.layout, n, (n * sizeof(long)) / (1024*1024));
+    global_find_init(&data, layout, n, args.num_threads, target, cancel_mode, args.any_of, args.poll_interval);
+    nodelet_timer_init();
+    occupancy_init();
+
+    LOG("Searching with %s, target at %s\n", args.mode, args.target);
+    global_find_run(&data, args.mode, args.num_trials);
+
+    global_find_deinit(&data);
+    nodelet_timer_deinit();
+    occupancy_deinit();
+    return 0;
+}
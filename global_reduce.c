@@ -8,12 +8,18 @@
 #include <emu_c_utils/emu_c_utils.h>
 
 #include "common.h"
+#include "scaling.h"
+#include "nodelet_timing.h"
+#include "locality.h"
+#include "occupancy.h"
 
 typedef struct global_reduce_data {
     emu_chunked_array array_a;
     long ** a;
     long n;
     long num_threads;
+    // Only the first num_nodelets chunks of the array are used
+    long num_nodelets;
 } global_reduce_data;
 
 
@@ -24,8 +30,11 @@ void
 global_reduce_init(global_reduce_data * data, long n)
 {
     data->n = n;
-    emu_chunked_array_replicated_init(&data->array_a, n, sizeof(long));
+    // Size the array so that all n elements land on the first num_nodelets chunks
+    long alloc_n = scaling_alloc_elements(n, data->num_nodelets);
+    emu_chunked_array_replicated_init(&data->array_a, alloc_n, sizeof(long));
     data->a = (long**)data->array_a.data;
+    LOCALITY_REGISTER_CHUNKED(&data->array_a);
 
 #ifdef __le64__
     // Replicate pointers to all other nodelets
@@ -42,6 +51,7 @@ global_reduce_init(global_reduce_data * data, long n)
 void
 global_reduce_deinit(global_reduce_data * data)
 {
+    LOCALITY_UNREGISTER_CHUNKED(&data->array_a);
     emu_chunked_array_replicated_deinit(&data->array_a);
 }
 
@@ -50,7 +60,7 @@ long
 global_reduce_add_serial(global_reduce_data * data)
 {
     long sum = 0;
-    long block_sz = data->n / NODELETS();
+    long block_sz = data->n / data->num_nodelets;
     for (long i = 0; i < data->n; ++i) {
         sum += INDEX(data->a, block_sz, i);
     }
@@ -60,13 +70,16 @@ global_reduce_add_serial(global_reduce_data * data)
 static noinline void
 global_reduce_add_emu_apply_worker(emu_chunked_array * array, long begin, long end, va_list args)
 {
+    long nlet = nodelet_timer_leaf_begin();
     long * sum = va_arg(args, long*);
     long * a = emu_chunked_array_index(array, begin);
+    LOCALITY_ENTER(a);
     long local_sum = 0;
     for (long i = 0; i < end-begin; ++i) {
-        local_sum += a[i];
+        local_sum += LOCALITY_READ(a[i]);
     }
-    REMOTE_ADD(sum, local_sum);
+    REMOTE_ADD(LOCALITY_REMOTE(sum), local_sum);
+    nodelet_timer_leaf_end(nlet);
 }
 
 // Use the apply from the library
@@ -75,9 +88,12 @@ long
 global_reduce_add_emu_apply(global_reduce_data * data)
 {
     long sum = 0;
+    // Every thread adds into this one
+    LOCALITY_REGISTER_LOCAL(&sum, sizeof(sum));
     emu_chunked_array_apply(&data->array_a, GLOBAL_GRAIN(data->n),
         global_reduce_add_emu_apply_worker, &sum
     );
+    LOCALITY_UNREGISTER(&sum);
     return sum;
 }
 
@@ -98,13 +114,18 @@ void global_reduce_run(
 {
     for (long trial = 0; trial < num_trials; ++trial) {
         hooks_set_attr_i64("trial", trial);
+        nodelet_timer_reset();
         hooks_region_begin(name);
-        long sum = benchmark(data);
+        nodelet_timer_start();
+        long sum;
+        OCCUPANCY_RUN(sum = benchmark(data));
         double time_ms = hooks_region_end();
         runtime_assert(sum == data->n, "Validation FAILED!");
         double bytes_per_second = time_ms == 0 ? 0 :
             (data->n * sizeof(long)) / (time_ms/1000);
         LOG("%3.2f MB/s\n", bytes_per_second / (1000000));
+        nodelet_timer_report(NODELETS());
+        occupancy_report();
     }
 }
 
@@ -114,6 +135,8 @@ replicated global_reduce_data data;
 
 int main(int argc, char** argv)
 {
+    scaling_args scaling = parse_scaling_args(&argc, argv);
+
     struct {
         const char* mode;
         long log2_num_elements;
@@ -122,7 +145,7 @@ int main(int argc, char** argv)
     } args;
 
     if (argc != 5) {
-        LOG("Usage: %s mode log2_num_elements num_threads num_trials\n", argv[0]);
+        LOG("Usage: %s mode log2_num_elements num_threads num_trials [--per_nodelet] [--num_nodelets M]\n", argv[0]);
         exit(1);
     } else {
         args.mode = argv[1];
@@ -135,13 +158,22 @@ int main(int argc, char** argv)
         if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
     }
 
-    long n = 1L << args.log2_num_elements;
+    long n = scaling_num_elements(&scaling, args.log2_num_elements);
+
+    hooks_set_attr_str("spawn_mode", args.mode);
+    hooks_set_attr_i64("num_threads", args.num_threads);
+    hooks_set_attr_i64("num_bytes_per_element", sizeof(long));
+    scaling_set_attrs(&scaling, n);
+
     long mbytes = n * sizeof(long) / (1024*1024);
-    long mbytes_per_nodelet = mbytes / NODELETS();
+    long mbytes_per_nodelet = mbytes / scaling.num_nodelets;
     LOG("Initializing arrays with %li elements each (%li MiB total, %li MiB per nodelet)\n", n, mbytes, mbytes_per_nodelet);
     fflush(stdout);
     data.num_threads = args.num_threads;
+    data.num_nodelets = scaling.num_nodelets;
     global_reduce_init(&data, n);
+    nodelet_timer_init();
+    occupancy_init();
     LOG("Doing vector addition using %s\n", args.mode); fflush(stdout);
 
     #define RUN_BENCHMARK(X) global_reduce_run(&data, args.mode, X, args.num_trials)
@@ -149,13 +181,17 @@ int main(int argc, char** argv)
     if (!strcmp(args.mode, "serial")) {
         RUN_BENCHMARK(global_reduce_add_serial);
     } else if (!strcmp(args.mode, "per_thread_remote")) {
+        runtime_assert(data.num_nodelets == NODELETS(), "per_thread_remote mode always spawns on every nodelet, can't use --num_nodelets");
         RUN_BENCHMARK(global_reduce_add_emu_apply);
     } else if (!strcmp(args.mode, "per_nodelet_remote")) {
+        runtime_assert(data.num_nodelets == NODELETS(), "per_nodelet_remote mode always spawns on every nodelet, can't use --num_nodelets");
         RUN_BENCHMARK(global_reduce_add_emu_reduce);
     } else {
         LOG("Mode %s not implemented!", args.mode);
     }
 
     global_reduce_deinit(&data);
+    nodelet_timer_deinit();
+    occupancy_deinit();
     return 0;
 }
@@ -10,6 +10,11 @@
 
 #include <emu_c_utils/emu_c_utils.h>
 #include "recursive_spawn.h"
+#include "scaling.h"
+#include "nodelet_timing.h"
+#include "occupancy.h"
+#include "trace.h"
+#include "locality.h"
 
 
 typedef struct global_stream_data {
@@ -21,6 +26,8 @@ typedef struct global_stream_data {
     long ** c;
     long n;
     long num_threads;
+    // Only the first num_nodelets chunks of each array are used
+    long num_nodelets;
 } global_stream_data;
 
 
@@ -31,12 +38,17 @@ void
 global_stream_init(global_stream_data * data, long n)
 {
     data->n = n;
-    emu_chunked_array_replicated_init(&data->array_a, n, sizeof(long));
+    // Size the arrays so that all n elements land on the first num_nodelets chunks
+    long alloc_n = scaling_alloc_elements(n, data->num_nodelets);
+    emu_chunked_array_replicated_init(&data->array_a, alloc_n, sizeof(long));
     data->a = (long**)data->array_a.data;
-    emu_chunked_array_replicated_init(&data->array_b, n, sizeof(long));
+    emu_chunked_array_replicated_init(&data->array_b, alloc_n, sizeof(long));
     data->b = (long**)data->array_b.data;
-    emu_chunked_array_replicated_init(&data->array_c, n, sizeof(long));
+    emu_chunked_array_replicated_init(&data->array_c, alloc_n, sizeof(long));
     data->c = (long**)data->array_c.data;
+    LOCALITY_REGISTER_CHUNKED(&data->array_a);
+    LOCALITY_REGISTER_CHUNKED(&data->array_b);
+    LOCALITY_REGISTER_CHUNKED(&data->array_c);
 
 #ifdef __le64__
     // Replicate pointers to all other nodelets
@@ -56,6 +68,9 @@ global_stream_init(global_stream_data * data, long n)
 void
 global_stream_deinit(global_stream_data * data)
 {
+    LOCALITY_UNREGISTER_CHUNKED(&data->array_a);
+    LOCALITY_UNREGISTER_CHUNKED(&data->array_b);
+    LOCALITY_UNREGISTER_CHUNKED(&data->array_c);
     emu_chunked_array_replicated_deinit(&data->array_a);
     emu_chunked_array_replicated_deinit(&data->array_b);
     emu_chunked_array_replicated_deinit(&data->array_c);
@@ -64,10 +79,13 @@ global_stream_deinit(global_stream_data * data)
 static noinline void
 global_stream_validate_worker(emu_chunked_array * array, long begin, long end, va_list args)
 {
+    // Skip the chunks that are not in use
+    long n = va_arg(args, long);
+    if (end > n) { end = n; }
     long * c = emu_chunked_array_index(array, begin);
     for (long i = 0; i < end - begin; ++i) {
         if (c[i] != 3) {
-            LOG("VALIDATION ERROR: c[%li] == %li (supposed to be 3)\n", begin + i, c[i]);
+            LOG_ERROR("VALIDATION ERROR: c[%li] == %li (supposed to be 3)\n", begin + i, c[i]);
             exit(1);
         }
     }
@@ -77,7 +95,7 @@ void
 global_stream_validate(global_stream_data * data)
 {
     emu_chunked_array_apply(&data->array_c, GLOBAL_GRAIN(data->n),
-        global_stream_validate_worker
+        global_stream_validate_worker, data->n
     );
 }
 
@@ -85,7 +103,7 @@ global_stream_validate(global_stream_data * data)
 void
 global_stream_add_serial(global_stream_data * data)
 {
-    long block_sz = data->n / NODELETS();
+    long block_sz = data->n / data->num_nodelets;
     for (long i = 0; i < data->n; ++i) {
         INDEX(data->c, block_sz, i) = INDEX(data->a, block_sz, i) + INDEX(data->b, block_sz, i);
     }
@@ -95,7 +113,7 @@ global_stream_add_serial(global_stream_data * data)
 void
 global_stream_add_cilk_for(global_stream_data * data)
 {
-    long block_sz = data->n / NODELETS();
+    long block_sz = data->n / data->num_nodelets;
     #pragma cilk grainsize = data->n / data->num_threads
     cilk_for (long i = 0; i < data->n; ++i) {
         INDEX(data->c, block_sz, i) = INDEX(data->a, block_sz, i) + INDEX(data->b, block_sz, i);
@@ -105,10 +123,12 @@ global_stream_add_cilk_for(global_stream_data * data)
 noinline void
 recursive_spawn_add_worker(long begin, long end, global_stream_data *data)
 {
-    long block_sz = data->n / NODELETS();
+    long nlet = nodelet_timer_leaf_begin();
+    long block_sz = data->n / data->num_nodelets;
     for (long i = begin; i < end; ++i) {
         INDEX(data->c, block_sz, i) = INDEX(data->a, block_sz, i) + INDEX(data->b, block_sz, i);
     }
+    nodelet_timer_leaf_end(nlet);
 }
 
 noinline void
@@ -140,9 +160,11 @@ global_stream_add_serial_spawn(global_stream_data * data)
 noinline void
 serial_remote_spawn_level2(long begin, long end, long * a, long * b, long * c)
 {
+    long nlet = nodelet_timer_leaf_begin();
     for (long i = begin; i < end; ++i) {
-        c[i] = a[i] + b[i];
+        LOCALITY_WRITE(c[i]) = LOCALITY_READ(a[i]) + LOCALITY_READ(b[i]);
     }
+    nodelet_timer_leaf_end(nlet);
 }
 
 noinline void
@@ -151,9 +173,9 @@ serial_remote_spawn_level1(long * a, long * b, long * c, long n, long grain)
     for (long i = 0; i < n; i += grain) {
         long begin = i;
         long end = begin + grain <= n ? begin + grain : n;
-        cilk_spawn serial_remote_spawn_level2(begin, end, a, b, c);
+        LOCALITY_SPAWN(serial_remote_spawn_level2(begin, end, a, b, c));
     }
-    cilk_sync;
+    LOCALITY_SYNC;
 }
 
 // serial_remote_spawn - remote spawn a thread on each nodelet, then do a serial spawn locally
@@ -161,22 +183,24 @@ void
 global_stream_add_serial_remote_spawn(global_stream_data * data)
 {
     // Each thread will be responsible for the elements on one nodelet
-    long local_n = data->n / NODELETS();
+    long local_n = data->n / data->num_nodelets;
     // Calculate the grain so we get the right number of threads globally
     long grain = data->n / data->num_threads;
     // Spawn a thread on each nodelet
-    for (long i = 0; i < NODELETS(); ++i) {
-        cilk_spawn_at(data->a[i]) serial_remote_spawn_level1(data->a[i], data->b[i], data->c[i], local_n, grain);
+    for (long i = 0; i < data->num_nodelets; ++i) {
+        LOCALITY_SPAWN_AT(data->a[i], serial_remote_spawn_level1(data->a[i], data->b[i], data->c[i], local_n, grain));
     }
-    cilk_sync;
+    LOCALITY_SYNC;
 }
 
 noinline void
 recursive_remote_spawn_level2_worker(long begin, long end, long * a, long * b, long * c)
 {
+    long nlet = nodelet_timer_leaf_begin();
     for (long i = begin; i < end; ++i) {
         c[i] = a[i] + b[i];
     }
+    nodelet_timer_leaf_end(nlet);
 }
 
 noinline void
@@ -186,35 +210,40 @@ recursive_remote_spawn_level2(long begin, long end, long grain, long * a, long *
 }
 
 noinline void
-recursive_remote_spawn_level1(long low, long high, global_stream_data * data)
+recursive_remote_spawn_level1(long low, long high, global_stream_data * data TRACE_PARAM)
 {
+    trace_thread self = trace_start(TRACE_ID, "recursive_remote_spawn_level1");
     for (;;) {
         long count = high - low;
         if (count == 1) break;
         long mid = low + count / 2;
-        cilk_spawn_at(data->a[low]) recursive_remote_spawn_level1(low, mid, data);
+        long child = trace_spawn(&self);
+        cilk_spawn_at(data->a[low]) recursive_remote_spawn_level1(low, mid, data TRACE_ARG(child));
         low = mid;
     }
 
     /* Recursive base case: call worker function */
-    long local_n = data->n / NODELETS();
+    long local_n = data->n / data->num_nodelets;
     long grain = data->n / data->num_threads;
     recursive_remote_spawn_level2(0, local_n, grain, data->a[low], data->b[low], data->c[low]);
+    cilk_sync;
+    trace_finish(&self);
 }
 
 // recursive_remote_spawn - Recursively spawns threads to divice up the loop range, using remote spawns where possible.
 void
 global_stream_add_recursive_remote_spawn(global_stream_data * data)
 {
-    recursive_remote_spawn_level1(0, NODELETS(), data);
+    recursive_remote_spawn_level1(0, data->num_nodelets, data TRACE_ARG(trace_root()));
 }
 
 void
 global_stream_add_library_worker(emu_chunked_array * array, long begin, long end, va_list args)
 {
+    long nlet = nodelet_timer_leaf_begin();
     (void)array;
     global_stream_data * data = va_arg(args, global_stream_data *);
-    long block_sz = data->n / NODELETS();
+    long block_sz = data->n / data->num_nodelets;
 
     long * c = &INDEX(data->c, block_sz, begin);
     long * b = &INDEX(data->b, block_sz, begin);
@@ -223,6 +252,7 @@ global_stream_add_library_worker(emu_chunked_array * array, long begin, long end
     for (long i = 0; i < end-begin; ++i) {
         c[i] = a[i] + b[i];
     }
+    nodelet_timer_leaf_end(nlet);
 }
 
 void
@@ -237,20 +267,20 @@ global_stream_add_library(global_stream_data * data)
 void
 global_stream_add_serial_remote_spawn_shallow(global_stream_data * data)
 {
-    long local_n = data->n / NODELETS();
+    long local_n = data->n / data->num_nodelets;
     long grain = data->n / data->num_threads;
 
-    for (long i = 0; i < NODELETS(); ++i) {
+    for (long i = 0; i < data->num_nodelets; ++i) {
         long * a = data->a[i];
         long * b = data->b[i];
         long * c = data->c[i];
         for (long j = 0; j < local_n; j += grain) {
             long begin = j;
             long end = begin + grain <= local_n ? begin + grain : local_n;
-            cilk_spawn_at(a) serial_remote_spawn_level2(begin, end, a, b, c);
+            LOCALITY_SPAWN_AT(a, serial_remote_spawn_level2(begin, end, a, b, c));
         }
     }
-    cilk_sync;
+    LOCALITY_SYNC;
 }
 
 void global_stream_run(
@@ -261,12 +291,17 @@ void global_stream_run(
 {
     for (long trial = 0; trial < num_trials; ++trial) {
         hooks_set_attr_i64("trial", trial);
+        nodelet_timer_reset();
+        trace_reset();
         hooks_region_begin(name);
-        benchmark(data);
+        nodelet_timer_start();
+        OCCUPANCY_RUN(benchmark(data));
         double time_ms = hooks_region_end();
         double bytes_per_second = time_ms == 0 ? 0 :
             (data->n * sizeof(long) * 3) / (time_ms/1000);
         LOG("%3.2f MB/s\n", bytes_per_second / (1000000));
+        nodelet_timer_report(data->num_nodelets);
+        occupancy_report();
     }
 }
 
@@ -274,6 +309,8 @@ replicated global_stream_data data;
 
 int main(int argc, char** argv)
 {
+    scaling_args scaling = parse_scaling_args(&argc, argv);
+
     struct {
         const char* mode;
         long log2_num_elements;
@@ -282,7 +319,7 @@ int main(int argc, char** argv)
     } args;
 
     if (argc != 5) {
-        LOG("Usage: %s mode log2_num_elements num_threads num_trials\n", argv[0]);
+        LOG("Usage: %s mode log2_num_elements num_threads num_trials [--per_nodelet] [--num_nodelets M]\n", argv[0]);
         exit(1);
     } else {
         args.mode = argv[1];
@@ -295,19 +332,23 @@ int main(int argc, char** argv)
         if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
     }
 
+    long n = scaling_num_elements(&scaling, args.log2_num_elements);
+
     hooks_set_attr_str("spawn_mode", args.mode);
-    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
     hooks_set_attr_i64("num_threads", args.num_threads);
-    hooks_set_attr_i64("num_nodelets", NODELETS());
     hooks_set_attr_i64("num_bytes_per_element", sizeof(long) * 3);
+    scaling_set_attrs(&scaling, n);
 
-    long n = 1L << args.log2_num_elements;
     long mbytes = n * sizeof(long) / (1024*1024);
-    long mbytes_per_nodelet = mbytes / NODELETS();
+    long mbytes_per_nodelet = mbytes / scaling.num_nodelets;
     LOG("Initializing arrays with %li elements each (%li MiB total, %li MiB per nodelet)\n", 3 * n, 3 * mbytes, 3 * mbytes_per_nodelet);
     fflush(stdout);
     data.num_threads = args.num_threads;
+    data.num_nodelets = scaling.num_nodelets;
     global_stream_init(&data, n);
+    nodelet_timer_init();
+    occupancy_init();
+    trace_init();
     LOG("Doing vector addition using %s\n", args.mode); fflush(stdout);
 
     #define RUN_BENCHMARK(X) global_stream_run(&data, args.mode, X, args.num_trials)
@@ -317,18 +358,19 @@ int main(int argc, char** argv)
     } else if (!strcmp(args.mode, "serial_spawn")) {
         RUN_BENCHMARK(global_stream_add_serial_spawn);
     } else if (!strcmp(args.mode, "serial_remote_spawn")) {
-        runtime_assert(data.num_threads >= NODELETS(), "serial_remote_spawn mode will always use at least one thread per nodelet");
+        runtime_assert(data.num_threads >= data.num_nodelets, "serial_remote_spawn mode will always use at least one thread per nodelet");
         RUN_BENCHMARK(global_stream_add_serial_remote_spawn);
     } else if (!strcmp(args.mode, "serial_remote_spawn_shallow")) {
-        runtime_assert(data.num_threads >= NODELETS(), "serial_remote_spawn_shallow mode will always use at least one thread per nodelet");
+        runtime_assert(data.num_threads >= data.num_nodelets, "serial_remote_spawn_shallow mode will always use at least one thread per nodelet");
         RUN_BENCHMARK(global_stream_add_serial_remote_spawn_shallow);
     } else if (!strcmp(args.mode, "recursive_spawn")) {
         RUN_BENCHMARK(global_stream_add_recursive_spawn);
     } else if (!strcmp(args.mode, "recursive_remote_spawn")) {
-        runtime_assert(data.num_threads >= NODELETS(), "recursive_remote_spawn mode will always use at least one thread per nodelet");
+        runtime_assert(data.num_threads >= data.num_nodelets, "recursive_remote_spawn mode will always use at least one thread per nodelet");
         RUN_BENCHMARK(global_stream_add_recursive_remote_spawn);
     } else if (!strcmp(args.mode, "library")) {
         runtime_assert(data.num_threads >= NODELETS(), "emu_for_2d mode will always use at least one thread per nodelet");
+        runtime_assert(data.num_nodelets == NODELETS(), "library mode always spawns on every nodelet, can't use --num_nodelets");
         RUN_BENCHMARK(global_stream_add_library);
     } else if (!strcmp(args.mode, "serial")) {
         runtime_assert(data.num_threads == 1, "serial mode can only use one thread");
@@ -341,6 +383,11 @@ int main(int argc, char** argv)
     global_stream_validate(&data);
     LOG("OK\n");
 #endif
+    // Timeline of the last trial
+    trace_dump("global_stream.trace.json");
+    trace_deinit();
     global_stream_deinit(&data);
+    nodelet_timer_deinit();
+    occupancy_deinit();
     return 0;
 }
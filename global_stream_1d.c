@@ -9,6 +9,10 @@
 #include <emu_c_utils/emu_c_utils.h>
 #include "common.h"
 #include "recursive_spawn.h"
+#include "scaling.h"
+#include "nodelet_timing.h"
+#include "occupancy.h"
+#include "locality.h"
 
 typedef struct global_stream_data {
     long * a;
@@ -16,8 +20,15 @@ typedef struct global_stream_data {
     long * c;
     long n;
     long num_threads;
+    // Only the stripes on the first num_nodelets nodelets are used
+    long num_nodelets;
 } global_stream_data;
 
+// Maps logical element I onto the stripes of the first num_nodelets nodelets.
+// Reduces to I when the whole machine is in use.
+#define INDEX(DATA, I) \
+    ((((I) >> PRIORITY((DATA)->num_nodelets)) * NODELETS()) + ((I) & ((DATA)->num_nodelets - 1)))
+
 
 static void init_worker(long * array, long begin, long end, va_list args)
 {
@@ -40,12 +51,14 @@ void
 global_stream_init(global_stream_data * data, long n)
 {
     data->n = n;
+    // Size the arrays so that all n elements land on the first num_nodelets nodelets
+    long alloc_n = scaling_alloc_elements(n, data->num_nodelets);
 
-    replicated_init_ptr(&data->a, mw_malloc1dlong(n));
-    replicated_init_ptr(&data->b, mw_malloc1dlong(n));
-    replicated_init_ptr(&data->c, mw_malloc1dlong(n));
+    replicated_init_ptr(&data->a, mw_malloc1dlong(alloc_n));
+    replicated_init_ptr(&data->b, mw_malloc1dlong(alloc_n));
+    replicated_init_ptr(&data->c, mw_malloc1dlong(alloc_n));
 #ifndef NO_VALIDATE
-    emu_1d_array_apply(data->a, n, GLOBAL_GRAIN(n),
+    emu_1d_array_apply(data->a, alloc_n, GLOBAL_GRAIN(alloc_n),
         init_worker, data
     );
 #endif
@@ -63,9 +76,12 @@ static void
 global_stream_validate_worker(long * array, long begin, long end, va_list args)
 {
     const long nodelets = NODELETS();
+    // Skip the nodelets that are not in use
+    long num_nodelets = va_arg(args, long);
+    if (begin % nodelets >= num_nodelets) { return; }
     for (long i = begin; i < end; i += nodelets) {
         if (array[i] != 3) {
-            LOG("VALIDATION ERROR: c[%li] == %li (supposed to be 3)\n", i, array[i]);
+            LOG_ERROR("VALIDATION ERROR: c[%li] == %li (supposed to be 3)\n", i, array[i]);
             exit(1);
         }
     }
@@ -74,8 +90,9 @@ global_stream_validate_worker(long * array, long begin, long end, va_list args)
 void
 global_stream_validate(global_stream_data * data)
 {
-    emu_1d_array_apply(data->c, data->n, GLOBAL_GRAIN_MIN(data->n, 64),
-        global_stream_validate_worker
+    long alloc_n = scaling_alloc_elements(data->n, data->num_nodelets);
+    emu_1d_array_apply(data->c, alloc_n, GLOBAL_GRAIN_MIN(alloc_n, 64),
+        global_stream_validate_worker, data->num_nodelets
     );
 }
 
@@ -84,7 +101,9 @@ void
 global_stream_add_serial(global_stream_data * data)
 {
     for (long i = 0; i < data->n; ++i) {
-        data->c[i] = data->a[i] + data->b[i];
+        long j = INDEX(data, i);
+        long sum = LOCALITY_READ(data->a[j]) + LOCALITY_READ(data->b[j]);
+        LOCALITY_WRITE(data->c[j]) = sum;
     }
 }
 
@@ -94,16 +113,21 @@ global_stream_add_cilk_for(global_stream_data * data)
 {
     #pragma cilk grainsize = data->n / data->num_threads
     cilk_for (long i = 0; i < data->n; ++i) {
-        data->c[i] = data->a[i] + data->b[i];
+        long j = INDEX(data, i);
+        data->c[j] = data->a[j] + data->b[j];
     }
 }
 
 noinline void
 serial_spawn_add_worker(long begin, long end, global_stream_data *data)
 {
+    long nlet = nodelet_timer_leaf_begin();
     for (long i = begin; i < end; ++i) {
-        data->c[i] = data->a[i] + data->b[i];
+        long j = INDEX(data, i);
+        long sum = LOCALITY_READ(data->a[j]) + LOCALITY_READ(data->b[j]);
+        LOCALITY_WRITE(data->c[j]) = sum;
     }
+    nodelet_timer_leaf_end(nlet);
 }
 
 // serial_spawn - spawn one thread to handle each grain-sized chunk of the range
@@ -114,21 +138,26 @@ global_stream_add_serial_spawn(global_stream_data * data)
     for (long i = 0; i < data->n; i += grain) {
         long begin = i;
         long end = begin + grain <= data->n ? begin + grain : data->n;
-        cilk_spawn serial_spawn_add_worker(begin, end, data);
+        LOCALITY_SPAWN(serial_spawn_add_worker(begin, end, data));
     }
-    cilk_sync;
+    LOCALITY_SYNC;
 }
 
 
 static void
 global_stream_add_library_worker(long * array, long begin, long end, va_list args)
 {
+    long nlet = nodelet_timer_leaf_begin();
     (void)array;
     global_stream_data * data = va_arg(args, global_stream_data *);
     const long nodelets = NODELETS();
+    // The library spawns this worker next to array[begin]
+    LOCALITY_ENTER(&array[begin]);
     for (long i = begin; i < end; i += nodelets) {
-        data->c[i] = data->a[i] + data->b[i];
+        long sum = LOCALITY_READ(data->a[i]) + LOCALITY_READ(data->b[i]);
+        LOCALITY_WRITE(data->c[i]) = sum;
     }
+    nodelet_timer_leaf_end(nlet);
 }
 
 void
@@ -147,12 +176,16 @@ void global_stream_run(
 {
     for (long trial = 0; trial < num_trials; ++trial) {
         hooks_set_attr_i64("trial", trial);
+        nodelet_timer_reset();
         hooks_region_begin(name);
-        benchmark(data);
+        nodelet_timer_start();
+        OCCUPANCY_RUN(benchmark(data));
         double time_ms = hooks_region_end();
         double bytes_per_second = time_ms == 0 ? 0 :
             (data->n * sizeof(long) * 3) / (time_ms/1000);
         LOG("%3.2f MB/s\n", bytes_per_second / (1000000));
+        nodelet_timer_report(data->num_nodelets);
+        occupancy_report();
     }
 }
 
@@ -160,6 +193,8 @@ replicated global_stream_data data;
 
 int main(int argc, char** argv)
 {
+    scaling_args scaling = parse_scaling_args(&argc, argv);
+
     struct {
         const char* mode;
         long log2_num_elements;
@@ -168,7 +203,7 @@ int main(int argc, char** argv)
     } args;
 
     if (argc != 5) {
-        LOG("Usage: %s mode log2_num_elements num_threads num_trials\n", argv[0]);
+        LOG("Usage: %s mode log2_num_elements num_threads num_trials [--per_nodelet] [--num_nodelets M]\n", argv[0]);
         exit(1);
     } else {
         args.mode = argv[1];
@@ -181,19 +216,22 @@ int main(int argc, char** argv)
         if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
     }
 
+    long n = scaling_num_elements(&scaling, args.log2_num_elements);
+
     hooks_set_attr_str("spawn_mode", args.mode);
-    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
     hooks_set_attr_i64("num_threads", args.num_threads);
-    hooks_set_attr_i64("num_nodelets", NODELETS());
     hooks_set_attr_i64("num_bytes_per_element", sizeof(long) * 3);
+    scaling_set_attrs(&scaling, n);
 
-    long n = 1L << args.log2_num_elements;
     long mbytes = n * sizeof(long) / (1024*1024);
-    long mbytes_per_nodelet = mbytes / NODELETS();
+    long mbytes_per_nodelet = mbytes / scaling.num_nodelets;
     LOG("Initializing arrays with %li elements each (%li MiB total, %li MiB per nodelet)\n", 3 * n, 3 * mbytes, 3 * mbytes_per_nodelet);
     fflush(stdout);
     data.num_threads = args.num_threads;
+    data.num_nodelets = scaling.num_nodelets;
     global_stream_init(&data, n);
+    nodelet_timer_init();
+    occupancy_init();
     LOG("Doing vector addition using %s\n", args.mode); fflush(stdout);
 
     #define RUN_BENCHMARK(X) global_stream_run(&data, args.mode, X, args.num_trials)
@@ -204,6 +242,7 @@ int main(int argc, char** argv)
         RUN_BENCHMARK(global_stream_add_serial_spawn);
     } else if (!strcmp(args.mode, "library")) {
         runtime_assert(data.num_threads >= NODELETS(), "will always use at least one thread per nodelet");
+        runtime_assert(data.num_nodelets == NODELETS(), "library mode always spawns on every nodelet, can't use --num_nodelets");
         RUN_BENCHMARK(global_stream_add_library);
     } else if (!strcmp(args.mode, "serial")) {
         runtime_assert(data.num_threads == 1, "serial mode can only use one thread");
@@ -218,5 +257,7 @@ int main(int argc, char** argv)
 #endif
 
     global_stream_deinit(&data);
+    nodelet_timer_deinit();
+    occupancy_deinit();
     return 0;
 }
@@ -9,6 +9,7 @@
 
 #include "recursive_spawn.h"
 #include "common.h"
+#include "rng.h"
 
 typedef struct local_sort_data {
     long * array;
@@ -26,7 +27,8 @@ init_array_worker(long begin, long end, va_list args)
 {
     long * array = va_arg(args, long*);
     for (long i = begin; i < end; ++i) {
-        array[i] = rand();
+        // Same range as rand()
+        array[i] = rng_at(0, 0, i) >> 33;
     }
 }
 
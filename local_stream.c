@@ -133,7 +133,7 @@ local_stream_validate_worker(long begin, long end, va_list args)
     long * c = va_arg(args, long*);
     for (long i = begin; i < end; ++i) {
         if (c[i] != 3) {
-            LOG("VALIDATION ERROR: c[%li] == %li (supposed to be 3)\n", i, c[i]);
+            LOG_ERROR("VALIDATION ERROR: c[%li] == %li (supposed to be 3)\n", i, c[i]);
             exit(1);
         }
     }
@@ -0,0 +1,425 @@
+#pragma once
+
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+
+/*
+ * Locality emulation for native builds (configure with -DENABLE_LOCALITY_EMULATION=ON).
+ *
+ * The native build runs the same code as the Emu build, but says nothing about where the data is.
+ * With emulation enabled, this header tracks the nodelet of each logical thread, and maps every
+ * instrumented access onto the nodelet that would own it on Emu:
+ *  - mw_malloc1dlong - element i is on nodelet i % LOCALITY_NODELETS
+ *  - mw_malloc2d     - block i is on nodelet i % LOCALITY_NODELETS
+ *  - mw_mallocrepl   - every nodelet has a copy, so accesses are always local
+ *  - mw_localmalloc  - the whole block is on the nodelet that owns the pointer argument
+ *  - anything else (malloc, stack, replicated globals) is treated as local
+ * A read (LOCALITY_READ) from another nodelet is a migration, after which the thread is on that nodelet.
+ * A write (LOCALITY_WRITE) or remote atomic (LOCALITY_REMOTE) to another nodelet is a remote write.
+ * A spawn (LOCALITY_SPAWN_AT) on another nodelet is a remote spawn.
+ * The counts for each region are attached to its record as the locality_migrations, locality_remote_writes
+ * and locality_remote_spawns attributes.
+ *
+ * Each region also gets a hotspot report: the accesses (reads and writes) and arrivals (migrations and remote spawns)
+ * that land on each nodelet, and the spawns issued from each nodelet. The skew of each count (max / mean over the
+ * nodelets, 1 for an even spread and LOCALITY_NODELETS when one nodelet gets everything) is attached as the
+ * locality_access_skew, locality_arrival_skew and locality_spawn_skew attributes, and the busiest nodelet as
+ * locality_hot_nodelet. Allocations made inside emu_c_utils (such as emu_chunked_array) are only
+ * tracked after LOCALITY_REGISTER_CHUNKED.
+ *
+ * The number of emulated nodelets comes from the LOCALITY_NODELETS environment variable (default 8).
+ * Each Cilk worker tracks the nodelet of the strand it is running, so every spawn and sync in the
+ * instrumented code must go through LOCALITY_SPAWN, LOCALITY_SPAWN_AT and LOCALITY_SYNC.
+ * The counts are exact with CILK_NWORKERS=1. With more workers, a function that returns after an implicit
+ * sync may resume on a worker with a stale nodelet. Accesses through mw_get_nth() and threads spawned by
+ * emu_c_utils library calls are not tracked (use LOCALITY_ENTER at the start of library workers).
+ *
+ * On Emu, or without emulation, all the macros compile down to the plain access, spawn or sync.
+ */
+
+#if defined(LOCALITY_EMULATION) && !defined(__le64__)
+
+#include <pthread.h>
+
+typedef enum locality_layout {
+    LOCALITY_STRIPED,
+    // Table of block pointers returned by mw_malloc2d, striped like LOCALITY_STRIPED
+    LOCALITY_TABLE,
+    LOCALITY_BLOCKED,
+    LOCALITY_REPLICATED,
+    LOCALITY_LOCAL,
+} locality_layout;
+
+// A registered allocation, covering [begin, end)
+typedef struct locality_range {
+    char * begin;
+    char * end;
+    long layout;
+    // Element size for LOCALITY_STRIPED and LOCALITY_BLOCKED, owner for LOCALITY_LOCAL
+    long param;
+} locality_range;
+
+typedef struct locality_state {
+    long num_nodelets;
+    // Sorted by begin, ranges never overlap
+    locality_range * ranges;
+    long num_ranges;
+    long capacity;
+    pthread_mutex_t lock;
+    // Counters for the current region
+    long migrations;
+    long remote_writes;
+    long remote_spawns;
+    // Hotspot counters for the current region, one element per nodelet
+    long * accesses;
+    long * arrivals;
+    long * spawns;
+} locality_state;
+
+static locality_state locality = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Nodelet of the strand running on this worker
+static _Thread_local long locality_here = 0;
+
+static inline void locality_region_begin();
+static inline void locality_region_end();
+
+__attribute__((constructor)) static void
+locality_init()
+{
+    // Attach the counts to every region (see logging.h)
+    log_set_region_hooks(locality_region_begin, locality_region_end);
+    const char * env = getenv("LOCALITY_NODELETS");
+    locality.num_nodelets = env ? atol(env) : 8;
+    runtime_assert(locality.num_nodelets > 0, "LOCALITY_NODELETS must be > 0");
+    locality.accesses = calloc(locality.num_nodelets, sizeof(long));
+    locality.arrivals = calloc(locality.num_nodelets, sizeof(long));
+    locality.spawns = calloc(locality.num_nodelets, sizeof(long));
+    runtime_assert(locality.accesses && locality.arrivals && locality.spawns, "Failed to allocate hotspot counters");
+}
+
+// Index of the last range that begins at or before p, or -1. Call with the lock held.
+static inline long
+locality_find(const char * p)
+{
+    long lo = 0, hi = locality.num_ranges;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (locality.ranges[mid].begin <= p) { lo = mid + 1; } else { hi = mid; }
+    }
+    return lo - 1;
+}
+
+static inline void
+locality_register(void * ptr, size_t size, long layout, long param)
+{
+    if (ptr == NULL || size == 0) { return; }
+    pthread_mutex_lock(&locality.lock);
+    if (locality.num_ranges == locality.capacity) {
+        locality.capacity = locality.capacity ? 2 * locality.capacity : 64;
+        locality.ranges = realloc(locality.ranges, locality.capacity * sizeof(locality_range));
+        runtime_assert(locality.ranges != NULL, "Failed to grow locality registry");
+    }
+    long i = locality_find(ptr) + 1;
+    memmove(&locality.ranges[i + 1], &locality.ranges[i], (locality.num_ranges - i) * sizeof(locality_range));
+    locality.ranges[i] = (locality_range){ (char*)ptr, (char*)ptr + size, layout, param };
+    locality.num_ranges += 1;
+    pthread_mutex_unlock(&locality.lock);
+}
+
+static inline void
+locality_unregister(void * ptr)
+{
+    if (ptr == NULL) { return; }
+    pthread_mutex_lock(&locality.lock);
+    long i = locality_find(ptr);
+    if (i >= 0 && locality.ranges[i].begin == (char*)ptr) {
+        memmove(&locality.ranges[i], &locality.ranges[i + 1], (locality.num_ranges - i - 1) * sizeof(locality_range));
+        locality.num_ranges -= 1;
+    }
+    pthread_mutex_unlock(&locality.lock);
+}
+
+// Nodelet that owns the address on Emu, or the current nodelet if it is local everywhere
+static inline long
+locality_owner(const void * ptr)
+{
+    const char * p = ptr;
+    long owner = locality_here;
+    pthread_mutex_lock(&locality.lock);
+    long i = locality_find(p);
+    if (i >= 0 && p < locality.ranges[i].end) {
+        locality_range * r = &locality.ranges[i];
+        switch (r->layout) {
+            case LOCALITY_STRIPED:
+            case LOCALITY_TABLE:
+            case LOCALITY_BLOCKED:
+                owner = ((p - r->begin) / r->param) % locality.num_nodelets;
+                break;
+            case LOCALITY_LOCAL:
+                owner = r->param;
+                break;
+        }
+    }
+    pthread_mutex_unlock(&locality.lock);
+    return owner;
+}
+
+static inline void
+locality_read(const void * ptr)
+{
+    long owner = locality_owner(ptr);
+    __sync_fetch_and_add(&locality.accesses[owner], 1);
+    if (owner != locality_here) {
+        __sync_fetch_and_add(&locality.migrations, 1);
+        __sync_fetch_and_add(&locality.arrivals[owner], 1);
+        locality_here = owner;
+    }
+}
+
+static inline void
+locality_write(const void * ptr)
+{
+    long owner = locality_owner(ptr);
+    __sync_fetch_and_add(&locality.accesses[owner], 1);
+    if (owner != locality_here) {
+        __sync_fetch_and_add(&locality.remote_writes, 1);
+    }
+}
+
+// Counts a local spawn, returns the current nodelet
+static inline long
+locality_spawn_local()
+{
+    __sync_fetch_and_add(&locality.spawns[locality_here], 1);
+    return locality_here;
+}
+
+// Moves the strand to the owner of ptr, counting a remote spawn. Returns the nodelet it came from.
+static inline long
+locality_spawn_begin(const void * ptr)
+{
+    long parent = locality_here;
+    long owner = locality_owner(ptr);
+    __sync_fetch_and_add(&locality.spawns[parent], 1);
+    if (owner != parent) {
+        __sync_fetch_and_add(&locality.remote_spawns, 1);
+        __sync_fetch_and_add(&locality.arrivals[owner], 1);
+        locality_here = owner;
+    }
+    return parent;
+}
+
+static inline void
+locality_region_begin()
+{
+    locality.migrations = 0;
+    locality.remote_writes = 0;
+    locality.remote_spawns = 0;
+    for (long i = 0; i < locality.num_nodelets; ++i) {
+        locality.accesses[i] = 0;
+        locality.arrivals[i] = 0;
+        locality.spawns[i] = 0;
+    }
+}
+
+// Max / mean of the counts, or 0 if they are all zero
+static inline double
+locality_skew(const long * counts)
+{
+    long max = 0, sum = 0;
+    for (long i = 0; i < locality.num_nodelets; ++i) {
+        if (counts[i] > max) { max = counts[i]; }
+        sum += counts[i];
+    }
+    return sum == 0 ? 0 : (double)max * locality.num_nodelets / sum;
+}
+
+static inline void
+locality_hotspot_report()
+{
+    long hot = 0, hot_total = -1;
+    for (long i = 0; i < locality.num_nodelets; ++i) {
+        long total = locality.accesses[i] + locality.arrivals[i] + locality.spawns[i];
+        if (total > hot_total) { hot = i; hot_total = total; }
+    }
+    // Nothing to report for uninstrumented regions
+    if (hot_total == 0) { return; }
+    hooks_set_attr_f64("locality_access_skew", locality_skew(locality.accesses));
+    hooks_set_attr_f64("locality_arrival_skew", locality_skew(locality.arrivals));
+    hooks_set_attr_f64("locality_spawn_skew", locality_skew(locality.spawns));
+    hooks_set_attr_i64("locality_hot_nodelet", hot);
+    LOG("Hotspots (accesses/arrivals/spawns per nodelet):");
+    for (long i = 0; i < locality.num_nodelets; ++i) {
+        LOG(" %li/%li/%li", locality.accesses[i], locality.arrivals[i], locality.spawns[i]);
+    }
+    LOG("\n");
+    LOG("Skew (max/mean): accesses %3.2f, arrivals %3.2f, spawns %3.2f, hottest nodelet %li\n",
+        locality_skew(locality.accesses), locality_skew(locality.arrivals), locality_skew(locality.spawns), hot);
+}
+
+static inline void
+locality_region_end()
+{
+    hooks_set_attr_i64("locality_migrations", locality.migrations);
+    hooks_set_attr_i64("locality_remote_writes", locality.remote_writes);
+    hooks_set_attr_i64("locality_remote_spawns", locality.remote_spawns);
+    LOG("Locality: %li migrations, %li remote writes, %li remote spawns\n",
+        locality.migrations, locality.remote_writes, locality.remote_spawns);
+    locality_hotspot_report();
+}
+
+// Registers each chunk of an emu_chunked_array, chunk i is on nodelet i
+static inline void
+locality_register_chunked(emu_chunked_array * array)
+{
+    long chunk_elements = 1L << array->log2_elements_per_chunk;
+    long num_chunks = (array->num_elements + chunk_elements - 1) / chunk_elements;
+    for (long i = 0; i < num_chunks; ++i) {
+        locality_register(array->data[i], chunk_elements * array->element_size, LOCALITY_LOCAL,
+            i % locality.num_nodelets);
+    }
+}
+
+static inline void
+locality_unregister_chunked(emu_chunked_array * array)
+{
+    long chunk_elements = 1L << array->log2_elements_per_chunk;
+    long num_chunks = (array->num_elements + chunk_elements - 1) / chunk_elements;
+    for (long i = 0; i < num_chunks; ++i) {
+        locality_unregister(array->data[i]);
+    }
+}
+
+// Registering versions of the memoryweb allocators
+
+static inline long *
+locality_mw_malloc1dlong(size_t n)
+{
+    long * ptr = mw_malloc1dlong(n);
+    locality_register(ptr, n * sizeof(long), LOCALITY_STRIPED, sizeof(long));
+    return ptr;
+}
+
+static inline void *
+locality_mw_malloc2d(size_t nelem, size_t sz)
+{
+    void ** ptr = mw_malloc2d(nelem, sz);
+    if (ptr == NULL) { return ptr; }
+    locality_register(ptr, nelem * sizeof(void*), LOCALITY_TABLE, sizeof(void*));
+    // Register all the blocks at once if they are contiguous, otherwise one at a time
+    bool contiguous = true;
+    for (size_t i = 1; i < nelem && contiguous; ++i) {
+        contiguous = (char*)ptr[i] == (char*)ptr[0] + i * sz;
+    }
+    if (contiguous) {
+        locality_register(ptr[0], nelem * sz, LOCALITY_BLOCKED, sz);
+    } else {
+        for (size_t i = 0; i < nelem; ++i) {
+            locality_register(ptr[i], sz, LOCALITY_LOCAL, i % locality.num_nodelets);
+        }
+    }
+    return ptr;
+}
+
+static inline void *
+locality_mw_mallocrepl(size_t sz)
+{
+    void * ptr = mw_mallocrepl(sz);
+    locality_register(ptr, sz, LOCALITY_REPLICATED, 0);
+    return ptr;
+}
+
+static inline void *
+locality_mw_localmalloc(size_t sz, const void * nlet_ptr)
+{
+    void * ptr = mw_localmalloc(sz, nlet_ptr);
+    locality_register(ptr, sz, LOCALITY_LOCAL, locality_owner(nlet_ptr));
+    return ptr;
+}
+
+static inline void
+locality_mw_free(void * ptr)
+{
+    // Unregister the blocks of an mw_malloc2d along with the table
+    void ** table = ptr;
+    long nelem = 0;
+    pthread_mutex_lock(&locality.lock);
+    long i = locality_find(ptr);
+    if (i >= 0 && locality.ranges[i].begin == (char*)ptr && locality.ranges[i].layout == LOCALITY_TABLE) {
+        nelem = (locality.ranges[i].end - locality.ranges[i].begin) / sizeof(void*);
+    }
+    pthread_mutex_unlock(&locality.lock);
+    for (long j = 0; j < nelem; ++j) {
+        locality_unregister(table[j]);
+    }
+    locality_unregister(ptr);
+    mw_free(ptr);
+}
+
+static inline void
+locality_mw_localfree(void * ptr)
+{
+    locality_unregister(ptr);
+    mw_localfree(ptr);
+}
+
+#define mw_malloc1dlong(N) locality_mw_malloc1dlong(N)
+#define mw_malloc2d(NELEM, SZ) locality_mw_malloc2d(NELEM, SZ)
+#define mw_mallocrepl(SZ) locality_mw_mallocrepl(SZ)
+#define mw_localmalloc(SZ, PTR) locality_mw_localmalloc(SZ, PTR)
+#define mw_free(PTR) locality_mw_free(PTR)
+#define mw_localfree(PTR) locality_mw_localfree(PTR)
+
+// Evaluates to the lvalue X, after moving the thread to the nodelet that owns it
+#define LOCALITY_READ(X) (*(locality_read(&(X)), &(X)))
+// Evaluates to the lvalue X, counting a remote write if another nodelet owns it
+#define LOCALITY_WRITE(X) (*(locality_write(&(X)), &(X)))
+// Evaluates to PTR, counting a remote write if another nodelet owns it (for REMOTE_ADD and friends)
+#define LOCALITY_REMOTE(PTR) (locality_write(PTR), (PTR))
+// Moves the thread to the nodelet that owns PTR, without counting anything
+#define LOCALITY_ENTER(PTR) (locality_here = locality_owner(PTR))
+// Places SIZE bytes at PTR (e.g. a stack variable) on the current nodelet until LOCALITY_UNREGISTER(PTR)
+#define LOCALITY_REGISTER_LOCAL(PTR, SIZE) locality_register(PTR, SIZE, LOCALITY_LOCAL, locality_here)
+#define LOCALITY_UNREGISTER(PTR) locality_unregister(PTR)
+// Tracks the chunks of an emu_chunked_array allocated by emu_c_utils
+#define LOCALITY_REGISTER_CHUNKED(ARRAY) locality_register_chunked(ARRAY)
+#define LOCALITY_UNREGISTER_CHUNKED(ARRAY) locality_unregister_chunked(ARRAY)
+
+#define LOCALITY_SPAWN(CALL)                                        \
+do {                                                                \
+    long locality_parent = locality_spawn_local();                  \
+    cilk_spawn CALL;                                                \
+    locality_here = locality_parent;                                \
+} while (0)
+
+#define LOCALITY_SPAWN_AT(PTR, CALL)                                \
+do {                                                                \
+    long locality_parent = locality_spawn_begin(PTR);               \
+    cilk_spawn_at(PTR) CALL;                                        \
+    locality_here = locality_parent;                                \
+} while (0)
+
+#define LOCALITY_SYNC                                               \
+do {                                                                \
+    long locality_parent = locality_here;                           \
+    cilk_sync;                                                      \
+    locality_here = locality_parent;                                \
+} while (0)
+
+#else
+
+#define LOCALITY_READ(X) (X)
+#define LOCALITY_WRITE(X) (X)
+#define LOCALITY_REMOTE(PTR) (PTR)
+#define LOCALITY_ENTER(PTR) ((void)0)
+#define LOCALITY_REGISTER_LOCAL(PTR, SIZE) ((void)0)
+#define LOCALITY_UNREGISTER(PTR) ((void)0)
+#define LOCALITY_REGISTER_CHUNKED(ARRAY) ((void)0)
+#define LOCALITY_UNREGISTER_CHUNKED(ARRAY) ((void)0)
+#define LOCALITY_SPAWN(CALL) cilk_spawn CALL
+#define LOCALITY_SPAWN_AT(PTR, CALL) cilk_spawn_at(PTR) CALL
+#define LOCALITY_SYNC cilk_sync
+
+#endif
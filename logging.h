@@ -0,0 +1,239 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <emu_c_utils/emu_c_utils.h>
+
+/*
+ * Buffered logging.
+ *
+ * Printing over the Emu console is slow, and flushing after every message distorts short trials.
+ * Each message is formatted into a ring buffer on the nodelet where it is logged. Outside of a region,
+ * the buffers are printed whenever a message ends a line. Between hooks_region_begin() and hooks_region_end(),
+ * nothing is printed until the region ends, unless a ring fills up. The buffers are also printed at exit,
+ * and when the program dies from a signal, so the output of a crashed run isn't lost.
+ *
+ * Messages from different nodelets are printed in the order of their nodelet's clock.
+ * A message that doesn't fit in a slot (LOG_SLOT_BYTES) is printed right away, after flushing the buffers.
+ *
+ * The LOG_LEVEL environment variable (error, warn, info or debug, default info) hides the less important levels.
+ * LOG() is at the info level.
+ */
+
+#ifndef LOG_SLOTS_PER_NODELET
+#define LOG_SLOTS_PER_NODELET 64
+#endif
+#ifndef LOG_SLOT_BYTES
+#define LOG_SLOT_BYTES 256
+#endif
+
+typedef enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+} log_level;
+
+typedef struct log_slot {
+    // Index of the message + 1, set once the text is ready
+    long seq;
+    long ts;
+    char text[LOG_SLOT_BYTES - 2 * sizeof(long)];
+} log_slot;
+
+// One copy of each on every nodelet
+replicated log_slot log_slots[LOG_SLOTS_PER_NODELET];
+// Next message to write and next message to print
+replicated long log_head;
+replicated long log_tail;
+// Set during a region
+replicated long log_deferred;
+// LOG_LEVEL + 1, or 0 until the environment variable has been read on this nodelet
+replicated long log_max_level;
+// Serializes the flushes, only the copy on nodelet 0 is used
+replicated long log_lock;
+
+static long log_handlers_installed = 0;
+
+// Extra work at the start and end of every region, set with log_set_region_hooks() (see locality.h).
+// Only main() begins and ends regions, so these don't need to be replicated.
+static void (*log_begin_hook)() = NULL;
+static void (*log_end_hook)() = NULL;
+
+// On native builds there is only one address space, so only one ring
+static inline long
+log_num_rings()
+{
+#ifdef __le64__
+    return NODELETS();
+#else
+    return 1;
+#endif
+}
+
+static inline long
+log_clock()
+{
+#ifdef __le64__
+    return CLOCK();
+#else
+    return 0;
+#endif
+}
+
+// Prints every message that is ready, oldest first. Gives up if wait is false and another thread is flushing.
+static inline void
+log_flush_buffers(bool wait)
+{
+    long * lock = (long*)mw_get_nth(&log_lock, 0);
+    while (ATOMIC_CAS(lock, 1, 0) != 0) {
+        if (!wait) { return; }
+    }
+    for (;;) {
+        // Pick the ring with the oldest message
+        long next = -1, next_ts = 0;
+        for (long n = 0; n < log_num_rings(); ++n) {
+            long tail = *(long*)mw_get_nth(&log_tail, n);
+            log_slot * slot = &((log_slot*)mw_get_nth(log_slots, n))[tail % LOG_SLOTS_PER_NODELET];
+            if (*(volatile long*)&slot->seq != tail + 1) { continue; }
+            if (next < 0 || slot->ts < next_ts) {
+                next = n;
+                next_ts = slot->ts;
+            }
+        }
+        if (next < 0) { break; }
+        long * tail = (long*)mw_get_nth(&log_tail, next);
+        log_slot * slot = &((log_slot*)mw_get_nth(log_slots, next))[*tail % LOG_SLOTS_PER_NODELET];
+        fputs(slot->text, stdout);
+        *tail += 1;
+    }
+    fflush(stdout);
+    *lock = 0;
+}
+
+static inline void
+log_flush()
+{
+    log_flush_buffers(true);
+}
+
+static void
+log_atexit()
+{
+    log_flush_buffers(true);
+}
+
+// Print what we have, then die from the signal as usual
+static void
+log_signal_handler(int sig)
+{
+    log_flush_buffers(false);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static inline long
+log_parse_level()
+{
+    const char * env = getenv("LOG_LEVEL");
+    if (env == NULL) { return LOG_LEVEL_INFO; }
+    if (!strcmp(env, "error")) { return LOG_LEVEL_ERROR; }
+    if (!strcmp(env, "warn")) { return LOG_LEVEL_WARN; }
+    if (!strcmp(env, "debug")) { return LOG_LEVEL_DEBUG; }
+    return LOG_LEVEL_INFO;
+}
+
+static inline bool
+log_enabled(long level)
+{
+    if (log_max_level == 0) {
+        log_max_level = log_parse_level() + 1;
+        if (ATOMIC_CAS(&log_handlers_installed, 1, 0) == 0) {
+            atexit(log_atexit);
+            signal(SIGSEGV, log_signal_handler);
+            signal(SIGABRT, log_signal_handler);
+            signal(SIGFPE, log_signal_handler);
+            signal(SIGILL, log_signal_handler);
+            signal(SIGINT, log_signal_handler);
+            signal(SIGTERM, log_signal_handler);
+        }
+    }
+    return level < log_max_level;
+}
+
+static inline void __attribute__((format(printf, 2, 3)))
+log_write(long level, const char * fmt, ...)
+{
+    if (!log_enabled(level)) { return; }
+    long i = ATOMIC_ADDMS(&log_head, 1);
+    // Wait for room in the ring
+    while (i - *(volatile long*)&log_tail >= LOG_SLOTS_PER_NODELET) {
+        log_flush();
+    }
+    log_slot * slot = &log_slots[i % LOG_SLOTS_PER_NODELET];
+    va_list args;
+    va_start(args, fmt);
+    long len = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    va_end(args);
+    bool too_long = len >= (long)sizeof(slot->text);
+    if (too_long) { slot->text[0] = '\0'; }
+    slot->ts = log_clock();
+#ifndef __le64__
+    // The flushing thread may be on another core
+    __sync_synchronize();
+#endif
+    slot->seq = i + 1;
+    if (too_long) {
+        log_flush();
+        va_start(args, fmt);
+        vfprintf(stdout, fmt, args);
+        va_end(args);
+        fflush(stdout);
+    } else if (!log_deferred && len > 0 && slot->text[len - 1] == '\n') {
+        log_flush();
+    }
+}
+
+// Runs begin at the start of every region, and end just before it ends, so it can attach attributes
+static inline void
+log_set_region_hooks(void (*begin)(), void (*end)())
+{
+    log_begin_hook = begin;
+    log_end_hook = end;
+}
+
+// Hold messages back until the end of the region
+static inline void
+log_region_begin()
+{
+    if (log_begin_hook) { log_begin_hook(); }
+    log_flush();
+    mw_replicated_init(&log_deferred, 1);
+}
+
+static inline void
+log_region_ending()
+{
+    if (log_end_hook) { log_end_hook(); }
+}
+
+static inline double
+log_region_end(double time_ms)
+{
+    mw_replicated_init(&log_deferred, 0);
+    log_flush();
+    return time_ms;
+}
+
+#define LOG_ERROR(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Flush the buffers and run the hooks around every region
+#define hooks_region_begin(NAME) (log_region_begin(), hooks_region_begin(NAME))
+#define hooks_region_end() log_region_end((log_region_ending(), hooks_region_end()))
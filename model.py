@@ -0,0 +1,269 @@
+#!/usr/bin/env python2.7
+
+"""
+Analytical performance model for the microbenchmarks.
+
+A platform profile holds a few numbers measured by the simple benchmarks:
+    migration_latency_us               - one thread migrating back and forth (ping_pong local, 1 thread)
+    migrations_per_second_per_nodelet  - saturated migration throughput (ping_pong local, many threads)
+    bandwidth_per_nodelet_mbps         - local memory bandwidth (local_stream)
+    spawn_cost_us                      - cost of one spawn on the critical path (spawn_rate)
+    num_nodelets                       - number of nodelets on the machine
+
+Each benchmark configuration is reduced to counts (bytes moved, migrations, spawns on the critical path),
+which are turned into a runtime:
+    predicted = spawns * spawn_cost + max(bytes / bandwidth, migration time)
+When a results file has the locality_migrations attribute (see locality.h), the measured count is used
+instead of the formula.
+
+Usage:
+    model.py calibrate <results.csv> <profile.json>
+    model.py predict <profile.json> <results.csv> [<output.csv>]
+    model.py plan <profile.json> <suite.json> [--max_ms T]
+
+Results files are the CSV files written by post_process.py.
+"""
+
+import sys
+import json
+import math
+import argparse
+import pandas as pd
+
+from generate import iterSuite
+
+# Regions that are not part of the timed benchmark
+IGNORED_REGIONS = ["validate", "init", "replicate"]
+
+def get_mode(row):
+    """Benchmarks name the mode argument either 'mode' or 'spawn_mode'"""
+    for key in ["mode", "spawn_mode"]:
+        if key in row and isinstance(row[key], basestring):
+            return row[key]
+    return ""
+
+def get_nodelets(row, profile):
+    """Number of nodelets in use, from the --num_nodelets scaling flag"""
+    if "num_nodelets" in row and not pd.isnull(row["num_nodelets"]):
+        return int(row["num_nodelets"])
+    return profile["num_nodelets"]
+
+def get_elements(row, profile):
+    n = 2 ** int(row["log2_num_elements"])
+    if row.get("per_nodelet", False) in [True, 1, "True"]:
+        n *= get_nodelets(row, profile)
+    return n
+
+def spawn_depth(mode, num_threads, num_nodelets):
+    """Number of spawns on the critical path of the spawn tree"""
+    if mode == "serial":
+        return 0
+    if "remote" in mode:
+        return num_nodelets + num_threads / num_nodelets
+    if "recursive" in mode or mode in ["cilk_for", "library"]:
+        return math.ceil(math.log(max(num_threads, 1), 2))
+    return num_threads
+
+def count_stream(row, profile, local):
+    """local_stream, global_stream, global_stream_1d: C = A + B"""
+    mode = get_mode(row)
+    n = get_elements(row, profile)
+    threads = int(row["num_threads"])
+    nodelets = 1 if local else get_nodelets(row, profile)
+    if local or mode == "library":
+        migrations = 0
+    elif row["benchmark"] == "global_stream_1d":
+        # Consecutive elements of a striped array are on different nodelets
+        migrations = n if nodelets > 1 else 0
+    else:
+        # Each thread migrates once to its chunk
+        migrations = threads
+    return dict(bytes=n * 3 * 8, migrations=migrations, threads=threads, nodelets=nodelets,
+                spawns=spawn_depth(mode, threads, nodelets))
+
+def count_global_reduce(row, profile):
+    mode = get_mode(row)
+    n = get_elements(row, profile)
+    threads = int(row["num_threads"])
+    nodelets = get_nodelets(row, profile)
+    migrations = 0 if mode == "per_nodelet_remote" else threads
+    return dict(bytes=n * 8, migrations=migrations, threads=threads, nodelets=nodelets,
+                spawns=spawn_depth(mode, threads, nodelets))
+
+def count_pointer_chase(row, profile):
+    mode = get_mode(row)
+    n = get_elements(row, profile)
+    threads = int(row["num_threads"])
+    nodelets = get_nodelets(row, profile)
+    block_size = int(row.get("block_size", 1))
+    # Each jump to the next block lands on a random nodelet
+    migrations = n / block_size * (nodelets - 1) / float(nodelets)
+    # Each element is a next pointer and a weight
+    return dict(bytes=n * 16, migrations=migrations, threads=threads, nodelets=nodelets,
+                spawns=spawn_depth(mode, threads, nodelets))
+
+def count_ping_pong(row, profile):
+    mode = get_mode(row)
+    if mode not in ["local", "load"]:
+        return None
+    threads = int(row["num_threads"])
+    return dict(bytes=0, migrations=threads * 2 ** int(row["log2_num_migrations"]), threads=threads,
+                nodelets=2, spawns=threads)
+
+def count(row, profile):
+    """Reduce one benchmark configuration to counts, or None if the model doesn't cover it"""
+    benchmark = row.get("benchmark")
+    if benchmark == "local_stream":
+        c = count_stream(row, profile, local=True)
+    elif benchmark in ["global_stream", "global_stream_1d"]:
+        c = count_stream(row, profile, local=False)
+    elif benchmark == "global_reduce":
+        c = count_global_reduce(row, profile)
+    elif benchmark == "pointer_chase":
+        c = count_pointer_chase(row, profile)
+    elif benchmark == "ping_pong":
+        c = count_ping_pong(row, profile)
+    else:
+        return None
+    # Prefer the counts from a locality emulation run
+    if c is not None and "locality_migrations" in row and not pd.isnull(row["locality_migrations"]):
+        c["migrations"] = row["locality_migrations"]
+    return c
+
+def predict_ms(c, profile):
+    spawn_ms = c["spawns"] * profile["spawn_cost_us"] / 1000.0
+    mem_ms = c["bytes"] / (profile["bandwidth_per_nodelet_mbps"] * 1e6 * c["nodelets"]) * 1000
+    # Migrations are limited by the latency of each thread, or the throughput of the nodelets
+    latency_ms = c["migrations"] * profile["migration_latency_us"] / 1000.0 / max(c["threads"], 1)
+    throughput_ms = c["migrations"] / (profile["migrations_per_second_per_nodelet"] * c["nodelets"]) * 1000
+    return spawn_ms + max(mem_ms, latency_ms, throughput_ms)
+
+def load_results(path):
+    data = pd.read_csv(path, index_col=0)
+    if "region_name" in data.columns:
+        data = data[~data["region_name"].isin(IGNORED_REGIONS)]
+    return data
+
+def calibrate(results_path, profile_path):
+    data = load_results(results_path)
+    profile = {}
+
+    stream = data[data["benchmark"] == "local_stream"]
+    if len(stream) > 0:
+        mbps = (2 ** stream["log2_num_elements"] * 3 * 8) / (stream["time_ms"] / 1000) / 1e6
+        profile["bandwidth_per_nodelet_mbps"] = mbps.max()
+
+    ping_pong = data[(data["benchmark"] == "ping_pong") & (data["mode"] == "local")]
+    if len(ping_pong) > 0:
+        migrations = ping_pong["num_threads"] * 2 ** ping_pong["log2_num_migrations"]
+        rate = migrations / (ping_pong["time_ms"] / 1000)
+        # Two nodelets share the traffic
+        profile["migrations_per_second_per_nodelet"] = rate.max() / 2
+        single = ping_pong[ping_pong["num_threads"] == 1]
+        if len(single) > 0:
+            profile["migration_latency_us"] = \
+                (single["time_ms"] * 1000 / 2 ** single["log2_num_migrations"]).min()
+
+    spawn_rate = data[data["benchmark"] == "spawn_rate"]
+    serial = spawn_rate[spawn_rate["mode"] == "serial"]
+    spawned = spawn_rate[spawn_rate["mode"] == "serial_spawn_light"]
+    if len(serial) > 0 and len(spawned) > 0:
+        keys = ["log2_num_elements", "num_threads"]
+        merged = pd.merge(
+            serial.groupby(keys)["time_ms"].min().reset_index(),
+            spawned.groupby(keys)["time_ms"].min().reset_index(),
+            on=keys, suffixes=("_serial", "_spawn"))
+        cost = (merged["time_ms_spawn"] - merged["time_ms_serial"]) * 1000 / merged["num_threads"]
+        profile["spawn_cost_us"] = max(cost.median(), 0)
+
+    if "num_nodelets" in data.columns:
+        profile["num_nodelets"] = int(data["num_nodelets"].max())
+
+    for key in ["migration_latency_us", "migrations_per_second_per_nodelet",
+                "bandwidth_per_nodelet_mbps", "spawn_cost_us", "num_nodelets"]:
+        if key not in profile:
+            print "WARNING: no results to calibrate", key, "- fill it in by hand"
+        else:
+            print key, "=", profile[key]
+
+    with open(profile_path, "w") as f:
+        json.dump(profile, f, indent=4, sort_keys=True)
+    print "Saved profile to " + profile_path
+
+def load_profile(path):
+    with open(path) as f:
+        profile = json.load(f)
+    for key in ["migration_latency_us", "migrations_per_second_per_nodelet",
+                "bandwidth_per_nodelet_mbps", "spawn_cost_us", "num_nodelets"]:
+        if key not in profile:
+            raise Exception("Missing {} field in platform profile".format(key))
+    return profile
+
+def predict(profile_path, results_path, output_path):
+    profile = load_profile(profile_path)
+    data = load_results(results_path)
+    rows = []
+    for _, row in data.iterrows():
+        c = count(row, profile)
+        if c is None:
+            continue
+        predicted = predict_ms(c, profile)
+        rows.append({
+            "benchmark": row["benchmark"],
+            "mode": get_mode(row),
+            "num_threads": row["num_threads"],
+            "num_nodelets": c["nodelets"],
+            "migrations": c["migrations"],
+            "measured_ms": row["time_ms"],
+            "predicted_ms": predicted,
+            "ratio": predicted / row["time_ms"] if row["time_ms"] > 0 else float("nan"),
+        })
+    if len(rows) == 0:
+        print "No records the model can predict"
+        return
+    table = pd.DataFrame.from_records(rows, columns=["benchmark", "mode", "num_threads", "num_nodelets",
+        "migrations", "measured_ms", "predicted_ms", "ratio"])
+    print table.to_string(index=False)
+    print "Median predicted / measured: {:.2f}".format(table["ratio"].median())
+    if output_path:
+        table.to_csv(output_path)
+        print "Saved to " + output_path
+
+def plan(profile_path, suite_path, max_ms):
+    profile = load_profile(profile_path)
+    with open(suite_path) as f:
+        suite = json.load(f)
+    for args in iterSuite(suite):
+        c = count(args, profile)
+        if c is None:
+            print "?       ", json.dumps(args)
+            continue
+        predicted = predict_ms(c, profile)
+        verdict = "skip" if max_ms is not None and predicted > max_ms else "run"
+        print "{:4} {:10.3f} ms  {}".format(verdict, predicted, json.dumps(args))
+
+def main():
+    parser = argparse.ArgumentParser(description="Predict benchmark runtimes from a platform profile")
+    subparsers = parser.add_subparsers(dest="command")
+    p = subparsers.add_parser("calibrate", help="Build a platform profile from ping_pong, local_stream and spawn_rate results")
+    p.add_argument("results")
+    p.add_argument("profile")
+    p = subparsers.add_parser("predict", help="Print a predicted-vs-measured table")
+    p.add_argument("profile")
+    p.add_argument("results")
+    p.add_argument("output", nargs="?", default=None)
+    p = subparsers.add_parser("plan", help="Predict the runtime of each configuration in a suite")
+    p.add_argument("profile")
+    p.add_argument("suite")
+    p.add_argument("--max_ms", type=float, default=None, help="Mark configurations predicted to take longer as skip")
+    args = parser.parse_args()
+
+    if args.command == "calibrate":
+        calibrate(args.results, args.profile)
+    elif args.command == "predict":
+        predict(args.profile, args.results, args.output)
+    elif args.command == "plan":
+        plan(args.profile, args.suite, args.max_ms)
+
+if __name__ == "__main__":
+    main()
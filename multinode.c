@@ -0,0 +1,292 @@
+// For ucontext, MAP_ANONYMOUS and prctl with -std=c11
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <emu_c_utils/emu_c_utils.h>
+
+#include "common.h"
+#include "multinode.h"
+
+/*
+ * Goal: Run the multi-node code paths of ping_pong, bulk_copy and global_stream on a native build,
+ * with each node emulated by a process (see multinode.h).
+ * - ping_pong_global - Threads migrate back and forth between the first nodelet of node 0 and of node 1,
+ *                      like ping_pong's global mode
+ * - bulk_copy_intra_chick - Threads on nodelet 0 copy an array to the first nodelet of node 1, like bulk_copy's
+ *                      intra_chick allocation
+ * - global_stream - C = A + B over arrays with a chunk on every nodelet, with a remote spawn on each nodelet
+ *                      followed by local spawns, like global_stream's serial_remote_spawn
+ * For ping_pong_global, 2^log2_num_elements is the number of migrations per thread.
+ */
+
+typedef struct multinode_data {
+    long n;
+    long num_threads;
+    // ping_pong: one element on each nodelet
+    long ** ping;
+    // bulk_copy
+    long * src;
+    long * dst;
+    // global_stream: a chunk on each nodelet
+    long ** a;
+    long ** b;
+    long ** c;
+} multinode_data;
+
+// ping_pong_global
+
+static void
+ping_pong_global_worker(long d, long unused1, long unused2, long unused3)
+{
+    multinode_data * data = (multinode_data*)d;
+    long ** a = data->ping;
+    long remote = mn_ctl->nodelets_per_node;
+    // Each iteration forces four migrations
+    long n = data->n / 4;
+    for (long i = 0; i < n; ++i) {
+        mn_migrate(a[remote]);
+        mn_migrate(a[0]);
+        mn_migrate(a[remote]);
+        mn_migrate(a[0]);
+    }
+}
+
+static void
+ping_pong_global(long d, long unused1, long unused2, long unused3)
+{
+    multinode_data * data = (multinode_data*)d;
+    for (long i = 0; i < data->num_threads; ++i) {
+        mn_spawn(ping_pong_global_worker, d, 0, 0, 0);
+    }
+    mn_sync();
+}
+
+// bulk_copy_intra_chick
+
+static void
+bulk_copy_worker(long d, long begin, long end, long unused)
+{
+    multinode_data * data = (multinode_data*)d;
+    memcpy(data->dst + begin, data->src + begin, (end - begin) * sizeof(long));
+}
+
+static void
+bulk_copy_intra_chick(long d, long unused1, long unused2, long unused3)
+{
+    multinode_data * data = (multinode_data*)d;
+    long grain = data->n / data->num_threads;
+    if (grain < 1) { grain = 1; }
+    for (long i = 0; i < data->n; i += grain) {
+        mn_spawn(bulk_copy_worker, d, i, i + grain <= data->n ? i + grain : data->n, 0);
+    }
+    mn_sync();
+}
+
+// global_stream
+
+static void
+global_stream_worker(long d, long nlet, long begin, long end)
+{
+    multinode_data * data = (multinode_data*)d;
+    long * a = data->a[nlet];
+    long * b = data->b[nlet];
+    long * c = data->c[nlet];
+    for (long i = begin; i < end; ++i) {
+        c[i] = a[i] + b[i];
+    }
+}
+
+static void
+global_stream_nodelet(long d, long nlet, long local_n, long grain)
+{
+    for (long i = 0; i < local_n; i += grain) {
+        mn_spawn(global_stream_worker, d, nlet, i, i + grain <= local_n ? i + grain : local_n);
+    }
+    mn_sync();
+}
+
+static void
+global_stream(long d, long unused1, long unused2, long unused3)
+{
+    multinode_data * data = (multinode_data*)d;
+    long local_n = data->n / mn_nodelets();
+    long grain = data->n / data->num_threads;
+    if (grain > local_n) { grain = local_n; }
+    if (grain < 1) { grain = 1; }
+    for (long nlet = 0; nlet < mn_nodelets(); ++nlet) {
+        mn_spawn_at(data->a[nlet], global_stream_nodelet, d, nlet, local_n, grain);
+    }
+    mn_sync();
+}
+
+void
+multinode_data_init(multinode_data * data, const char * mode)
+{
+    long n = data->n;
+    long local_n = n / mn_nodelets();
+    if (!strcmp(mode, "ping_pong_global")) {
+        data->ping = (long**)mn_malloc2d(mn_nodelets(), sizeof(long));
+    } else if (!strcmp(mode, "bulk_copy_intra_chick")) {
+        data->src = mn_localmalloc(n * sizeof(long), 0);
+        data->dst = mn_localmalloc(n * sizeof(long), mn_ctl->nodelets_per_node);
+        for (long i = 0; i < n; ++i) {
+            data->src[i] = i;
+            data->dst[i] = -1;
+        }
+    } else if (!strcmp(mode, "global_stream")) {
+        data->a = (long**)mn_malloc2d(mn_nodelets(), local_n * sizeof(long));
+        data->b = (long**)mn_malloc2d(mn_nodelets(), local_n * sizeof(long));
+        data->c = (long**)mn_malloc2d(mn_nodelets(), local_n * sizeof(long));
+        for (long nlet = 0; nlet < mn_nodelets(); ++nlet) {
+            for (long i = 0; i < local_n; ++i) {
+                data->a[nlet][i] = 1;
+                data->b[nlet][i] = 2;
+                data->c[nlet][i] = 0;
+            }
+        }
+    }
+}
+
+bool
+multinode_validate(multinode_data * data, const char * mode, mn_stats * stats, long num_trials)
+{
+    if (!strcmp(mode, "ping_pong_global")) {
+        long expected = num_trials * data->num_threads * (data->n / 4) * 4;
+        if (stats->remote_migrations != expected) {
+            LOG_ERROR("VALIDATION ERROR: %li migrations between nodes (expected %li)\n",
+                stats->remote_migrations, expected);
+            return false;
+        }
+    } else if (!strcmp(mode, "bulk_copy_intra_chick")) {
+        for (long i = 0; i < data->n; ++i) {
+            if (data->dst[i] != i) {
+                LOG_ERROR("VALIDATION ERROR: dst[%li] == %li (supposed to be %li)\n", i, data->dst[i], i);
+                return false;
+            }
+        }
+    } else if (!strcmp(mode, "global_stream")) {
+        for (long nlet = 0; nlet < mn_nodelets(); ++nlet) {
+            for (long i = 0; i < data->n / mn_nodelets(); ++i) {
+                if (data->c[nlet][i] != 3) {
+                    LOG_ERROR("VALIDATION ERROR: c[%li][%li] == %li (supposed to be 3)\n",
+                        nlet, i, data->c[nlet][i]);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Returns the migration and spawn counts, summed over all trials
+mn_stats
+multinode_run(multinode_data * data, const char * name, mn_fn benchmark, long num_trials)
+{
+    mn_stats total = {0, 0, 0};
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        mn_reset_stats();
+        hooks_region_begin(name);
+        mn_run(benchmark, (long)data, 0, 0, 0);
+        mn_stats stats = mn_get_stats();
+        hooks_set_attr_i64("remote_migrations", stats.remote_migrations);
+        hooks_set_attr_i64("remote_spawns", stats.remote_spawns);
+        double time_ms = hooks_region_end();
+        total.remote_migrations += stats.remote_migrations;
+        total.local_migrations += stats.local_migrations;
+        total.remote_spawns += stats.remote_spawns;
+        if (benchmark == ping_pong_global) {
+            double migrations_per_second = time_ms == 0 ? 0 :
+                (data->n * data->num_threads) / (time_ms / 1000);
+            LOG("%3.2f million migrations per second\n", migrations_per_second / 1000000);
+        } else {
+            // bulk_copy counts a read and a write per element, global_stream two reads and a write
+            long bytes = data->n * sizeof(long) * (benchmark == global_stream ? 3 : 2);
+            double bytes_per_second = time_ms == 0 ? 0 : bytes / (time_ms / 1000);
+            LOG("%3.2f MB/s\n", bytes_per_second / 1000000);
+        }
+    }
+    return total;
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* mode;
+        long log2_num_elements;
+        long num_threads;
+        long num_trials;
+        long num_nodes;
+        long nodelets_per_node;
+    } args;
+
+    args.num_nodes = take_long_option(&argc, argv, "num_nodes", 2);
+    args.nodelets_per_node = take_long_option(&argc, argv, "nodelets_per_node", 8);
+
+    if (argc != 5) {
+        LOG("Usage: %s mode log2_num_elements num_threads num_trials [--num_nodes N] [--nodelets_per_node M]\n",
+            argv[0]);
+        exit(1);
+    } else {
+        args.mode = argv[1];
+        args.log2_num_elements = atol(argv[2]);
+        args.num_threads = atol(argv[3]);
+        args.num_trials = atol(argv[4]);
+
+        if (args.log2_num_elements <= 0) { LOG("log2_num_elements must be > 0"); exit(1); }
+        if (args.num_threads <= 0) { LOG("num_threads must be > 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+        if (args.num_nodes < 2) { LOG("num_nodes must be > 1"); exit(1); }
+    }
+
+    mn_fn benchmark;
+    if (!strcmp(args.mode, "ping_pong_global")) {
+        benchmark = ping_pong_global;
+    } else if (!strcmp(args.mode, "bulk_copy_intra_chick")) {
+        benchmark = bulk_copy_intra_chick;
+    } else if (!strcmp(args.mode, "global_stream")) {
+        benchmark = global_stream;
+    } else {
+        LOG("Mode %s not implemented!\n", args.mode);
+        exit(1);
+    }
+
+    hooks_set_attr_str("mode", args.mode);
+    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
+    hooks_set_attr_i64("num_threads", args.num_threads);
+    hooks_set_attr_i64("num_nodes", args.num_nodes);
+    hooks_set_attr_i64("num_nodelets", args.num_nodes * args.nodelets_per_node);
+
+    LOG("Starting %li node processes with %li nodelets each\n", args.num_nodes, args.nodelets_per_node);
+    mn_init(args.num_nodes, args.nodelets_per_node);
+
+    multinode_data * data = mn_localmalloc(sizeof(multinode_data), 0);
+    memset(data, 0, sizeof(multinode_data));
+    data->n = 1L << args.log2_num_elements;
+    data->num_threads = args.num_threads;
+    if (benchmark == global_stream && data->n < mn_nodelets()) {
+        LOG("global_stream needs at least one element per nodelet\n");
+        mn_deinit();
+        exit(1);
+    }
+    LOG("Initializing %s\n", args.mode);
+    multinode_data_init(data, args.mode);
+
+    mn_stats stats = multinode_run(data, args.mode, benchmark, args.num_trials);
+    LOG("%li migrations between nodes, %li within nodes, %li remote spawns\n",
+        stats.remote_migrations, stats.local_migrations, stats.remote_spawns);
+
+#ifndef NO_VALIDATE
+    LOG("Validating results...");
+    bool ok = multinode_validate(data, args.mode, &stats, args.num_trials);
+    runtime_assert(ok, "Validation failed");
+    LOG("OK\n");
+#endif
+
+    mn_deinit();
+    return 0;
+}
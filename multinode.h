@@ -0,0 +1,526 @@
+#pragma once
+
+#ifdef __le64__
+#error "multinode.h emulates multiple nodes on native builds, use the real thing on Emu"
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "common.h"
+
+/*
+ * Multi-node emulation on one Linux box.
+ *
+ * Native builds run every nodelet in a single address space, so the code paths that need more than one node
+ * (ping_pong global, bulk_copy intra_chick, global_stream across nodes) can't run at all. This backend runs
+ * each node as a process, with its own scheduler, and keeps the memory of every nodelet in a shared segment
+ * that is mapped at the same address in all of the processes:
+ *
+ *     mn_init(num_nodes, nodelets_per_node);       // Forks num_nodes - 1 processes
+ *     long ** a = (long**)mn_malloc2d(mn_nodelets(), bytes);
+ *     mn_run(root, (long)a, 0, 0, 0);              // Runs root(a, 0, 0, 0) as a thread on nodelet 0
+ *     mn_deinit();
+ *
+ * Threads are user-level contexts whose stacks live in shared memory, so a thread can stop in one process and
+ * carry on in another. mn_spawn_at() hands a new thread to the node that owns an address, and mn_migrate()
+ * hands the running thread over, through a queue in shared memory. Moving between nodelets of the same node
+ * only updates the thread's nodelet. Remote loads and stores are ordinary accesses to shared memory.
+ *
+ * The threads on a node take turns on that node's scheduler, and switch at migrations, spawns and syncs.
+ * Anything a thread uses must be in a segment (mn_localmalloc, mn_malloc2d) or passed as an argument:
+ * globals and the heap are private to each process, like replicated data, and writes to them after
+ * mn_init() aren't seen by the other nodes. Allocations are only freed by mn_deinit().
+ *
+ * Hand-offs go through the kernel's scheduler and the cache coherence protocol, so the rates say more about
+ * the structure of the code (how often it migrates, where threads end up) than about Emu hardware.
+ * The MULTINODE_SEGMENT_MB environment variable sets the size of each nodelet's segment (default 256).
+ */
+
+#define MN_MAX_NODES 16
+#define MN_MAX_NODELETS 256
+// Also the limit on live threads, so a hand-off never waits for room
+#define MN_QUEUE_SLOTS 4096
+#define MN_STACK_BYTES (64L * 1024)
+#define MN_ALIGN 64
+
+typedef void (*mn_fn)(long, long, long, long);
+
+typedef enum mn_thread_state {
+    MN_RUNNING,
+    MN_DONE,
+    MN_MOVING,
+    MN_YIELDING,
+} mn_thread_state;
+
+typedef struct mn_thread {
+    ucontext_t ctx;
+    char * stack;
+    long state;
+    long nodelet;
+    // Spawned threads that haven't finished yet
+    long children;
+    // Counter of the thread that spawned this one
+    long * parent_children;
+    mn_fn fn;
+    long args[4];
+    struct mn_thread * next_free;
+} mn_thread;
+
+// Bounded queue with a sequence number in each slot (Vyukov), any process can push, only the owner pops
+typedef struct mn_queue {
+    long head;
+    char pad0[MN_ALIGN - sizeof(long)];
+    long tail;
+    char pad1[MN_ALIGN - sizeof(long)];
+    struct {
+        long seq;
+        mn_thread * thread;
+    } slots[MN_QUEUE_SLOTS];
+} mn_queue;
+
+typedef struct mn_node_state {
+    mn_queue inbox;
+    // An idle scheduler sleeps on wake_seq while sleeping is set
+    int wake_seq;
+    long sleeping;
+    // Threads that arrived from other nodes
+    long migrations_in;
+    long spawns_in;
+    // Moves between nodelets of this node
+    long local_migrations;
+} mn_node_state;
+
+// Shared by every process
+typedef struct mn_control {
+    long num_nodes;
+    long nodelets_per_node;
+    long segment_bytes;
+    long shutdown;
+    // Empty polls before an idle scheduler goes to sleep
+    long idle_polls;
+    // Allocated bytes in each nodelet's segment
+    long used[MN_MAX_NODELETS];
+    // Recycled threads
+    long pool_lock;
+    mn_thread * free_threads;
+    long live_threads;
+    // Outstanding threads started by mn_run()
+    long root_children;
+    mn_node_state nodes[MN_MAX_NODES];
+} mn_control;
+
+typedef struct mn_stats {
+    long remote_migrations;
+    long local_migrations;
+    long remote_spawns;
+} mn_stats;
+
+// Private to each process, but set up before the fork so they are the same everywhere except mn_node
+static mn_control * mn_ctl;
+static char * mn_segments;
+static long mn_node;
+static pid_t mn_pids[MN_MAX_NODES];
+static ucontext_t mn_scheduler_ctx;
+// Thread running on this process's scheduler
+static mn_thread * mn_current;
+
+static inline long mn_num_nodes() { return mn_ctl->num_nodes; }
+static inline long mn_nodelets() { return mn_ctl->num_nodes * mn_ctl->nodelets_per_node; }
+static inline long mn_node_id() { return mn_node; }
+static inline long mn_nodelet_id() { return mn_current ? mn_current->nodelet : mn_node * mn_ctl->nodelets_per_node; }
+
+// Nodelet whose segment holds ptr
+static inline long
+mn_owner(const void * ptr)
+{
+    long offset = (const char*)ptr - mn_segments;
+    runtime_assert(offset >= 0 && offset < mn_nodelets() * mn_ctl->segment_bytes,
+        "Pointer is not in a multinode segment");
+    return offset / mn_ctl->segment_bytes;
+}
+
+static inline void
+mn_queue_init(mn_queue * q)
+{
+    q->head = 0;
+    q->tail = 0;
+    for (long i = 0; i < MN_QUEUE_SLOTS; ++i) {
+        q->slots[i].seq = i;
+    }
+}
+
+static inline void
+mn_queue_push(mn_queue * q, mn_thread * t)
+{
+    long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        long seq = __atomic_load_n(&q->slots[pos % MN_QUEUE_SLOTS].seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else {
+            // Lost a race with another producer (the queue can't be full)
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    q->slots[pos % MN_QUEUE_SLOTS].thread = t;
+    __atomic_store_n(&q->slots[pos % MN_QUEUE_SLOTS].seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Returns NULL if the queue is empty
+static inline mn_thread *
+mn_queue_pop(mn_queue * q)
+{
+    long pos = q->head;
+    if (__atomic_load_n(&q->slots[pos % MN_QUEUE_SLOTS].seq, __ATOMIC_ACQUIRE) != pos + 1) { return NULL; }
+    mn_thread * t = q->slots[pos % MN_QUEUE_SLOTS].thread;
+    __atomic_store_n(&q->slots[pos % MN_QUEUE_SLOTS].seq, pos + MN_QUEUE_SLOTS, __ATOMIC_RELEASE);
+    q->head = pos + 1;
+    return t;
+}
+
+static inline bool
+mn_queue_empty(mn_queue * q)
+{
+    return __atomic_load_n(&q->slots[q->head % MN_QUEUE_SLOTS].seq, __ATOMIC_ACQUIRE) != q->head + 1;
+}
+
+// Wakes a node's scheduler if it is asleep
+static inline void
+mn_wake(long node)
+{
+    mn_node_state * state = &mn_ctl->nodes[node];
+    // Pairs with the fence in mn_sleep, so either the sleeper sees the new work or we see it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&state->sleeping, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&state->wake_seq, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &state->wake_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Hands a thread to a node
+static inline void
+mn_post(long node, mn_thread * t)
+{
+    mn_queue_push(&mn_ctl->nodes[node].inbox, t);
+    mn_wake(node);
+}
+
+// Waits until this node has work, is woken, or a millisecond goes by
+static inline void
+mn_sleep()
+{
+    mn_node_state * state = &mn_ctl->nodes[mn_node];
+    int seq = __atomic_load_n(&state->wake_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&state->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (mn_queue_empty(&state->inbox)) {
+        struct timespec timeout = {0, 1000000};
+        syscall(SYS_futex, &state->wake_seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+    }
+    __atomic_store_n(&state->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+// Allocates bytes in a nodelet's segment
+static inline void *
+mn_localmalloc(long bytes, long nlet)
+{
+    runtime_assert(nlet >= 0 && nlet < mn_nodelets(), "Nodelet out of range");
+    long size = (bytes + MN_ALIGN - 1) / MN_ALIGN * MN_ALIGN;
+    long offset = __atomic_fetch_add(&mn_ctl->used[nlet], size, __ATOMIC_RELAXED);
+    runtime_assert(offset + size <= mn_ctl->segment_bytes, "Out of memory in multinode segment");
+    return mn_segments + nlet * mn_ctl->segment_bytes + offset;
+}
+
+// Like mw_malloc2d: a table of nlets pointers, pointer i to a block of bytes on nodelet i
+static inline void **
+mn_malloc2d(long nlets, long bytes)
+{
+    void ** table = mn_localmalloc(nlets * sizeof(void*), 0);
+    for (long i = 0; i < nlets; ++i) {
+        table[i] = mn_localmalloc(bytes, i);
+    }
+    return table;
+}
+
+static inline void
+mn_pool_lock()
+{
+    while (__atomic_exchange_n(&mn_ctl->pool_lock, 1, __ATOMIC_ACQUIRE)) {}
+}
+
+static inline void
+mn_pool_unlock()
+{
+    __atomic_store_n(&mn_ctl->pool_lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline mn_thread *
+mn_thread_alloc(long nlet)
+{
+    mn_pool_lock();
+    runtime_assert(mn_ctl->live_threads < MN_QUEUE_SLOTS, "Too many multinode threads");
+    mn_ctl->live_threads += 1;
+    mn_thread * t = mn_ctl->free_threads;
+    if (t) { mn_ctl->free_threads = t->next_free; }
+    mn_pool_unlock();
+    if (t == NULL) {
+        // New threads get their stack on the nodelet where they start
+        t = mn_localmalloc(sizeof(mn_thread), nlet);
+        t->stack = mn_localmalloc(MN_STACK_BYTES, nlet);
+    }
+    return t;
+}
+
+static inline void
+mn_thread_free(mn_thread * t)
+{
+    mn_pool_lock();
+    t->next_free = mn_ctl->free_threads;
+    mn_ctl->free_threads = t;
+    mn_ctl->live_threads -= 1;
+    mn_pool_unlock();
+}
+
+static inline void mn_sync();
+
+// Every thread starts here, on whichever process its node runs in
+static void
+mn_thread_start()
+{
+    mn_thread * t = mn_current;
+    t->fn(t->args[0], t->args[1], t->args[2], t->args[3]);
+    // Like the implicit cilk_sync at the end of a spawned function, so no child outlives the thread it
+    // decrements the counter of
+    mn_sync();
+    // mn_current may have changed if the thread migrated
+    t = mn_current;
+    t->state = MN_DONE;
+    setcontext(&mn_scheduler_ctx);
+}
+
+// Starts fn(a0, a1, a2, a3) as a new thread on the nodelet that owns where
+static inline void
+mn_spawn_at(const void * where, mn_fn fn, long a0, long a1, long a2, long a3)
+{
+    long nlet = mn_owner(where);
+    long node = nlet / mn_ctl->nodelets_per_node;
+    mn_thread * t = mn_thread_alloc(nlet);
+    t->fn = fn;
+    t->args[0] = a0; t->args[1] = a1; t->args[2] = a2; t->args[3] = a3;
+    t->nodelet = nlet;
+    t->children = 0;
+    t->state = MN_RUNNING;
+    t->parent_children = mn_current ? &mn_current->children : &mn_ctl->root_children;
+    __atomic_add_fetch(t->parent_children, 1, __ATOMIC_RELAXED);
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = t->stack;
+    t->ctx.uc_stack.ss_size = MN_STACK_BYTES;
+    t->ctx.uc_link = NULL;
+    makecontext(&t->ctx, mn_thread_start, 0);
+    if (node != mn_node) {
+        __atomic_add_fetch(&mn_ctl->nodes[node].spawns_in, 1, __ATOMIC_RELAXED);
+    }
+    mn_post(node, t);
+}
+
+// Starts a thread on the current nodelet
+static inline void
+mn_spawn(mn_fn fn, long a0, long a1, long a2, long a3)
+{
+    long nlet = mn_nodelet_id();
+    mn_spawn_at(mn_segments + nlet * mn_ctl->segment_bytes, fn, a0, a1, a2, a3);
+}
+
+// Gives the other threads on this node a turn
+static inline void
+mn_yield()
+{
+    mn_thread * t = mn_current;
+    t->state = MN_YIELDING;
+    swapcontext(&t->ctx, &mn_scheduler_ctx);
+}
+
+// Waits for every thread spawned by the current thread
+static inline void
+mn_sync()
+{
+    mn_thread * t = mn_current;
+    while (__atomic_load_n(&t->children, __ATOMIC_ACQUIRE) != 0) {
+        mn_yield();
+    }
+}
+
+// Moves the current thread to the nodelet that owns ptr. Returns on that nodelet's node.
+static inline void
+mn_migrate(const void * ptr)
+{
+    mn_thread * t = mn_current;
+    long nlet = mn_owner(ptr);
+    if (nlet == t->nodelet) { return; }
+    long node = nlet / mn_ctl->nodelets_per_node;
+    t->nodelet = nlet;
+    if (node == mn_node) {
+        __atomic_add_fetch(&mn_ctl->nodes[node].local_migrations, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    // The scheduler queues the thread on the other node once its context is saved
+    t->state = MN_MOVING;
+    swapcontext(&t->ctx, &mn_scheduler_ctx);
+}
+
+static inline void
+mn_remote_add(long * ptr, long value)
+{
+    __atomic_add_fetch(ptr, value, __ATOMIC_RELAXED);
+}
+
+// Runs threads from this node's queue until *counter is zero, or until shutdown if counter is NULL
+static inline void
+mn_schedule(long * counter)
+{
+    mn_queue * inbox = &mn_ctl->nodes[mn_node].inbox;
+    long idle = 0;
+    for (;;) {
+        if (counter ? __atomic_load_n(counter, __ATOMIC_ACQUIRE) == 0
+                    : __atomic_load_n(&mn_ctl->shutdown, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        mn_thread * t = mn_queue_pop(inbox);
+        if (t == NULL) {
+            if (++idle >= mn_ctl->idle_polls) { mn_sleep(); }
+            continue;
+        }
+        idle = 0;
+        mn_current = t;
+        swapcontext(&mn_scheduler_ctx, &t->ctx);
+        mn_current = NULL;
+        switch (t->state) {
+            case MN_DONE:
+                // mn_run() waits for the root threads on node 0
+                if (__atomic_sub_fetch(t->parent_children, 1, __ATOMIC_RELEASE) == 0
+                    && t->parent_children == &mn_ctl->root_children) {
+                    mn_wake(0);
+                }
+                mn_thread_free(t);
+                break;
+            case MN_MOVING: {
+                long node = t->nodelet / mn_ctl->nodelets_per_node;
+                t->state = MN_RUNNING;
+                __atomic_add_fetch(&mn_ctl->nodes[node].migrations_in, 1, __ATOMIC_RELAXED);
+                mn_post(node, t);
+                break;
+            }
+            case MN_YIELDING:
+                t->state = MN_RUNNING;
+                mn_queue_push(inbox, t);
+                break;
+        }
+    }
+}
+
+// Maps the segments and forks a process for each node after the first. Only returns on node 0.
+static inline void
+mn_init(long num_nodes, long nodelets_per_node)
+{
+    runtime_assert(num_nodes > 0 && num_nodes <= MN_MAX_NODES, "Too many nodes");
+    runtime_assert(nodelets_per_node > 0 && num_nodes * nodelets_per_node <= MN_MAX_NODELETS,
+        "Too many nodelets");
+    const char * env = getenv("MULTINODE_SEGMENT_MB");
+    long segment_bytes = (env ? atol(env) : 256) * 1024 * 1024;
+    runtime_assert(segment_bytes > 0, "MULTINODE_SEGMENT_MB must be > 0");
+
+    mn_ctl = mmap(NULL, sizeof(mn_control), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    runtime_assert(mn_ctl != MAP_FAILED, "Failed to map multinode control block");
+    // Pages are only backed once they are touched
+    mn_segments = mmap(NULL, num_nodes * nodelets_per_node * segment_bytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    runtime_assert(mn_segments != MAP_FAILED, "Failed to map multinode segments");
+
+    memset(mn_ctl, 0, sizeof(mn_control));
+    mn_ctl->num_nodes = num_nodes;
+    mn_ctl->nodelets_per_node = nodelets_per_node;
+    mn_ctl->segment_bytes = segment_bytes;
+    // Spin for a while before sleeping if every node has a core to itself, otherwise let the others run right away
+    mn_ctl->idle_polls = sysconf(_SC_NPROCESSORS_ONLN) >= num_nodes ? 100000 : 1;
+    for (long n = 0; n < num_nodes; ++n) {
+        mn_queue_init(&mn_ctl->nodes[n].inbox);
+    }
+
+    // Don't let the children print what's already buffered
+    log_flush();
+    fflush(stdout);
+    fflush(stderr);
+    mn_node = 0;
+    for (long n = 1; n < num_nodes; ++n) {
+        pid_t pid = fork();
+        runtime_assert(pid >= 0, "Failed to fork node process");
+        if (pid == 0) {
+            // Don't outlive the parent if it dies
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            mn_node = n;
+            mn_schedule(NULL);
+            log_flush();
+            _exit(0);
+        }
+        mn_pids[n] = pid;
+    }
+}
+
+// Stops the other nodes and unmaps the segments
+static inline void
+mn_deinit()
+{
+    __atomic_store_n(&mn_ctl->shutdown, 1, __ATOMIC_RELEASE);
+    for (long n = 1; n < mn_ctl->num_nodes; ++n) {
+        mn_wake(n);
+        waitpid(mn_pids[n], NULL, 0);
+    }
+    munmap(mn_segments, mn_nodelets() * mn_ctl->segment_bytes);
+    munmap(mn_ctl, sizeof(mn_control));
+    mn_ctl = NULL;
+    mn_segments = NULL;
+}
+
+// Runs fn(a0, a1, a2, a3) on nodelet 0 and waits for it and everything it spawns. Call from main on node 0.
+static inline void
+mn_run(mn_fn fn, long a0, long a1, long a2, long a3)
+{
+    mn_spawn_at(mn_segments, fn, a0, a1, a2, a3);
+    mn_schedule(&mn_ctl->root_children);
+}
+
+// Totals over all nodes since the last reset
+static inline mn_stats
+mn_get_stats()
+{
+    mn_stats stats = {0, 0, 0};
+    for (long n = 0; n < mn_ctl->num_nodes; ++n) {
+        stats.remote_migrations += mn_ctl->nodes[n].migrations_in;
+        stats.local_migrations += mn_ctl->nodes[n].local_migrations;
+        stats.remote_spawns += mn_ctl->nodes[n].spawns_in;
+    }
+    return stats;
+}
+
+static inline void
+mn_reset_stats()
+{
+    for (long n = 0; n < mn_ctl->num_nodes; ++n) {
+        mn_ctl->nodes[n].migrations_in = 0;
+        mn_ctl->nodes[n].local_migrations = 0;
+        mn_ctl->nodes[n].spawns_in = 0;
+    }
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <time.h>
+#include <limits.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+
+/*
+ * Per-nodelet timing of the leaf workers in a spawn tree (configure with -DENABLE_NODELET_TIMING=ON).
+ *
+ * hooks_region_end() only reports the time for the whole tree, so a slow nodelet is invisible.
+ * Each leaf worker calls nodelet_timer_leaf_begin() / nodelet_timer_leaf_end(), which record
+ * timestamps into a striped array, so the updates are local to the nodelet where the leaf starts.
+ * After each trial, nodelet_timer_report() prints:
+ *  - busy time per nodelet (first leaf start to last leaf finish on that nodelet)
+ *  - load imbalance (max / mean busy time over the nodelets in use, counting idle ones as 0)
+ *  - spawn tree latency (trial start until the last leaf starts)
+ * The leaf hooks are also enabled by -DENABLE_OCCUPANCY=ON, which only counts the active leaves (see occupancy.h).
+ * Otherwise every call except timing_now() compiles to nothing, so the leaves run exactly as they would without it.
+ */
+
+#ifdef __le64__
+// Emu Chick core clock is 175MHz
+#define TIMING_TICKS_PER_MS 175000.0
+static inline long
+timing_now()
+{
+    return CLOCK();
+}
+#else
+#define TIMING_TICKS_PER_MS 1000000.0
+static inline long
+timing_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+#endif
+
+typedef struct nodelet_timer {
+    // Timestamp at the start of the trial
+    long trial_start;
+    // Striped arrays, one element per nodelet
+    long * first_start;
+    long * last_start;
+    long * last_finish;
+    long * num_leaves;
+    // Number of leaves running on each nodelet, only updated with -DOCCUPANCY (see occupancy.h)
+    long * active;
+} nodelet_timer;
+
+replicated nodelet_timer nodelet_timers;
+
+static inline void
+atomic_min_long(long * ptr, long value)
+{
+    long old = *ptr;
+    while (value < old) {
+        long prev = ATOMIC_CAS(ptr, value, old);
+        if (prev == old) { break; }
+        old = prev;
+    }
+}
+
+static inline void
+atomic_max_long(long * ptr, long value)
+{
+    long old = *ptr;
+    while (value > old) {
+        long prev = ATOMIC_CAS(ptr, value, old);
+        if (prev == old) { break; }
+        old = prev;
+    }
+}
+
+static inline void
+nodelet_timer_init()
+{
+    mw_replicated_init((long*)&nodelet_timers.first_start, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&nodelet_timers.last_start, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&nodelet_timers.last_finish, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&nodelet_timers.num_leaves, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&nodelet_timers.active, (long)mw_malloc1dlong(NODELETS()));
+    runtime_assert(nodelet_timers.first_start && nodelet_timers.last_start
+        && nodelet_timers.last_finish && nodelet_timers.num_leaves && nodelet_timers.active,
+        "Failed to allocate per-nodelet timers");
+}
+
+static inline void
+nodelet_timer_deinit()
+{
+    mw_free(nodelet_timers.first_start);
+    mw_free(nodelet_timers.last_start);
+    mw_free(nodelet_timers.last_finish);
+    mw_free(nodelet_timers.num_leaves);
+    mw_free(nodelet_timers.active);
+}
+
+// Clear the timers, call before hooks_region_begin()
+static inline void
+nodelet_timer_reset()
+{
+    for (long i = 0; i < NODELETS(); ++i) {
+        nodelet_timers.first_start[i] = LONG_MAX;
+        nodelet_timers.last_start[i] = LONG_MIN;
+        nodelet_timers.last_finish[i] = LONG_MIN;
+        nodelet_timers.num_leaves[i] = 0;
+        nodelet_timers.active[i] = 0;
+    }
+}
+
+
+#if defined(NODELET_TIMING) || defined(OCCUPANCY)
+
+// Call at the start of each leaf worker, returns the nodelet to pass to nodelet_timer_leaf_end()
+static inline long
+nodelet_timer_leaf_begin()
+{
+    long nlet = NODE_ID();
+#ifdef NODELET_TIMING
+    long t = timing_now();
+    atomic_min_long(&nodelet_timers.first_start[nlet], t);
+    atomic_max_long(&nodelet_timers.last_start[nlet], t);
+    REMOTE_ADD(&nodelet_timers.num_leaves[nlet], 1);
+#endif
+#ifdef OCCUPANCY
+    REMOTE_ADD(&nodelet_timers.active[nlet], 1);
+#endif
+    return nlet;
+}
+
+// Call at the end of each leaf worker.
+// The finish time is charged to the nodelet where the leaf started, so a leaf that
+// migrated away during its work will migrate back once here.
+static inline void
+nodelet_timer_leaf_end(long nlet)
+{
+#ifdef NODELET_TIMING
+    long t = timing_now();
+    atomic_max_long(&nodelet_timers.last_finish[nlet], t);
+#endif
+#ifdef OCCUPANCY
+    REMOTE_ADD(&nodelet_timers.active[nlet], -1);
+#endif
+}
+
+#else
+
+static inline long nodelet_timer_leaf_begin() { return 0; }
+static inline void nodelet_timer_leaf_end(long nlet) { (void)nlet; }
+
+#endif
+
+#ifdef NODELET_TIMING
+
+// Mark the start of the trial, call right after hooks_region_begin()
+static inline void
+nodelet_timer_start()
+{
+    nodelet_timers.trial_start = timing_now();
+}
+
+// Print the per-nodelet busy times, load imbalance and spawn tree latency for the last trial.
+// num_nodelets is the number of nodelets the benchmark is spread over; those that ran no leaves count as idle.
+static inline void
+nodelet_timer_report(long num_nodelets)
+{
+    long num_active = 0;
+    double sum_ms = 0, max_ms = 0;
+    long last_start = LONG_MIN;
+    for (long i = 0; i < NODELETS(); ++i) {
+        if (nodelet_timers.num_leaves[i] == 0) { continue; }
+        double busy_ms = (nodelet_timers.last_finish[i] - nodelet_timers.first_start[i]) / TIMING_TICKS_PER_MS;
+        num_active += 1;
+        sum_ms += busy_ms;
+        if (busy_ms > max_ms) { max_ms = busy_ms; }
+        if (nodelet_timers.last_start[i] > last_start) { last_start = nodelet_timers.last_start[i]; }
+    }
+    // Nothing to report for modes without instrumented leaf workers
+    if (num_active == 0) { return; }
+
+    LOG("Per-nodelet busy time (ms):");
+    for (long i = 0; i < NODELETS(); ++i) {
+        if (nodelet_timers.num_leaves[i] == 0) {
+            LOG(" -");
+        } else {
+            LOG(" %3.3f", (nodelet_timers.last_finish[i] - nodelet_timers.first_start[i]) / TIMING_TICKS_PER_MS);
+        }
+    }
+    LOG("\n");
+    if (num_active > num_nodelets) { num_nodelets = num_active; }
+    double mean_ms = sum_ms / num_nodelets;
+    double spawn_latency_ms = (last_start - nodelet_timers.trial_start) / TIMING_TICKS_PER_MS;
+    LOG("Load imbalance (max/mean): %3.2f, spawn tree latency: %3.3f ms\n",
+        mean_ms == 0 ? 1.0 : max_ms / mean_ms, spawn_latency_ms);
+}
+
+#else
+
+static inline void nodelet_timer_start() {}
+static inline void nodelet_timer_report(long num_nodelets) { (void)num_nodelets; }
+
+#endif
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <stdio.h>
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+#include "nodelet_timing.h"
+
+/*
+ * Active thread occupancy sampling (configure with -DENABLE_OCCUPANCY=ON).
+ *
+ * Each leaf worker that calls nodelet_timer_leaf_begin() / nodelet_timer_leaf_end() is counted as active on the
+ * nodelet where it started. OCCUPANCY_RUN(CALL) runs CALL while a sampler polls the active count on every nodelet
+ * at a fixed interval:
+ *
+ *     hooks_region_begin(name);
+ *     OCCUPANCY_RUN(benchmark(data));
+ *     double time_ms = hooks_region_end();
+ *     occupancy_report();
+ *
+ * The peak and mean occupancy over all nodelets are attached to the region as the occupancy_peak and
+ * occupancy_mean attributes, and occupancy_report() prints the peak, mean and occupancy curve of each nodelet.
+ *
+ * On Emu there is one sampler thread on each nodelet, which takes up a thread context and some issue slots
+ * while the region runs. Native builds use a single pthread that samples every nodelet.
+ * The OCCUPANCY_INTERVAL_US environment variable sets the sampling interval (default 10us).
+ * Each nodelet keeps OCCUPANCY_SAMPLES samples; when a long region fills the buffer, adjacent samples are merged
+ * (keeping the larger one) and the interval doubles. Stopping the samplers adds up to one interval to the region.
+ * Without occupancy sampling, OCCUPANCY_RUN(CALL) is just CALL and occupancy_report() does nothing.
+ */
+
+#ifdef OCCUPANCY
+
+#ifndef __le64__
+#include <pthread.h>
+#endif
+
+#ifndef OCCUPANCY_SAMPLES
+#define OCCUPANCY_SAMPLES 1024
+#endif
+
+// Number of points printed for each curve
+#define OCCUPANCY_CURVE_POINTS 16
+
+typedef struct occupancy_state {
+    // Set on every copy to stop the samplers
+    long stop;
+    // Ticks between polls
+    long interval;
+    // Striped arrays, one element per nodelet
+    long * num_samples;
+    // Polls merged into each sample
+    long * stride;
+    long * peak;
+    long * sum;
+    long * num_polls;
+    // OCCUPANCY_SAMPLES samples on each nodelet
+    long ** samples;
+#ifndef __le64__
+    pthread_t thread;
+#endif
+} occupancy_state;
+
+replicated occupancy_state occupancy;
+
+static inline void
+occupancy_init()
+{
+    mw_replicated_init((long*)&occupancy.num_samples, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&occupancy.stride, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&occupancy.peak, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&occupancy.sum, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&occupancy.num_polls, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&occupancy.samples, (long)mw_malloc2d(NODELETS(), OCCUPANCY_SAMPLES * sizeof(long)));
+    runtime_assert(occupancy.num_samples && occupancy.stride && occupancy.peak && occupancy.sum
+        && occupancy.num_polls && occupancy.samples, "Failed to allocate occupancy buffers");
+    const char * env = getenv("OCCUPANCY_INTERVAL_US");
+    double interval_us = env ? atof(env) : 10;
+    runtime_assert(interval_us > 0, "OCCUPANCY_INTERVAL_US must be > 0");
+    mw_replicated_init(&occupancy.interval, (long)(interval_us * TIMING_TICKS_PER_MS / 1000) + 1);
+}
+
+static inline void
+occupancy_deinit()
+{
+    mw_free(occupancy.num_samples);
+    mw_free(occupancy.stride);
+    mw_free(occupancy.peak);
+    mw_free(occupancy.sum);
+    mw_free(occupancy.num_polls);
+    mw_free(occupancy.samples);
+}
+
+// Records one poll of the active count on a nodelet
+static inline void
+occupancy_poll(long nlet)
+{
+    long active = *(volatile long *)&nodelet_timers.active[nlet];
+    long * samples = occupancy.samples[nlet];
+    long n = occupancy.num_samples[nlet];
+    long polls = occupancy.num_polls[nlet];
+    // Start a new sample every stride polls
+    if (polls % occupancy.stride[nlet] == 0) {
+        if (n == OCCUPANCY_SAMPLES) {
+            for (long i = 0; i < n / 2; ++i) {
+                samples[i] = samples[2 * i] > samples[2 * i + 1] ? samples[2 * i] : samples[2 * i + 1];
+            }
+            n /= 2;
+            occupancy.stride[nlet] *= 2;
+        }
+        samples[n++] = active;
+    } else if (active > samples[n - 1]) {
+        samples[n - 1] = active;
+    }
+    occupancy.num_samples[nlet] = n;
+    occupancy.num_polls[nlet] = polls + 1;
+    occupancy.sum[nlet] += active;
+    if (active > occupancy.peak[nlet]) { occupancy.peak[nlet] = active; }
+}
+
+// Polls nodelets [first, first + count) until occupancy_end()
+static inline void
+occupancy_sample(long first, long count)
+{
+    for (long nlet = first; nlet < first + count; ++nlet) {
+        occupancy.num_samples[nlet] = 0;
+        occupancy.stride[nlet] = 1;
+        occupancy.peak[nlet] = 0;
+        occupancy.sum[nlet] = 0;
+        occupancy.num_polls[nlet] = 0;
+    }
+    long next = timing_now();
+    while (!*(volatile long *)&occupancy.stop) {
+        if (timing_now() < next) { continue; }
+        next += occupancy.interval;
+        for (long nlet = first; nlet < first + count; ++nlet) {
+            occupancy_poll(nlet);
+        }
+    }
+}
+
+static inline void
+occupancy_set_attrs()
+{
+    long peak = 0;
+    double mean = 0;
+    for (long i = 0; i < NODELETS(); ++i) {
+        if (occupancy.peak[i] > peak) { peak = occupancy.peak[i]; }
+        if (occupancy.num_polls[i] > 0) { mean += (double)occupancy.sum[i] / occupancy.num_polls[i]; }
+    }
+    hooks_set_attr_i64("occupancy_peak", peak);
+    hooks_set_attr_f64("occupancy_mean", mean / NODELETS());
+}
+
+#ifdef __le64__
+
+static void
+occupancy_sampler(long nlet)
+{
+    occupancy_sample(nlet, 1);
+}
+
+// Runs one sampler on each nodelet until occupancy_end()
+static void
+occupancy_sample_all()
+{
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        cilk_spawn_at(&occupancy.num_samples[nlet]) occupancy_sampler(nlet);
+    }
+    cilk_sync;
+}
+
+static inline void
+occupancy_begin()
+{
+    mw_replicated_init(&occupancy.stop, 0);
+}
+
+static inline void
+occupancy_end()
+{
+    mw_replicated_init(&occupancy.stop, 1);
+}
+
+#define OCCUPANCY_RUN(CALL)                                         \
+do {                                                                \
+    occupancy_begin();                                              \
+    cilk_spawn occupancy_sample_all();                              \
+    CALL;                                                           \
+    occupancy_end();                                                \
+    cilk_sync;                                                      \
+    occupancy_set_attrs();                                          \
+} while (0)
+
+#else
+
+static void *
+occupancy_sampler(void * arg)
+{
+    (void)arg;
+    occupancy_sample(0, NODELETS());
+    return NULL;
+}
+
+// A spinning Cilk strand could hold the only worker, so the native sampler is a separate thread
+static inline void
+occupancy_begin()
+{
+    occupancy.stop = 0;
+    runtime_assert(pthread_create(&occupancy.thread, NULL, occupancy_sampler, NULL) == 0,
+        "Failed to start occupancy sampler");
+}
+
+static inline void
+occupancy_end()
+{
+    __atomic_store_n(&occupancy.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(occupancy.thread, NULL);
+}
+
+#define OCCUPANCY_RUN(CALL)                                         \
+do {                                                                \
+    occupancy_begin();                                              \
+    CALL;                                                           \
+    occupancy_end();                                                \
+    occupancy_set_attrs();                                          \
+} while (0)
+
+#endif
+
+// Print the peak, mean and occupancy curve of each nodelet for the last trial
+static inline void
+occupancy_report()
+{
+    LOG("Occupancy (active leaves, curve points span equal parts of the region):\n");
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        long n = occupancy.num_samples[nlet];
+        long polls = occupancy.num_polls[nlet];
+        LOG("  nodelet %li: peak %li, mean %3.2f, curve", nlet, occupancy.peak[nlet],
+            polls ? (double)occupancy.sum[nlet] / polls : 0);
+        // Print at most OCCUPANCY_CURVE_POINTS points, each the peak of the samples it covers
+        long points = n < OCCUPANCY_CURVE_POINTS ? n : OCCUPANCY_CURVE_POINTS;
+        for (long p = 0; p < points; ++p) {
+            long peak = 0;
+            for (long i = p * n / points; i < (p + 1) * n / points; ++i) {
+                if (occupancy.samples[nlet][i] > peak) { peak = occupancy.samples[nlet][i]; }
+            }
+            LOG(" %li", peak);
+        }
+        LOG("\n");
+    }
+}
+
+#else
+
+#define OCCUPANCY_RUN(CALL) CALL
+static inline void occupancy_init() {}
+static inline void occupancy_deinit() {}
+static inline void occupancy_report() {}
+
+#endif
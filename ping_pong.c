@@ -13,6 +13,8 @@ typedef struct ping_pong_data {
     long * a;
     long num_migrations;
     long num_threads;
+    // What each of the num_migrations operations is, for reporting
+    const char * op_name;
 } ping_pong_data;
 
 void
@@ -20,6 +22,7 @@ ping_pong_init(ping_pong_data * data, long num_migrations, long num_threads)
 {
     data->num_migrations = num_migrations;
     data->num_threads = num_threads;
+    data->op_name = "migrations";
     data->a = mw_malloc1dlong(NODELETS());
 }
 
@@ -94,6 +97,113 @@ ping_pong_global_sweep_nlets(ping_pong_data * data, long src_nlet, long dst_nlet
     }
 }
 
+/*
+ * Variants of ping_pong_local where the remote access is an ordinary memory operation
+ * rather than MIGRATE(), so the cost of each kind of operation can be compared
+ */
+
+// A remote load migrates the thread to the data, so alternate between the two nodelets
+void
+ping_pong_load(ping_pong_data * data)
+{
+    volatile long * a = data->a;
+    long sum = 0;
+    // Each iteration does four migrating loads
+    long n = data->num_migrations / 4;
+    for (long i = 0; i < n; ++i) {
+        sum += a[1];
+        sum += a[0];
+        sum += a[1];
+        sum += a[0];
+    }
+    // Keep the loads from being optimized away
+    if (sum == -1) { LOG("%li\n", sum); }
+}
+
+// A remote store is sent to the other nodelet without migrating, so the thread stays put
+void
+ping_pong_store(ping_pong_data * data)
+{
+    volatile long * a = data->a;
+    // Each iteration does four remote stores
+    long n = data->num_migrations / 4;
+    for (long i = 0; i < n; ++i) {
+        a[1] = i;
+        a[1] = i;
+        a[1] = i;
+        a[1] = i;
+    }
+}
+
+// A remote atomic add is also sent without migrating
+void
+ping_pong_remote_add(ping_pong_data * data)
+{
+    long * a = data->a;
+    // Each iteration does four remote atomic adds
+    long n = data->num_migrations / 4;
+    for (long i = 0; i < n; ++i) {
+        REMOTE_ADD(&a[1], 1);
+        REMOTE_ADD(&a[1], 1);
+        REMOTE_ADD(&a[1], 1);
+        REMOTE_ADD(&a[1], 1);
+    }
+}
+
+static noinline void
+spawn_at_target(long * p)
+{
+    (void)p;
+}
+
+// Push the work instead: spawn an empty thread on the other nodelet
+void
+ping_pong_spawn_at(ping_pong_data * data)
+{
+    long * a = data->a;
+    // Each iteration does four remote spawns, and waits for them so the number of threads stays bounded
+    long n = data->num_migrations / 4;
+    for (long i = 0; i < n; ++i) {
+        cilk_spawn_at(&a[1]) spawn_at_target(&a[1]);
+        cilk_spawn_at(&a[1]) spawn_at_target(&a[1]);
+        cilk_spawn_at(&a[1]) spawn_at_target(&a[1]);
+        cilk_spawn_at(&a[1]) spawn_at_target(&a[1]);
+        cilk_sync;
+    }
+}
+
+void
+ping_pong_spawn_load(ping_pong_data * data)
+{
+    for (long i = 0; i < data->num_threads; ++i) {
+        cilk_spawn ping_pong_load(data);
+    }
+}
+
+void
+ping_pong_spawn_store(ping_pong_data * data)
+{
+    for (long i = 0; i < data->num_threads; ++i) {
+        cilk_spawn ping_pong_store(data);
+    }
+}
+
+void
+ping_pong_spawn_remote_add(ping_pong_data * data)
+{
+    for (long i = 0; i < data->num_threads; ++i) {
+        cilk_spawn ping_pong_remote_add(data);
+    }
+}
+
+void
+ping_pong_spawn_spawn_at(ping_pong_data * data)
+{
+    for (long i = 0; i < data->num_threads; ++i) {
+        cilk_spawn ping_pong_spawn_at(data);
+    }
+}
+
 void
 ping_pong_spawn_local(ping_pong_data * data)
 {
@@ -171,6 +281,46 @@ ping_pong_spawn_global_sweep_nlets(ping_pong_data * data)
     }
 }
 
+static void
+spawn_local_threads(ping_pong_data * data, long num_threads)
+{
+    for (long i = 0; i < num_threads; ++i) {
+        cilk_spawn ping_pong_local(data);
+    }
+}
+
+// Step the number of threads doing local ping pong from 1 to num_threads (doubling, or adding step each time),
+// to find where the migration queues saturate. Each step is its own region, with num_threads set to the step.
+void
+ping_pong_thread_sweep(ping_pong_data * data, long step, long num_trials)
+{
+    LOG("threads, million migrations per second (total), latency (amortized, us)\n");
+    double prev_throughput = 0;
+    long knee = 0;
+    for (long t = 1; t <= data->num_threads; t = step > 0 ? t + step : t * 2) {
+        hooks_set_attr_i64("num_threads", t);
+        double best_throughput = 0;
+        for (long trial = 0; trial < num_trials; ++trial) {
+            hooks_set_attr_i64("trial", trial);
+            hooks_region_begin("ping_pong");
+            spawn_local_threads(data, t);
+            double time_ms = hooks_region_end();
+            if (time_ms == 0) return; // simulator was run without timing mode enabled
+            double throughput = (t * data->num_migrations) / (time_ms/1e3);
+            // Each thread does num_migrations in the whole time
+            double latency_us = (time_ms * 1e3) / data->num_migrations;
+            LOG("%li, %3.2f, %3.3f\n", t, throughput / 1e6, latency_us);
+            if (throughput > best_throughput) { best_throughput = throughput; }
+        }
+        // The knee is the first step that adds less than 10% throughput
+        if (knee == 0 && prev_throughput > 0 && best_throughput < 1.1 * prev_throughput) { knee = t; }
+        prev_throughput = best_throughput;
+    }
+    if (knee != 0) {
+        LOG("Throughput stops scaling at %li threads\n", knee);
+    }
+}
+
 void ping_pong_run(
     ping_pong_data * data,
     const char * name,
@@ -184,7 +334,7 @@ void ping_pong_run(
         double time_ms = hooks_region_end();
         if (time_ms == 0) return; // simulator was run without timing mode enabled
         double migrations_per_second = (data->num_migrations) / (time_ms/1e3);
-        LOG("%3.2f million migrations per second\n", migrations_per_second / (1e6));
+        LOG("%3.2f million %s per second\n", migrations_per_second / (1e6), data->op_name);
         LOG("Latency (amortized): %3.2f us\n", (1.0 / migrations_per_second) * 1e6);
     }
 }
@@ -198,8 +348,10 @@ int main(int argc, char** argv)
         long num_trials;
     } args;
 
+    long sweep_step = take_long_option(&argc, argv, "step", 0);
+
     if (argc != 5) {
-        LOG("Usage: %s mode log2_num_migrations num_threads num_trials\n", argv[0]);
+        LOG("Usage: %s mode log2_num_migrations num_threads num_trials [--step K]\n", argv[0]);
         exit(1);
     } else {
         args.mode = argv[1];
@@ -233,6 +385,20 @@ int main(int argc, char** argv)
         RUN_BENCHMARK(ping_pong_spawn_global_sweep);
     } else if (!strcmp(args.mode, "global_sweep_nlets")) {
         RUN_BENCHMARK(ping_pong_spawn_global_sweep_nlets);
+    } else if (!strcmp(args.mode, "thread_sweep")) {
+        ping_pong_thread_sweep(&data, sweep_step, args.num_trials);
+    } else if (!strcmp(args.mode, "load")) {
+        data.op_name = "migrating loads";
+        RUN_BENCHMARK(ping_pong_spawn_load);
+    } else if (!strcmp(args.mode, "store")) {
+        data.op_name = "remote stores";
+        RUN_BENCHMARK(ping_pong_spawn_store);
+    } else if (!strcmp(args.mode, "remote_add")) {
+        data.op_name = "remote adds";
+        RUN_BENCHMARK(ping_pong_spawn_remote_add);
+    } else if (!strcmp(args.mode, "spawn_at")) {
+        data.op_name = "remote spawns";
+        RUN_BENCHMARK(ping_pong_spawn_spawn_at);
     } else {
         LOG("Mode %s not implemented!", args.mode);
     }
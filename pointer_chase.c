@@ -8,8 +8,19 @@
 #include <getopt.h>
 #include <limits.h>
 #include <emu_c_utils/emu_c_utils.h>
+#ifndef __le64__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "common.h"
+#include "rng.h"
+#include "scaling.h"
+#include "nodelet_timing.h"
+#include "occupancy.h"
+#include "locality.h"
 
 typedef struct node {
     struct node * next;
@@ -25,68 +36,48 @@ enum sort_mode {
 
 typedef struct pointer_chase_data {
     long n;
+    // Number of elements in the pool, only the first num_nodelets nodelets hold elements of the list
+    long pool_size;
+    long num_nodelets;
     long block_size;
     long num_threads;
     // Threads accumulate result into this field, to prevent over-optimization
     long sum;
     enum sort_mode sort_mode;
+    // Seed for the shuffles
+    long seed;
     // One pointer per thread
     node ** heads;
     // Actual array pointer
     node ** pool;
     // Ordering of linked list nodes
     long * indices;
+    // Mapping of the snapshot file that indices points into, if it was restored from one
+    void * snapshot;
+    long snapshot_bytes;
+    // List ranking state, indexed by position in the pool (so striped the same way)
+    // Only allocated for the list_rank modes, see list_rank_init()
+    long * succ;
+    long * rank;
+    long * aux1;
+    long * aux2;
+    long ruler_spacing;
 } pointer_chase_data;
 
 replicated pointer_chase_data data;
 
-#define LCG_MUL64 6364136223846793005ULL
-#define LCG_ADD64 1
-
-void
-lcg_init(unsigned long * x, unsigned long step)
-{
-    unsigned long mul_k, add_k, ran, un;
-
-    mul_k = LCG_MUL64;
-    add_k = LCG_ADD64;
-
-    ran = 1;
-    for (un = step; un; un >>= 1) {
-        if (un & 1)
-            ran = mul_k * ran + add_k;
-        add_k *= (mul_k + 1);
-        mul_k *= mul_k;
-    }
-
-    *x = ran;
-}
-
-unsigned long
-lcg_rand(unsigned long * x) {
-    *x = LCG_MUL64 * *x + LCG_ADD64;
-    return *x;
-}
-
-//https://benpfaff.org/writings/clc/shuffle.html
-/* Arrange the N elements of ARRAY in random order.
-   Only effective if N is much smaller than RAND_MAX;
-   if this may not be the case, use a better random
-   number generator. */
-void shuffle(long *array, size_t n)
+// Fisher-Yates shuffle, drawing from one stream of the counter-based generator,
+// so the result depends only on the seed and not on where the array was allocated
+void shuffle(long *array, size_t n, long seed, unsigned long stream)
 {
-    unsigned long rand_state;
-    lcg_init(&rand_state, (unsigned long)array);
-    if (n > 1)
+    rng_state rand_state;
+    rng_init(&rand_state, seed, stream);
+    for (size_t i = 0; i + 1 < n; i++)
     {
-        size_t i;
-        for (i = 0; i < n - 1; i++)
-        {
-            size_t j = i + lcg_rand(&rand_state) / (ULONG_MAX / (n - i) + 1);
-            long t = array[j];
-            array[j] = array[i];
-            array[i] = t;
-        }
+        size_t j = i + rng_below(rng_next(&rand_state), n - i);
+        long t = array[j];
+        array[j] = array[i];
+        array[i] = t;
     }
 }
 
@@ -117,7 +108,7 @@ strided_index_init_worker(long begin, long end, va_list args)
 
 static inline node *
 get_node_ptr(pointer_chase_data* data, long i) {
-    return mw_arrayindex((long*)data->pool, (size_t)i, (size_t)data->n, sizeof(node));
+    return mw_arrayindex((long*)data->pool, (size_t)i, (size_t)data->pool_size, sizeof(node));
 }
 
 static void
@@ -190,41 +181,140 @@ intra_block_shuffle_worker(long begin, long end, va_list args)
     pointer_chase_data* data = va_arg(args, pointer_chase_data *);
     long block_size = va_arg(args, long);
     for (long block_id = begin; block_id < end; ++block_id) {
-        shuffle(data->indices + block_id * block_size, block_size);
+        shuffle(data->indices + block_id * block_size, block_size, data->seed, 1 + block_id);
     }
 }
 
-void
-pointer_chase_data_init(pointer_chase_data * data, long n, long block_size, long num_threads, enum sort_mode sort_mode)
+/*
+ * Snapshots of the shuffled index array, so repeated runs on native builds can skip the shuffles.
+ * The file is keyed by everything that determines the shuffle, and is mapped back in without copying.
+ * The pool itself holds absolute pointers, so it is always relinked from the indices.
+ */
+typedef struct pointer_chase_snapshot {
+    char magic[8];
+    long n;
+    long pool_size;
+    long block_size;
+    long sort_mode;
+    long seed;
+    // The strided index pattern depends on the number of nodelets
+    long nodelets;
+    long reserved;
+} pointer_chase_snapshot;
+
+static const char snapshot_magic[8] = "PCSNAP2";
+
+static void
+snapshot_header_init(pointer_chase_snapshot * header, pointer_chase_data * data)
 {
-    data->n = n;
-    data->block_size = block_size;
-    data->num_threads = num_threads;
-    data->sort_mode = sort_mode;
-    mw_replicated_init(&data->sum, 0);
-    // Allocate N nodes, striped across nodelets
-    data->pool = mw_malloc2d(n, sizeof(node));
-    runtime_assert(data->pool != NULL, "Failed to allocate element pool");
-    // Store a pointer for this thread's head of the list
-    data->heads = (node**)mw_malloc1dlong(num_threads);
-    runtime_assert(data->heads != NULL, "Failed to allocate pointers for each thread");
-    // Make an array with entries 1 through n
-    data->indices = mw_mallocrepl(n * sizeof(long));
-    runtime_assert(data->indices != NULL, "Failed to allocate local index array");
+    memset(header, 0, sizeof(pointer_chase_snapshot));
+    memcpy(header->magic, snapshot_magic, sizeof(snapshot_magic));
+    header->n = data->n;
+    header->pool_size = data->pool_size;
+    header->block_size = data->block_size;
+    header->sort_mode = data->sort_mode;
+    header->seed = data->seed;
+    header->nodelets = NODELETS();
+}
 
-    LOG("Replicating pointers...\n");
-    // Replicate pointers to all other nodelets
-    data = mw_get_nth(data, 0);
-    for (long i = 1; i < NODELETS(); ++i) {
-        pointer_chase_data * remote_data = mw_get_nth(data, i);
-        memcpy(remote_data, data, sizeof(pointer_chase_data));
+static void
+snapshot_path(char * path, size_t len, const char * dir, pointer_chase_data * data)
+{
+    snprintf(path, len, "%s/pointer_chase.n%li.pool%li.bs%li.sort%i.seed%li.nlets%li.idx",
+        dir, data->n, data->pool_size, data->block_size, (int)data->sort_mode, data->seed, NODELETS());
+}
+
+#ifndef __le64__
+// Try to map the index array from a snapshot file. Returns false if there is no matching snapshot.
+static bool
+pointer_chase_snapshot_restore(pointer_chase_data * data, const char * dir)
+{
+    char path[4096];
+    snapshot_path(path, sizeof(path), dir, data);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return false; }
+
+    struct stat st;
+    long bytes = sizeof(pointer_chase_snapshot) + data->n * sizeof(long);
+    if (fstat(fd, &st) != 0 || st.st_size != bytes) {
+        LOG("Ignoring snapshot %s with unexpected size\n", path);
+        close(fd);
+        return false;
     }
+    // Private mapping, so the pages are shared with the page cache until something writes to them
+    void * map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return false; }
+
+    pointer_chase_snapshot expected;
+    snapshot_header_init(&expected, data);
+    if (memcmp(map, &expected, sizeof(pointer_chase_snapshot))) {
+        LOG("Ignoring snapshot %s with mismatched header\n", path);
+        munmap(map, bytes);
+        return false;
+    }
+
+    LOG("Restored indices from %s\n", path);
+    data->snapshot = map;
+    data->snapshot_bytes = bytes;
+    data->indices = (long*)((char*)map + sizeof(pointer_chase_snapshot));
+    return true;
+}
+
+// Write the index array to a snapshot file, so the next run can restore it
+static void
+pointer_chase_snapshot_save(pointer_chase_data * data, const char * dir)
+{
+    char path[4096], tmp_path[4096 + 8];
+    snapshot_path(path, sizeof(path), dir, data);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    pointer_chase_snapshot header;
+    snapshot_header_init(&header, data);
+    FILE * f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        LOG("Failed to create snapshot %s\n", tmp_path);
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+           && fwrite(data->indices, sizeof(long), data->n, f) == (size_t)data->n;
+    ok = (fclose(f) == 0) && ok;
+    // Rename into place so concurrent runs never see a partial file
+    if (!ok || rename(tmp_path, path) != 0) {
+        LOG("Failed to write snapshot %s\n", path);
+        remove(tmp_path);
+        return;
+    }
+    LOG("Saved indices to %s\n", path);
+}
+#else
+// There is no file system to map from on Emu hardware
+static bool
+pointer_chase_snapshot_restore(pointer_chase_data * data, const char * dir)
+{
+    LOG("Snapshots are only supported on native builds, ignoring --snapshot_dir\n");
+    return false;
+}
+
+static void
+pointer_chase_snapshot_save(pointer_chase_data * data, const char * dir)
+{
+}
+#endif
+
+// Shuffle the index array according to the sort mode
+static void
+pointer_chase_indices_init(pointer_chase_data * data)
+{
+    long n = data->n;
+    long block_size = data->block_size;
 
     // Initialize with striped index pattern (i.e. 0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15)
     // This will transform malloc2D address mode to sequential
+    // Striding over the whole pool keeps the first n indices on the first num_nodelets nodelets
     LOG("Initializing indices...\n");
     emu_local_for(0, n, LOCAL_GRAIN(n),
-        strided_index_init_worker, data->indices, (void*)n
+        strided_index_init_worker, data->indices, (void*)data->pool_size
     );
 
     bool do_block_shuffle = false, do_intra_block_shuffle = false;
@@ -262,8 +352,8 @@ pointer_chase_data_init(pointer_chase_data * data, long n, long block_size, long
         );
 
         LOG("shuffle block_indices...\n");
-        // Randomly shuffle it
-        shuffle(block_indices, num_blocks);
+        // Randomly shuffle it, stream 0 is the one not used by the intra-block shuffles
+        shuffle(block_indices, num_blocks, data->seed, 0);
 
         LOG("copy old_indices...\n");
         // Make a copy of the indices array
@@ -289,15 +379,70 @@ pointer_chase_data_init(pointer_chase_data * data, long n, long block_size, long
             intra_block_shuffle_worker, data, (void*)block_size
         );
     }
+}
+
+// Index of thread i's list head. heads is striped across every nodelet, but only the first num_nodelets
+// hold heads: head i is on nodelet i % num_nodelets.
+static inline long
+head_index(pointer_chase_data * data, long i)
+{
+    return (i / data->num_nodelets) * NODELETS() + i % data->num_nodelets;
+}
+
+void
+pointer_chase_data_init(pointer_chase_data * data, long n, long block_size, long num_threads, enum sort_mode sort_mode,
+    long num_nodelets, long seed, const char * snapshot_dir)
+{
+    data->n = n;
+    data->pool_size = scaling_alloc_elements(n, num_nodelets);
+    data->num_nodelets = num_nodelets;
+    data->block_size = block_size;
+    data->num_threads = num_threads;
+    data->sort_mode = sort_mode;
+    data->seed = seed;
+    data->snapshot = NULL;
+    data->snapshot_bytes = 0;
+    data->succ = data->rank = data->aux1 = data->aux2 = NULL;
+    data->ruler_spacing = 1;
+    mw_replicated_init(&data->sum, 0);
+    // Allocate N nodes, striped across nodelets
+    data->pool = mw_malloc2d(data->pool_size, sizeof(node));
+    runtime_assert(data->pool != NULL, "Failed to allocate element pool");
+    // Store a pointer for this thread's head of the list
+    data->heads = (node**)mw_malloc1dlong(head_index(data, num_threads - 1) + 1);
+    runtime_assert(data->heads != NULL, "Failed to allocate pointers for each thread");
+    // Make an array with entries 1 through n, or map it from a snapshot of a previous run
+    runtime_assert((n % block_size) == 0, "Block size must evenly divide number of elements");
+    bool restored = snapshot_dir != NULL && pointer_chase_snapshot_restore(data, snapshot_dir);
+    if (!restored) {
+        data->indices = mw_mallocrepl(n * sizeof(long));
+        runtime_assert(data->indices != NULL, "Failed to allocate local index array");
+    }
 
-    LOG("Scattering index array...\n");
-    // emu_replicated_array_init(data->indices, sizeof(long), n);
-    long * local_indices = mw_get_nth(data->indices, 0);
+    LOG("Replicating pointers...\n");
+    // Replicate pointers to all other nodelets
+    data = mw_get_nth(data, 0);
     for (long i = 1; i < NODELETS(); ++i) {
-        long * remote_indices = mw_get_nth(data->indices, i);
-        cilk_spawn_at(local_indices) memcpy(remote_indices, local_indices, sizeof(long) * n);
+        pointer_chase_data * remote_data = mw_get_nth(data, i);
+        memcpy(remote_data, data, sizeof(pointer_chase_data));
     }
-    cilk_sync;
+
+    if (!restored) {
+        pointer_chase_indices_init(data);
+        if (snapshot_dir != NULL) {
+            pointer_chase_snapshot_save(data, snapshot_dir);
+        }
+
+        LOG("Scattering index array...\n");
+        // emu_replicated_array_init(data->indices, sizeof(long), n);
+        long * local_indices = mw_get_nth(data->indices, 0);
+        for (long i = 1; i < NODELETS(); ++i) {
+            long * remote_indices = mw_get_nth(data->indices, i);
+            cilk_spawn_at(local_indices) memcpy(remote_indices, local_indices, sizeof(long) * n);
+        }
+        cilk_sync;
+    }
+    // Snapshots are only restored on native builds, which keep a single copy of replicated data
 
     LOG("Linking nodes together...\n");
     long grain = GLOBAL_GRAIN_MIN(data->n, 64);
@@ -321,7 +466,7 @@ pointer_chase_data_init(pointer_chase_data * data, long n, long block_size, long
        // );
 
         // Store a pointer for this thread's head of the list
-        data->heads[i] = get_node_ptr(data, data->indices[first_index]);
+        data->heads[head_index(data, i)] = get_node_ptr(data, data->indices[first_index]);
         // Set this thread's tail to null so it knows where to stop
         get_node_ptr(data, data->indices[last_index])->next = NULL;
     }
@@ -332,24 +477,33 @@ pointer_chase_data_deinit(pointer_chase_data * data)
 {
     mw_free(data->pool);
     mw_free(data->heads);
+#ifndef __le64__
+    if (data->snapshot) {
+        munmap(data->snapshot, data->snapshot_bytes);
+        return;
+    }
+#endif
     free(data->indices);
 }
 
 static noinline void
 chase_pointers(node * head, long * sum)
 {
+    long nlet = nodelet_timer_leaf_begin();
     long local_sum = 0;
-    for (node * p = head; p != NULL; p = p->next) {
-        local_sum += p->weight;
+    for (node * p = head; p != NULL; p = LOCALITY_READ(p->next)) {
+        local_sum += LOCALITY_READ(p->weight);
     }
-    REMOTE_ADD(sum, local_sum);
+    REMOTE_ADD(LOCALITY_REMOTE(sum), local_sum);
+    nodelet_timer_leaf_end(nlet);
 }
 
 void
 pointer_chase_serial_spawn(pointer_chase_data * data)
 {
     for (long i = 0; i < data->num_threads; ++i) {
-        cilk_spawn chase_pointers(data->heads[i], &data->sum);
+        node * head = LOCALITY_READ(data->heads[head_index(data, i)]);
+        LOCALITY_SPAWN(chase_pointers(head, &data->sum));
     }
 }
 
@@ -357,9 +511,10 @@ void
 serial_spawn_local(pointer_chase_data * data)
 {
     // Spawn a thread for each list head located at this nodelet
-    // Using striped indexing to avoid migrations
-    for (long i = NODE_ID(); i < data->num_threads; i += NODELETS()) {
-        cilk_spawn chase_pointers(data->heads[i], &data->sum);
+    // head_index() puts every head this loop reads on this nodelet, so there are no migrations
+    for (long i = NODE_ID(); i < data->num_threads; i += data->num_nodelets) {
+        node * head = LOCALITY_READ(data->heads[head_index(data, i)]);
+        LOCALITY_SPAWN(chase_pointers(head, &data->sum));
     }
 }
 
@@ -367,9 +522,9 @@ void
 pointer_chase_serial_remote_spawn(pointer_chase_data * data)
 {
     // Spawn a thread at each nodelet
-    for (long nodelet_id = 0; nodelet_id < NODELETS(); ++nodelet_id ) {
+    for (long nodelet_id = 0; nodelet_id < data->num_nodelets; ++nodelet_id ) {
         if (nodelet_id >= data->num_threads) { break; }
-        cilk_spawn_at(&data->heads[nodelet_id]) serial_spawn_local(data);
+        LOCALITY_SPAWN_AT(&data->heads[head_index(data, nodelet_id)], serial_spawn_local(data));
     }
 }
 
@@ -393,8 +548,10 @@ void pointer_chase_run(
     for (long trial = 0; trial < num_trials; ++trial) {
         hooks_set_attr_i64("trial", trial);
         mw_replicated_init(&data->sum, 0);
+        nodelet_timer_reset();
         hooks_region_begin("chase_pointers");
-        benchmark(data);
+        nodelet_timer_start();
+        OCCUPANCY_RUN(benchmark(data));
         double time_ms = hooks_region_end();
 #ifndef NO_VALIDATE
         // Sum of all integers from 0 to n
@@ -406,6 +563,256 @@ void pointer_chase_run(
         double bytes_per_second = time_ms == 0 ? 0 :
             (data->n * sizeof(node)) / (time_ms/1000);
         LOG("%3.2f MB/s\n", bytes_per_second / (1000000));
+        nodelet_timer_report(data->num_nodelets);
+        occupancy_report();
+    }
+}
+
+/*
+ * List ranking: compute the distance from every node to the tail of the list.
+ * The list is the same one that is traversed above, but without the chops, so node
+ * number i (its weight) has rank n - 1 - i.
+ * The algorithms work on arrays of pool positions rather than the node pointers,
+ * and these arrays are striped the same way as the pool, so each access to a successor
+ * migrates to the nodelet that holds it.
+ */
+
+// Marks the end of the list in succ
+#define NIL (-1L)
+
+// Number of rulers per thread in the sparse ruling set algorithm
+#define RULERS_PER_THREAD 8
+
+static inline void
+replicated_init_ptr(long ** ptr, long * val)
+{
+    mw_replicated_init((long*)ptr, (long)val);
+}
+
+void
+list_rank_init(pointer_chase_data * data)
+{
+    replicated_init_ptr(&data->succ, mw_malloc1dlong(data->pool_size));
+    replicated_init_ptr(&data->rank, mw_malloc1dlong(data->pool_size));
+    replicated_init_ptr(&data->aux1, mw_malloc1dlong(data->pool_size));
+    replicated_init_ptr(&data->aux2, mw_malloc1dlong(data->pool_size));
+    runtime_assert(data->succ && data->rank && data->aux1 && data->aux2,
+        "Failed to allocate list ranking arrays");
+    // Pick the spacing so each thread has a few sublists to walk
+    long spacing = data->n / (data->num_threads * RULERS_PER_THREAD);
+    mw_replicated_init(&data->ruler_spacing, spacing > 1 ? spacing : 1);
+}
+
+void
+list_rank_deinit(pointer_chase_data * data)
+{
+    mw_free(data->succ);
+    mw_free(data->rank);
+    mw_free(data->aux1);
+    mw_free(data->aux2);
+}
+
+static inline long
+list_rank_grain(pointer_chase_data * data)
+{
+    long grain = data->pool_size / data->num_threads;
+    return grain > 1 ? grain : 1;
+}
+
+// Fill in the successor of each node from the index array, and an initial rank
+// of 1 for each node (0 for the tail)
+static void
+list_rank_reset_worker(long begin, long end, va_list args)
+{
+    pointer_chase_data * data = va_arg(args, pointer_chase_data *);
+    long * indices = data->indices;
+    for (long i = begin; i < end; ++i) {
+        long a = indices[i];
+        if (i == data->n - 1) {
+            data->succ[a] = NIL;
+            data->rank[a] = 0;
+        } else {
+            data->succ[a] = indices[i + 1];
+            data->rank[a] = 1;
+        }
+    }
+}
+
+void
+list_rank_reset(pointer_chase_data * data)
+{
+    emu_local_for(0, data->n, LOCAL_GRAIN(data->n),
+        list_rank_reset_worker, data
+    );
+}
+
+// One round of pointer jumping: each node adds the rank of its successor and skips over it
+static noinline void
+wyllie_worker(long * array, long begin, long end, va_list args)
+{
+    long * succ_in = va_arg(args, long*);
+    long * rank_in = va_arg(args, long*);
+    long * succ_out = va_arg(args, long*);
+    long * rank_out = va_arg(args, long*);
+    long num_nodelets = va_arg(args, long);
+    const long nodelets = NODELETS();
+    // Skip the nodelets that are not in use
+    if (begin % nodelets >= num_nodelets) { return; }
+    long nlet = nodelet_timer_leaf_begin();
+    for (long i = begin; i < end; i += nodelets) {
+        long s = succ_in[i];
+        if (s == NIL) {
+            rank_out[i] = rank_in[i];
+            succ_out[i] = NIL;
+        } else {
+            rank_out[i] = rank_in[i] + rank_in[s];
+            succ_out[i] = succ_in[s];
+        }
+    }
+    nodelet_timer_leaf_end(nlet);
+}
+
+// Wyllie's algorithm: log2(n) rounds of pointer jumping over every node, O(n log n) work
+void
+pointer_chase_list_rank_wyllie(pointer_chase_data * data)
+{
+    long grain = list_rank_grain(data);
+    long num_rounds = 0;
+    for (long span = 1; span < data->n; span *= 2) { num_rounds += 1; }
+    // Double buffered, round up to an even number of rounds so the result ends up in rank
+    // (rounds after the last one just copy)
+    if (num_rounds % 2) { num_rounds += 1; }
+    for (long round = 0; round < num_rounds; round += 2) {
+        emu_1d_array_apply(data->succ, data->pool_size, grain,
+            wyllie_worker, data->succ, data->rank, data->aux1, data->aux2, data->num_nodelets
+        );
+        emu_1d_array_apply(data->succ, data->pool_size, grain,
+            wyllie_worker, data->aux1, data->aux2, data->succ, data->rank, data->num_nodelets
+        );
+    }
+}
+
+// Rulers are picked with a hash of their position, so the choice costs no memory accesses.
+// The head is always a ruler so that every node follows one.
+static inline bool
+is_ruler(pointer_chase_data * data, long i)
+{
+    if (i == data->indices[0]) { return true; }
+    unsigned long x = (unsigned long)i * 0x9e3779b97f4a7c15UL;
+    return ((x >> 32) % data->ruler_spacing) == 0;
+}
+
+// Each ruler walks its sublist up to the next ruler, recording in each node
+// the ruler that owns it (aux1) and the distance from that ruler (aux2).
+// The ruler itself records the next ruler (aux1) and the length of its sublist (aux2).
+static noinline void
+ruling_set_walk_worker(long * array, long begin, long end, va_list args)
+{
+    pointer_chase_data * data = va_arg(args, pointer_chase_data *);
+    const long nodelets = NODELETS();
+    if (begin % nodelets >= data->num_nodelets) { return; }
+    long nlet = nodelet_timer_leaf_begin();
+    long * succ = data->succ;
+    long * owner = data->aux1;
+    long * dist = data->aux2;
+    for (long r = begin; r < end; r += nodelets) {
+        if (!is_ruler(data, r)) { continue; }
+        long d = 1;
+        long v = succ[r];
+        while (v != NIL && !is_ruler(data, v)) {
+            owner[v] = r;
+            dist[v] = d++;
+            v = succ[v];
+        }
+        owner[r] = v;
+        dist[r] = d;
+    }
+    nodelet_timer_leaf_end(nlet);
+}
+
+// Every node is ranked relative to its ruler
+static noinline void
+ruling_set_expand_worker(long * array, long begin, long end, va_list args)
+{
+    pointer_chase_data * data = va_arg(args, pointer_chase_data *);
+    const long nodelets = NODELETS();
+    if (begin % nodelets >= data->num_nodelets) { return; }
+    long nlet = nodelet_timer_leaf_begin();
+    for (long v = begin; v < end; v += nodelets) {
+        if (is_ruler(data, v)) { continue; }
+        data->rank[v] = data->rank[data->aux1[v]] - data->aux2[v];
+    }
+    nodelet_timer_leaf_end(nlet);
+}
+
+// Sparse ruling set: split the list into sublists at ~n/ruler_spacing rulers, walk the sublists in parallel,
+// rank the short list of rulers serially, then expand the ranks back out to every node. O(n) work.
+void
+pointer_chase_list_rank_ruling_set(pointer_chase_data * data)
+{
+    long grain = list_rank_grain(data);
+    emu_1d_array_apply(data->succ, data->pool_size, grain,
+        ruling_set_walk_worker, data
+    );
+    // Walk the list of rulers from the head, computing the rank of each
+    long pos = 0;
+    for (long r = data->indices[0]; r != NIL; r = data->aux1[r]) {
+        data->rank[r] = data->n - 1 - pos;
+        pos += data->aux2[r];
+    }
+    emu_1d_array_apply(data->succ, data->pool_size, grain,
+        ruling_set_expand_worker, data
+    );
+}
+
+static void
+list_rank_validate_worker(long * array, long begin, long end, va_list args)
+{
+    pointer_chase_data * data = va_arg(args, pointer_chase_data *);
+    long * checksum = va_arg(args, long*);
+    const long nodelets = NODELETS();
+    if (begin % nodelets >= data->num_nodelets) { return; }
+    long local_sum = 0;
+    for (long i = begin; i < end; i += nodelets) {
+        // The weight of each node is its position in the list
+        long expected = data->n - 1 - get_node_ptr(data, i)->weight;
+        if (data->rank[i] != expected) {
+            LOG_ERROR("VALIDATION ERROR: rank[%li] == %li (supposed to be %li)\n", i, data->rank[i], expected);
+            exit(1);
+        }
+        local_sum += data->rank[i];
+    }
+    REMOTE_ADD(checksum, local_sum);
+}
+
+void list_rank_run(
+    pointer_chase_data * data,
+    const char * name,
+    void (*benchmark)(pointer_chase_data *),
+    long num_trials)
+{
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        list_rank_reset(data);
+        nodelet_timer_reset();
+        hooks_region_begin("list_rank");
+        nodelet_timer_start();
+        OCCUPANCY_RUN(benchmark(data));
+        double time_ms = hooks_region_end();
+#ifndef NO_VALIDATE
+        long checksum = 0;
+        emu_1d_array_apply(data->rank, data->pool_size, GLOBAL_GRAIN_MIN(data->pool_size, 64),
+            list_rank_validate_worker, data, &checksum
+        );
+        // Sum of all integers from 0 to n-1
+        long expected_sum = (data->n * (data->n - 1)) / 2;
+        LOG("expected_sum = %li, actual_sum = %li\n", expected_sum, checksum);
+        runtime_assert(checksum == expected_sum, "Validation FAILED!");
+#endif
+        double nodes_per_second = time_ms == 0 ? 0 : data->n / (time_ms/1000);
+        LOG("%3.2f M nodes/s\n", nodes_per_second / (1000000));
+        nodelet_timer_report(data->num_nodelets);
+        occupancy_report();
     }
 }
 
@@ -417,6 +824,10 @@ static const struct option long_options[] = {
     {"spawn_mode"   , required_argument},
     {"sort_mode"    , required_argument},
     {"num_trials"   , required_argument},
+    {"per_nodelet"  , no_argument},
+    {"num_nodelets" , required_argument},
+    {"seed"         , required_argument},
+    {"snapshot_dir" , required_argument},
     {"help"         , no_argument},
     {NULL}
 };
@@ -428,9 +839,13 @@ print_help(const char* argv0)
     LOG("\t--log2_num_elements  Number of elements in the list\n");
     LOG("\t--num_threads        Number of threads traversing the list\n");
     LOG("\t--block_size         Number of elements to swap at a time\n");
-    LOG("\t--spawn_mode         How to spawn the threads\n");
+    LOG("\t--spawn_mode         How to spawn the threads (or list_rank_wyllie, list_rank_ruling_set)\n");
     LOG("\t--sort_mode          How to shuffle the array\n");
     LOG("\t--num_trials         Number of times to repeat the benchmark\n");
+    LOG("\t--per_nodelet        log2_num_elements is per nodelet rather than in total\n");
+    LOG("\t--num_nodelets       Only use the first num_nodelets nodelets\n");
+    LOG("\t--seed               Seed for the shuffles\n");
+    LOG("\t--snapshot_dir       Save/restore the shuffled indices here (native builds only)\n");
     LOG("\t--help               Print command line help\n");
 }
 
@@ -441,6 +856,9 @@ typedef struct pointer_chase_args {
     const char* spawn_mode;
     const char* sort_mode;
     long num_trials;
+    scaling_args scaling;
+    long seed;
+    const char* snapshot_dir;
 } pointer_chase_args;
 
 static struct pointer_chase_args
@@ -453,6 +871,10 @@ parse_args(int argc, char *argv[])
     args.spawn_mode = "serial_spawn";
     args.sort_mode = "block_shuffle";
     args.num_trials = 1;
+    args.scaling.per_nodelet = false;
+    args.scaling.num_nodelets = NODELETS();
+    args.seed = 0;
+    args.snapshot_dir = NULL;
 
     int option_index;
     while (true)
@@ -480,6 +902,14 @@ parse_args(int argc, char *argv[])
             args.sort_mode = optarg;
         } else if (!strcmp(option_name, "num_trials")) {
             args.num_trials = atol(optarg);
+        } else if (!strcmp(option_name, "per_nodelet")) {
+            args.scaling.per_nodelet = true;
+        } else if (!strcmp(option_name, "num_nodelets")) {
+            args.scaling.num_nodelets = atol(optarg);
+        } else if (!strcmp(option_name, "seed")) {
+            args.seed = atol(optarg);
+        } else if (!strcmp(option_name, "snapshot_dir")) {
+            args.snapshot_dir = optarg;
         } else if (!strcmp(option_name, "help")) {
             print_help(argv[0]);
             exit(1);
@@ -488,6 +918,8 @@ parse_args(int argc, char *argv[])
     if (args.log2_num_elements <= 0) { LOG( "log2_num_elements must be > 0"); exit(1); }
     if (args.block_size <= 0) { LOG( "block_size must be > 0"); exit(1); }
     if (args.num_threads <= 0) { LOG( "num_threads must be > 0"); exit(1); }
+    if (args.seed < 0) { LOG( "seed must be >= 0"); exit(1); }
+    scaling_args_check(&args.scaling);
     return args;
 }
 
@@ -517,24 +949,28 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
+    long n = scaling_num_elements(&args.scaling, args.log2_num_elements);
+
     hooks_set_attr_i64("num_threads", args.num_threads);
     hooks_set_attr_i64("block_size", args.block_size);
     hooks_set_attr_str("spawn_mode", args.spawn_mode);
     hooks_set_attr_str("sort_mode", args.sort_mode);
-    hooks_set_attr_i64("num_nodelets", NODELETS());
+    hooks_set_attr_i64("seed", args.seed);
+    scaling_set_attrs(&args.scaling, n);
 
-    long n = 1L << args.log2_num_elements;
     long bytes = n * (sizeof(node));
     long mbytes = bytes / (1000000);
-    long mbytes_per_nodelet = mbytes / NODELETS();
+    long mbytes_per_nodelet = mbytes / args.scaling.num_nodelets;
     LOG("Initializing %s array with %li elements (%li MB total, %li MB per nodelet)\n",
         args.sort_mode, n, mbytes, mbytes_per_nodelet);
 
     hooks_region_begin("init");
     pointer_chase_data_init(&data,
-        n, args.block_size, args.num_threads, sort_mode);
+        n, args.block_size, args.num_threads, sort_mode, args.scaling.num_nodelets,
+        args.seed, args.snapshot_dir);
     hooks_region_end();
+    nodelet_timer_init();
+    occupancy_init();
     LOG( "Launching %s with %li threads...\n", args.spawn_mode, args.num_threads);
 
     #define RUN_BENCHMARK(X) pointer_chase_run(&data, args.spawn_mode, X, args.num_trials)
@@ -543,11 +979,21 @@ int main(int argc, char** argv)
         RUN_BENCHMARK(pointer_chase_serial_spawn);
     } else if (!strcmp(args.spawn_mode, "serial_remote_spawn")) {
         RUN_BENCHMARK(pointer_chase_serial_remote_spawn);
+    } else if (!strcmp(args.spawn_mode, "list_rank_wyllie")) {
+        list_rank_init(&data);
+        list_rank_run(&data, args.spawn_mode, pointer_chase_list_rank_wyllie, args.num_trials);
+        list_rank_deinit(&data);
+    } else if (!strcmp(args.spawn_mode, "list_rank_ruling_set")) {
+        list_rank_init(&data);
+        list_rank_run(&data, args.spawn_mode, pointer_chase_list_rank_ruling_set, args.num_trials);
+        list_rank_deinit(&data);
     } else {
         LOG( "Spawn mode %s not implemented!", args.spawn_mode);
         exit(1);
     }
 
     pointer_chase_data_deinit(&data);
+    nodelet_timer_deinit();
+    occupancy_deinit();
     return 0;
 }
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+#include "rng.h"
+
+/*
+ * Goal: Find out when it pays to replicate a lookup table.
+ * Threads on every nodelet do random lookups into a table of 2^log2_table_size elements.
+ * The table is placed in one of three ways:
+ * - single     - one copy on nodelet 0, so most lookups migrate there and back
+ * - replicated - one copy per nodelet (mw_mallocrepl), each thread reads the copy on its own nodelet
+ * - striped    - spread across all nodelets (mw_malloc1dlong), so lookups migrate to a random nodelet
+ * In replicated mode, copying the table to the other nodelets is timed as its own "replicate" region
+ * before each trial, so the break-even point can be read off a sweep of table size and lookups per element.
+ */
+
+enum table_layout {
+    SINGLE,
+    REPLICATED,
+    STRIPED
+};
+
+typedef struct replicated_lookup_data {
+    // Table of values to look up, table[k] = k
+    long * table;
+    long table_size;
+    // Striped array of starting keys, one per element
+    long * keys;
+    // Striped array of results, one per element
+    long * out;
+    long n;
+    long lookups_per_element;
+    long num_threads;
+    long layout;
+} replicated_lookup_data;
+
+replicated replicated_lookup_data data;
+
+// The key of the j'th lookup after looking up k, computed without touching memory
+static inline long
+next_key(long k, long j, long mask)
+{
+    return rng_hash(k + j + 1) & mask;
+}
+
+void
+replicated_init_ptr(long ** ptr, long * val)
+{
+    mw_replicated_init((long*)ptr, (long)val);
+}
+
+static void
+table_init_worker(long begin, long end, va_list args)
+{
+    long * table = va_arg(args, long*);
+    for (long i = begin; i < end; ++i) {
+        table[i] = i;
+    }
+}
+
+static void
+striped_table_init_worker(long * array, long begin, long end, va_list args)
+{
+    const long nodelets = NODELETS();
+    for (long i = begin; i < end; i += nodelets) {
+        array[i] = i;
+    }
+}
+
+static void
+keys_init_worker(long * array, long begin, long end, va_list args)
+{
+    replicated_lookup_data * data = va_arg(args, replicated_lookup_data *);
+    const long nodelets = NODELETS();
+    const long mask = data->table_size - 1;
+    for (long i = begin; i < end; i += nodelets) {
+        data->keys[i] = rng_at(0, 0, i) & mask;
+        data->out[i] = 0;
+    }
+}
+
+void
+replicated_lookup_init(replicated_lookup_data * data, enum table_layout layout,
+    long table_size, long n, long lookups_per_element, long num_threads)
+{
+    mw_replicated_init(&data->table_size, table_size);
+    mw_replicated_init(&data->n, n);
+    mw_replicated_init(&data->lookups_per_element, lookups_per_element);
+    mw_replicated_init(&data->num_threads, num_threads);
+    mw_replicated_init(&data->layout, layout);
+
+    long * table = NULL;
+    switch (layout) {
+        case SINGLE:
+            // main() runs on nodelet 0, so this lands there
+            table = malloc(table_size * sizeof(long));
+            break;
+        case REPLICATED:
+            table = mw_mallocrepl(table_size * sizeof(long));
+            break;
+        case STRIPED:
+            table = mw_malloc1dlong(table_size);
+            break;
+    }
+    runtime_assert(table != NULL, "Failed to allocate lookup table");
+    replicated_init_ptr(&data->table, table);
+    replicated_init_ptr(&data->keys, mw_malloc1dlong(n));
+    replicated_init_ptr(&data->out, mw_malloc1dlong(n));
+    runtime_assert(data->keys && data->out, "Failed to allocate key arrays");
+
+    if (layout == STRIPED) {
+        emu_1d_array_apply(table, table_size, GLOBAL_GRAIN(table_size),
+            striped_table_init_worker
+        );
+    } else {
+        // Only fill the copy on nodelet 0, the replicate step copies it to the others
+        long * local = layout == REPLICATED ? mw_get_nth(table, 0) : table;
+        emu_local_for(0, table_size, LOCAL_GRAIN(table_size),
+            table_init_worker, local
+        );
+    }
+    emu_1d_array_apply(data->keys, n, GLOBAL_GRAIN(n),
+        keys_init_worker, data
+    );
+}
+
+void
+replicated_lookup_deinit(replicated_lookup_data * data)
+{
+    if (data->layout == SINGLE) {
+        free(data->table);
+    } else {
+        mw_free(data->table);
+    }
+    mw_free(data->keys);
+    mw_free(data->out);
+}
+
+static void
+copy_long_worker(long begin, long end, va_list args)
+{
+    long * dst = va_arg(args, long*);
+    long * src = va_arg(args, long*);
+    for (long i = begin; i < end; ++i) {
+        dst[i] = src[i];
+    }
+}
+
+static noinline void
+replicate_to(long * dst, long * src, long n)
+{
+    emu_local_for(0, n, LOCAL_GRAIN_MIN(n, 64),
+        copy_long_worker, dst, src
+    );
+}
+
+// Copy the table from nodelet 0 to every other nodelet, spawning a copy at each destination
+noinline void
+replicated_lookup_replicate(replicated_lookup_data * data)
+{
+    long * local = mw_get_nth(data->table, 0);
+    for (long i = 1; i < NODELETS(); ++i) {
+        long * remote = mw_get_nth(data->table, i);
+        cilk_spawn_at(remote) replicate_to(remote, local, data->table_size);
+    }
+    cilk_sync;
+}
+
+static noinline void
+lookup_worker(long * array, long begin, long end, va_list args)
+{
+    (void)array;
+    replicated_lookup_data * data = va_arg(args, replicated_lookup_data *);
+    const long nodelets = NODELETS();
+    const long mask = data->table_size - 1;
+    const long lookups_per_element = data->lookups_per_element;
+    long * table = data->table;
+    // Read the copy of the table on this nodelet
+    if (data->layout == REPLICATED) {
+        table = mw_get_nth(table, NODE_ID());
+    }
+    for (long i = begin; i < end; i += nodelets) {
+        long k = data->keys[i];
+        long acc = 0;
+        for (long j = 0; j < lookups_per_element; ++j) {
+            acc += table[k];
+            k = next_key(k, j, mask);
+        }
+        data->out[i] = acc;
+    }
+}
+
+noinline void
+replicated_lookup_run_lookups(replicated_lookup_data * data)
+{
+    long grain = data->n / data->num_threads;
+    emu_1d_array_apply(data->keys, data->n, grain > 0 ? grain : 1,
+        lookup_worker, data
+    );
+}
+
+static void
+validate_worker(long * array, long begin, long end, va_list args)
+{
+    replicated_lookup_data * data = va_arg(args, replicated_lookup_data *);
+    long * checksum = va_arg(args, long*);
+    const long nodelets = NODELETS();
+    const long mask = data->table_size - 1;
+    long local_sum = 0;
+    for (long i = begin; i < end; i += nodelets) {
+        // Since table[k] = k, the expected result is the sum of the keys
+        long k = data->keys[i];
+        long expected = 0;
+        for (long j = 0; j < data->lookups_per_element; ++j) {
+            expected += k;
+            k = next_key(k, j, mask);
+        }
+        if (data->out[i] != expected) {
+            LOG_ERROR("VALIDATION ERROR: out[%li] == %li (supposed to be %li)\n", i, data->out[i], expected);
+            exit(1);
+        }
+        local_sum += expected;
+    }
+    REMOTE_ADD(checksum, local_sum);
+}
+
+// Check every result in parallel, returns the sum of all results
+long
+replicated_lookup_validate(replicated_lookup_data * data)
+{
+    long checksum = 0;
+    emu_1d_array_apply(data->out, data->n, GLOBAL_GRAIN_MIN(data->n, 64),
+        validate_worker, data, &checksum
+    );
+    return checksum;
+}
+
+void
+replicated_lookup_run(replicated_lookup_data * data, const char * name, long num_trials)
+{
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        double replicate_ms = 0;
+        if (data->layout == REPLICATED) {
+            hooks_region_begin("replicate");
+            replicated_lookup_replicate(data);
+            replicate_ms = hooks_region_end();
+        }
+        hooks_region_begin(name);
+        replicated_lookup_run_lookups(data);
+        double time_ms = hooks_region_end();
+        double num_lookups = (double)data->n * data->lookups_per_element;
+        double lookups_per_second = time_ms == 0 ? 0 : num_lookups / (time_ms/1000);
+        LOG("%3.2f M lookups/s\n", lookups_per_second / 1000000);
+        if (data->layout == REPLICATED) {
+            double total_ms = time_ms + replicate_ms;
+            double amortized_per_second = total_ms == 0 ? 0 : num_lookups / (total_ms/1000);
+            LOG("%3.2f M lookups/s including %3.3f ms to replicate\n",
+                amortized_per_second / 1000000, replicate_ms);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* mode;
+        long log2_table_size;
+        long log2_num_elements;
+        long num_threads;
+        long num_trials;
+        long lookups_per_element;
+    } args;
+
+    args.lookups_per_element = take_long_option(&argc, argv, "lookups_per_element", 1);
+
+    if (argc != 6) {
+        LOG("Usage: %s mode log2_table_size log2_num_elements num_threads num_trials [--lookups_per_element K]\n", argv[0]);
+        exit(1);
+    } else {
+        args.mode = argv[1];
+        args.log2_table_size = atol(argv[2]);
+        args.log2_num_elements = atol(argv[3]);
+        args.num_threads = atol(argv[4]);
+        args.num_trials = atol(argv[5]);
+
+        if (args.log2_table_size < 0) { LOG("log2_table_size must be >= 0"); exit(1); }
+        if (args.log2_num_elements <= 0) { LOG("log2_num_elements must be > 0"); exit(1); }
+        if (args.num_threads <= 0) { LOG("num_threads must be > 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+        if (args.lookups_per_element <= 0) { LOG("lookups_per_element must be > 0"); exit(1); }
+    }
+
+    enum table_layout layout;
+    if (!strcmp(args.mode, "single")) {
+        layout = SINGLE;
+    } else if (!strcmp(args.mode, "replicated")) {
+        layout = REPLICATED;
+    } else if (!strcmp(args.mode, "striped")) {
+        layout = STRIPED;
+    } else {
+        LOG("Mode %s not implemented!\n", args.mode);
+        exit(1);
+    }
+
+    hooks_set_attr_str("mode", args.mode);
+    hooks_set_attr_i64("log2_table_size", args.log2_table_size);
+    hooks_set_attr_i64("log2_num_elements", args.log2_num_elements);
+    hooks_set_attr_i64("lookups_per_element", args.lookups_per_element);
+    hooks_set_attr_i64("num_threads", args.num_threads);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+    hooks_set_attr_i64("num_bytes_per_element", sizeof(long));
+
+    long table_size = 1L << args.log2_table_size;
+    long n = 1L << args.log2_num_elements;
+    LOG("Initializing %s table with %li elements (%li MiB per copy) and %li keys\n",
+        args.mode, table_size, (table_size * sizeof(long)) / (1024*1024), n);
+    replicated_lookup_init(&data, layout, table_size, n, args.lookups_per_element, args.num_threads);
+
+    LOG("Doing %li lookups per element with %li threads\n", args.lookups_per_element, args.num_threads);
+    replicated_lookup_run(&data, args.mode, args.num_trials);
+
+#ifndef NO_VALIDATE
+    LOG("Validating results...");
+    hooks_region_begin("validate");
+    long checksum = replicated_lookup_validate(&data);
+    hooks_set_attr_i64("checksum", checksum);
+    hooks_region_end();
+    LOG("OK\n");
+#endif
+
+    replicated_lookup_deinit(&data);
+    return 0;
+}
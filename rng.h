@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Counter-based random numbers (Philox4x32-10, from Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3").
+ *
+ * Every number is a pure function of (seed, stream, index), so any thread can generate any part of a sequence
+ * without shared state, and the data doesn't depend on the number of threads or the order they run in:
+ *
+ *     for (long i = begin; i < end; ++i) {
+ *         array[i] = rng_at(seed, STREAM_VALUES, i) % range;
+ *     }
+ *
+ * rng_state walks a stream sequentially, and rng_skip() jumps ahead in constant time.
+ * Each Philox block holds two 64-bit numbers, so rng_next() only computes a block every other call.
+ */
+
+#define RNG_PHILOX_M0 0xD2511F53U
+#define RNG_PHILOX_M1 0xCD9E8D57U
+#define RNG_PHILOX_W0 0x9E3779B9U
+#define RNG_PHILOX_W1 0xBB67AE85U
+
+// Philox4x32-10 block function
+static inline void
+rng_philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; ++round) {
+        uint64_t p0 = (uint64_t)RNG_PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)RNG_PHILOX_M1 * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c0 = n0;
+        c1 = (uint32_t)p1;
+        c2 = n2;
+        c3 = (uint32_t)p0;
+        k0 += RNG_PHILOX_W0;
+        k1 += RNG_PHILOX_W1;
+    }
+    out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+// Both 64-bit numbers in the block'th block of a stream
+static inline void
+rng_block(unsigned long seed, unsigned long stream, unsigned long block, unsigned long out[2])
+{
+    uint32_t ctr[4] = { (uint32_t)block, (uint32_t)(block >> 32), (uint32_t)stream, (uint32_t)(stream >> 32) };
+    uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+    uint32_t words[4];
+    rng_philox4x32(ctr, key, words);
+    out[0] = ((unsigned long)words[1] << 32) | words[0];
+    out[1] = ((unsigned long)words[3] << 32) | words[2];
+}
+
+// The index'th 64-bit number of a stream
+static inline unsigned long
+rng_at(unsigned long seed, unsigned long stream, unsigned long index)
+{
+    unsigned long out[2];
+    rng_block(seed, stream, index >> 1, out);
+    return out[index & 1];
+}
+
+// Maps a random number to [0, n). The bias is negligible for n much smaller than 2^64.
+static inline unsigned long
+rng_below(unsigned long r, unsigned long n)
+{
+    return r % n;
+}
+
+// Maps a random number to [0, 1)
+static inline double
+rng_double(unsigned long r)
+{
+    return (r >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Cheap integer hash (the MurmurHash3 finalizer), for when a full Philox block is more than the caller needs
+static inline unsigned long
+rng_hash(unsigned long x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdUL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53UL;
+    x ^= x >> 33;
+    return x;
+}
+
+typedef struct rng_state {
+    unsigned long seed;
+    unsigned long stream;
+    unsigned long index;
+    // Second half of the last block, valid when index is odd and has_spare is set
+    unsigned long spare;
+    bool has_spare;
+} rng_state;
+
+static inline void
+rng_init(rng_state * s, unsigned long seed, unsigned long stream)
+{
+    s->seed = seed;
+    s->stream = stream;
+    s->index = 0;
+    s->has_spare = false;
+}
+
+// Jumps n numbers ahead
+static inline void
+rng_skip(rng_state * s, unsigned long n)
+{
+    s->index += n;
+    s->has_spare = false;
+}
+
+static inline unsigned long
+rng_next(rng_state * s)
+{
+    unsigned long r;
+    if ((s->index & 1) && s->has_spare) {
+        r = s->spare;
+        s->has_spare = false;
+    } else {
+        unsigned long out[2];
+        rng_block(s->seed, s->stream, s->index >> 1, out);
+        r = out[s->index & 1];
+        s->spare = out[1];
+        s->has_spare = !(s->index & 1);
+    }
+    s->index += 1;
+    return r;
+}
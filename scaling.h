@@ -0,0 +1,60 @@
+#pragma once
+
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+
+/*
+ * Options for producing weak- and strong-scaling curves from a single binary:
+ *   --per_nodelet       log2_num_elements is the number of elements on each nodelet, not in total
+ *   --num_nodelets M    only place data and threads on the first M nodelets
+ *
+ * Arrays are still allocated across all nodelets (the allocators offer no other layout),
+ * but each one is sized so that the first M nodelets hold all of the elements in use.
+ */
+typedef struct scaling_args {
+    bool per_nodelet;
+    long num_nodelets;
+} scaling_args;
+
+static inline void
+scaling_args_check(scaling_args * args)
+{
+    runtime_assert(args->num_nodelets > 0 && args->num_nodelets <= NODELETS(),
+        "num_nodelets must be between 1 and NODELETS()");
+    runtime_assert((args->num_nodelets & (args->num_nodelets - 1)) == 0,
+        "num_nodelets must be a power of two");
+}
+
+// Removes the scaling options from the command line
+static inline scaling_args
+parse_scaling_args(int * argc, char ** argv)
+{
+    scaling_args args;
+    args.per_nodelet = take_flag(argc, argv, "per_nodelet");
+    args.num_nodelets = take_long_option(argc, argv, "num_nodelets", NODELETS());
+    scaling_args_check(&args);
+    return args;
+}
+
+// Total number of elements to use
+static inline long
+scaling_num_elements(scaling_args * args, long log2_num_elements)
+{
+    long n = 1L << log2_num_elements;
+    return args->per_nodelet ? n * args->num_nodelets : n;
+}
+
+// Number of elements to allocate so that n elements fit on the first num_nodelets nodelets
+static inline long
+scaling_alloc_elements(long n, long num_nodelets)
+{
+    return (n / num_nodelets) * NODELETS();
+}
+
+static inline void
+scaling_set_attrs(scaling_args * args, long n)
+{
+    hooks_set_attr_i64("per_nodelet", args->per_nodelet);
+    hooks_set_attr_i64("num_nodelets", args->num_nodelets);
+    hooks_set_attr_i64("log2_num_elements", PRIORITY(n));
+}
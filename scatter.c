@@ -8,6 +8,7 @@
 
 #include <emu_c_utils/emu_c_utils.h>
 #include "common.h"
+#include "trace.h"
 
 typedef struct scatter_data {
     long * buffer;
@@ -139,11 +140,12 @@ scatter_emu_for(scatter_data * data)
 
 // TODO - Scatter with recursive tree
 static void
-scatter_tree(long * buffer, long n, long nlet_begin, long nlet_end)
+scatter_tree(long * buffer, long n, long nlet_begin, long nlet_end TRACE_PARAM)
 {
     long num_nodelets = nlet_end - nlet_begin;
     // TODO detect this condition before spawning
     if (num_nodelets == 1) { return; }
+    trace_thread self = trace_start(TRACE_ID, "scatter_tree");
 
     long nlet_mid = nlet_begin + (num_nodelets / 2);
 
@@ -159,13 +161,16 @@ scatter_tree(long * buffer, long n, long nlet_begin, long nlet_end)
 //    LOG("nlet[%li]: Spawn scatter_tree(%li - %li)\n", NODE_ID(), nlet_mid, nlet_end);
 
     // Spawn at target and recurse through my range
-    cilk_spawn scatter_tree(remote, n, nlet_mid, nlet_end);
-    scatter_tree(local, n, nlet_begin, nlet_mid);
+    long child = trace_spawn(&self);
+    cilk_spawn scatter_tree(remote, n, nlet_mid, nlet_end TRACE_ARG(child));
+    scatter_tree(local, n, nlet_begin, nlet_mid TRACE_ARG(trace_nested(&self)));
+    cilk_sync;
+    trace_finish(&self);
 }
 
 noinline void scatter_recursive_tree(scatter_data * data)
 {
-    scatter_tree(data->buffer, data->n, 0, NODELETS());
+    scatter_tree(data->buffer, data->n, 0, NODELETS() TRACE_ARG(trace_root()));
 }
 
 
@@ -176,6 +181,7 @@ void scatter_run(
 {
     for (long trial = 0; trial < num_trials; ++trial) {
         hooks_set_attr_i64("trial", trial);
+        trace_reset();
         hooks_region_begin("scatter");
         benchmark(data);
         double time_ms = hooks_region_end();
@@ -220,6 +226,7 @@ int main(int argc, char** argv)
     long mbytes = n * sizeof(long) / (1024*1024);
     LOG("Initializing arrays with %li elements each (%li MiB)\n", n, mbytes);
     scatter_data_init(&data, n, args.num_threads);
+    trace_init();
     LOG("Scattering with %s\n", args.mode);
 
     #define RUN_BENCHMARK(X) scatter_run(&data, X, args.num_trials)
@@ -238,6 +245,9 @@ int main(int argc, char** argv)
         LOG("Spawn mode %s not implemented!", args.mode);
     }
 
+    // Timeline of the last trial
+    trace_dump("scatter.trace.json");
+    trace_deinit();
     scatter_data_deinit(&data);
     return 0;
 }
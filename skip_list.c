@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+#include "rng.h"
+
+/*
+ * Goal: Measure the pointer_chase access pattern under concurrent writes.
+ * Threads on every nodelet do a mix of lookups and lock-free inserts (no deletes) on a shared skip list.
+ * Each node (key, value and its tower of next pointers) is allocated in one piece, on a nodelet picked by:
+ * - round_robin - the nodelet of the operation that inserts it, so neighbouring keys are scattered
+ * - home        - the key's home nodelet (key space is range-partitioned across nodelets),
+ *                 so a traversal stays on one nodelet until it crosses into the next range
+ * Every node records the nodelet it lives on, which lets each operation count how many times it would
+ * have to migrate (each time it reads a node on a different nodelet from the previous one).
+ */
+
+#define MAX_LEVEL 20
+
+typedef struct sl_node {
+    long key;
+    long value;
+    // Nodelet holding this node
+    long home;
+    long height;
+    struct sl_node * next[];
+} sl_node;
+
+enum alloc_mode {
+    ROUND_ROBIN,
+    HOME
+};
+
+typedef struct skip_list_data {
+    sl_node * head;
+    // Keys are drawn from 0 through num_keys-1
+    long num_keys;
+    // Number of keys inserted before each trial
+    long num_initial;
+    // Number of nodes in the list after the initial inserts
+    long initial_count;
+    long alloc_mode;
+    long insert_percent;
+    long skew;
+    // One element on each nodelet, used to allocate a node on a particular nodelet
+    long * anchors;
+    // Striped array with the result of each operation (1 = found / inserted)
+    long * out;
+    long num_ops;
+    long num_threads;
+    // Totals for the current trial, only valid in nodelet 0's copy
+    long num_inserted;
+    long num_migrations;
+} skip_list_data;
+
+replicated skip_list_data data;
+
+// Independent pseudo-random streams, addressed by operation index
+enum { STREAM_OP = 1, STREAM_HEIGHT, STREAM_INIT, STREAM_KEY };
+
+static inline unsigned long
+sl_rand(unsigned long stream, unsigned long i)
+{
+    return rng_hash(rng_hash(stream) + i);
+}
+
+// Key of the i'th operation: the minimum of 1 + skew uniform draws, so higher skew favors low keys
+static inline long
+op_key(skip_list_data * data, long i)
+{
+    long key = sl_rand(STREAM_KEY, i) % data->num_keys;
+    for (long s = 1; s <= data->skew; ++s) {
+        long k = sl_rand(STREAM_KEY + s, i) % data->num_keys;
+        if (k < key) { key = k; }
+    }
+    return key;
+}
+
+// Geometric distribution with p = 1/2, capped at MAX_LEVEL
+static inline long
+node_height(long key)
+{
+    unsigned long r = sl_rand(STREAM_HEIGHT, key) | (1UL << (MAX_LEVEL - 1));
+    return 1 + __builtin_ctzl(r);
+}
+
+static inline long
+key_home(skip_list_data * data, long key)
+{
+    return (key * NODELETS()) / data->num_keys;
+}
+
+static sl_node *
+node_alloc(skip_list_data * data, long key, long height, long nlet)
+{
+    sl_node * node = mw_localmalloc(sizeof(sl_node) + height * sizeof(sl_node*), &data->anchors[nlet]);
+    runtime_assert(node != NULL, "Failed to allocate skip list node");
+    node->key = key;
+    node->value = key;
+    node->home = nlet;
+    node->height = height;
+    return node;
+}
+
+// Reads the key of a node, counting a migration if it lives on a different nodelet than the last one read
+static inline long
+visit(sl_node * node, long * nlet, long * migrations)
+{
+    if (node->home != *nlet) {
+        *migrations += 1;
+        *nlet = node->home;
+    }
+    return node->key;
+}
+
+// Fill in the last node before key and the first node at or after it on each level.
+// Returns the node holding key, or NULL.
+static sl_node *
+sl_find(skip_list_data * data, long key, sl_node ** preds, sl_node ** succs, long * nlet, long * migrations)
+{
+    sl_node * pred = data->head;
+    // Every operation starts at the head tower on nodelet 0
+    visit(pred, nlet, migrations);
+    for (long level = MAX_LEVEL - 1; level >= 0; --level) {
+        sl_node * curr = pred->next[level];
+        while (curr != NULL && visit(curr, nlet, migrations) < key) {
+            pred = curr;
+            curr = pred->next[level];
+        }
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+    return (succs[0] != NULL && succs[0]->key == key) ? succs[0] : NULL;
+}
+
+// Returns the value stored with key, or -1
+static long
+sl_lookup(skip_list_data * data, long key, long * nlet, long * migrations)
+{
+    sl_node * pred = data->head;
+    visit(pred, nlet, migrations);
+    for (long level = MAX_LEVEL - 1; level >= 0; --level) {
+        sl_node * curr = pred->next[level];
+        long curr_key;
+        while (curr != NULL && (curr_key = visit(curr, nlet, migrations)) <= key) {
+            if (curr_key == key) { return curr->value; }
+            pred = curr;
+            curr = pred->next[level];
+        }
+    }
+    return -1;
+}
+
+static inline bool
+cas_next(sl_node * pred, long level, sl_node * expected, sl_node * desired)
+{
+    return ATOMIC_CAS((long*)&pred->next[level], (long)desired, (long)expected) == (long)expected;
+}
+
+// Lock-free insert. The node is published by linking it into level 0, then linked into the higher levels
+// one at a time. Without deletes, a failed CAS just means another insert got in first, so search again.
+// Returns false if the key was already present.
+static bool
+sl_insert(skip_list_data * data, long key, long alloc_nlet, long * nlet, long * migrations)
+{
+    sl_node * preds[MAX_LEVEL];
+    sl_node * succs[MAX_LEVEL];
+    if (sl_find(data, key, preds, succs, nlet, migrations)) { return false; }
+
+    long height = node_height(key);
+    sl_node * node = node_alloc(data, key, height, alloc_nlet);
+    for (;;) {
+        node->next[0] = succs[0];
+        if (cas_next(preds[0], 0, succs[0], node)) { break; }
+        if (sl_find(data, key, preds, succs, nlet, migrations)) {
+            mw_localfree(node);
+            return false;
+        }
+    }
+    for (long level = 1; level < height; ++level) {
+        for (;;) {
+            node->next[level] = succs[level];
+            if (cas_next(preds[level], level, succs[level], node)) { break; }
+            sl_find(data, key, preds, succs, nlet, migrations);
+        }
+    }
+    return true;
+}
+
+static inline long
+alloc_nodelet(skip_list_data * data, long key, long i)
+{
+    return data->alloc_mode == HOME ? key_home(data, key) : i % NODELETS();
+}
+
+static void
+initial_insert_worker(long begin, long end, va_list args)
+{
+    skip_list_data * data = va_arg(args, skip_list_data *);
+    long local_inserted = 0, local_migrations = 0;
+    for (long i = begin; i < end; ++i) {
+        long key = sl_rand(STREAM_INIT, i) % data->num_keys;
+        long nlet = NODE_ID();
+        local_inserted += sl_insert(data, key, alloc_nodelet(data, key, i), &nlet, &local_migrations);
+    }
+    REMOTE_ADD((long*)mw_get_nth(&data->num_inserted, 0), local_inserted);
+}
+
+static noinline void
+ops_worker(long * array, long begin, long end, va_list args)
+{
+    (void)array;
+    skip_list_data * data = va_arg(args, skip_list_data *);
+    const long nodelets = NODELETS();
+    long local_inserted = 0, local_migrations = 0;
+    for (long i = begin; i < end; i += nodelets) {
+        long key = op_key(data, i);
+        // Each operation starts on the nodelet that holds its result
+        long nlet = NODE_ID();
+        if ((long)(sl_rand(STREAM_OP, i) % 100) < data->insert_percent) {
+            bool inserted = sl_insert(data, key, alloc_nodelet(data, key, i), &nlet, &local_migrations);
+            local_inserted += inserted;
+            data->out[i] = inserted;
+        } else {
+            data->out[i] = sl_lookup(data, key, &nlet, &local_migrations) == key;
+        }
+    }
+    REMOTE_ADD((long*)mw_get_nth(&data->num_inserted, 0), local_inserted);
+    REMOTE_ADD((long*)mw_get_nth(&data->num_migrations, 0), local_migrations);
+}
+
+noinline void
+skip_list_run_ops(skip_list_data * data)
+{
+    long grain = data->num_ops / data->num_threads;
+    emu_1d_array_apply(data->out, data->num_ops, grain > 0 ? grain : 1,
+        ops_worker, data
+    );
+}
+
+void
+replicated_init_ptr(long ** ptr, long * val)
+{
+    mw_replicated_init((long*)ptr, (long)val);
+}
+
+// Free every node except the head
+static void
+skip_list_clear(skip_list_data * data)
+{
+    sl_node * node = data->head->next[0];
+    while (node != NULL) {
+        sl_node * next = node->next[0];
+        mw_localfree(node);
+        node = next;
+    }
+    for (long level = 0; level < MAX_LEVEL; ++level) {
+        data->head->next[level] = NULL;
+    }
+}
+
+// Empty the list and insert the initial keys
+void
+skip_list_reset(skip_list_data * data)
+{
+    skip_list_clear(data);
+    data->num_inserted = 0;
+    emu_local_for(0, data->num_initial, LOCAL_GRAIN(data->num_initial),
+        initial_insert_worker, data
+    );
+    data->initial_count = data->num_inserted;
+    data->num_inserted = 0;
+    data->num_migrations = 0;
+}
+
+void
+skip_list_init(skip_list_data * data, enum alloc_mode alloc_mode, long num_keys, long num_ops,
+    long insert_percent, long skew, long num_threads)
+{
+    // Workers add their totals to nodelet 0's copy, which is the one main() reads
+    data->num_inserted = 0;
+    data->num_migrations = 0;
+    data->initial_count = 0;
+
+    mw_replicated_init(&data->num_keys, num_keys);
+    mw_replicated_init(&data->num_initial, num_keys / 2);
+    mw_replicated_init(&data->alloc_mode, alloc_mode);
+    mw_replicated_init(&data->insert_percent, insert_percent);
+    mw_replicated_init(&data->skew, skew);
+    mw_replicated_init(&data->num_ops, num_ops);
+    mw_replicated_init(&data->num_threads, num_threads);
+    replicated_init_ptr(&data->anchors, mw_malloc1dlong(NODELETS()));
+    replicated_init_ptr(&data->out, mw_malloc1dlong(num_ops));
+    runtime_assert(data->anchors && data->out, "Failed to allocate arrays");
+
+    // The head has a full tower and sorts before every key
+    sl_node * head = node_alloc(data, LONG_MIN, MAX_LEVEL, 0);
+    for (long level = 0; level < MAX_LEVEL; ++level) {
+        head->next[level] = NULL;
+    }
+    replicated_init_ptr((long**)&data->head, (long*)head);
+}
+
+void
+skip_list_deinit(skip_list_data * data)
+{
+    skip_list_clear(data);
+    mw_localfree(data->head);
+    mw_free(data->anchors);
+    mw_free(data->out);
+}
+
+static void
+validate_worker(long * array, long begin, long end, va_list args)
+{
+    skip_list_data * data = va_arg(args, skip_list_data *);
+    const long nodelets = NODELETS();
+    long nlet = NODE_ID(), migrations = 0;
+    for (long i = begin; i < end; i += nodelets) {
+        bool is_insert = (long)(sl_rand(STREAM_OP, i) % 100) < data->insert_percent;
+        long key = op_key(data, i);
+        if (is_insert && sl_lookup(data, key, &nlet, &migrations) != key) {
+            LOG_ERROR("VALIDATION ERROR: inserted key %li not found\n", key);
+            exit(1);
+        }
+    }
+}
+
+// Check that every level is sorted, that the list holds every key that was inserted,
+// and that the node count matches. Returns the number of nodes.
+long
+skip_list_validate(skip_list_data * data)
+{
+    long count = 0;
+    for (long level = MAX_LEVEL - 1; level >= 0; --level) {
+        count = 0;
+        long prev = LONG_MIN;
+        for (sl_node * node = data->head->next[level]; node != NULL; node = node->next[level]) {
+            if (node->key <= prev) {
+                LOG_ERROR("VALIDATION ERROR: level %li is not sorted (%li after %li)\n", level, node->key, prev);
+                exit(1);
+            }
+            prev = node->key;
+            count += 1;
+        }
+    }
+    runtime_assert(count == data->initial_count + data->num_inserted, "Wrong number of nodes in the list");
+    emu_1d_array_apply(data->out, data->num_ops, GLOBAL_GRAIN_MIN(data->num_ops, 64),
+        validate_worker, data
+    );
+    return count;
+}
+
+void
+skip_list_run(skip_list_data * data, const char * name, long num_trials)
+{
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        skip_list_reset(data);
+        hooks_region_begin(name);
+        skip_list_run_ops(data);
+        double time_ms = hooks_region_end();
+        double ops_per_second = time_ms == 0 ? 0 : data->num_ops / (time_ms/1000);
+        LOG("%3.2f M ops/s, %3.2f migrations/op, %li keys inserted\n",
+            ops_per_second / 1000000, (double)data->num_migrations / data->num_ops, data->num_inserted);
+#ifndef NO_VALIDATE
+        hooks_region_begin("validate");
+        long checksum = skip_list_validate(data);
+        hooks_set_attr_i64("checksum", checksum);
+        hooks_region_end();
+#endif
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* mode;
+        long log2_num_keys;
+        long log2_num_ops;
+        long num_threads;
+        long num_trials;
+        long insert_percent;
+        long skew;
+    } args;
+
+    args.insert_percent = take_long_option(&argc, argv, "insert_percent", 10);
+    args.skew = take_long_option(&argc, argv, "skew", 0);
+
+    if (argc != 6) {
+        LOG("Usage: %s mode log2_num_keys log2_num_ops num_threads num_trials [--insert_percent P] [--skew S]\n", argv[0]);
+        exit(1);
+    } else {
+        args.mode = argv[1];
+        args.log2_num_keys = atol(argv[2]);
+        args.log2_num_ops = atol(argv[3]);
+        args.num_threads = atol(argv[4]);
+        args.num_trials = atol(argv[5]);
+
+        if (args.log2_num_keys <= 0 || args.log2_num_keys > 40) { LOG("log2_num_keys must be in [1, 40]"); exit(1); }
+        if (args.log2_num_ops <= 0) { LOG("log2_num_ops must be > 0"); exit(1); }
+        if (args.num_threads <= 0) { LOG("num_threads must be > 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+        if (args.insert_percent < 0 || args.insert_percent > 100) { LOG("insert_percent must be in [0, 100]"); exit(1); }
+        if (args.skew < 0) { LOG("skew must be >= 0"); exit(1); }
+    }
+
+    enum alloc_mode alloc_mode;
+    if (!strcmp(args.mode, "round_robin")) {
+        alloc_mode = ROUND_ROBIN;
+    } else if (!strcmp(args.mode, "home")) {
+        alloc_mode = HOME;
+    } else {
+        LOG("Mode %s not implemented!\n", args.mode);
+        exit(1);
+    }
+
+    hooks_set_attr_str("mode", args.mode);
+    hooks_set_attr_i64("log2_num_keys", args.log2_num_keys);
+    hooks_set_attr_i64("log2_num_ops", args.log2_num_ops);
+    hooks_set_attr_i64("insert_percent", args.insert_percent);
+    hooks_set_attr_i64("skew", args.skew);
+    hooks_set_attr_i64("num_threads", args.num_threads);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+
+    long num_keys = 1L << args.log2_num_keys;
+    long num_ops = 1L << args.log2_num_ops;
+    LOG("Initializing skip list with %li of %li keys, %s allocation\n", num_keys / 2, num_keys, args.mode);
+    skip_list_init(&data, alloc_mode, num_keys, num_ops, args.insert_percent, args.skew, args.num_threads);
+
+    LOG("Doing %li operations (%li%% inserts) with %li threads\n", num_ops, args.insert_percent, args.num_threads);
+    skip_list_run(&data, args.mode, args.num_trials);
+
+    skip_list_deinit(&data);
+    return 0;
+}
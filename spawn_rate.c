@@ -15,6 +15,7 @@
  * - recursive vs serial spawn tree
  * - number of arguments passed to worker thread
  * - worker thread has stack or is stackless
+ * - call depth and stack frame size of the worker thread, and what they cost when the thread migrates
  * Secondary goal: reproduce issues with va_arg in a minimal test case
  */
 
@@ -22,6 +23,13 @@ typedef struct spawn_rate_data {
     long * array;
     long n;
     long num_threads;
+    // Call depth and local array size (in longs) of each stack frame for the deep_* modes
+    long call_depth;
+    long frame_words;
+    // Number of round trips to nodelet 1 at the bottom of the call stack in deep_migrate mode
+    long num_migrations;
+    // Striped array, one element per nodelet, used as migration targets
+    long * nodelets;
 } spawn_rate_data;
 
 replicated spawn_rate_data data;
@@ -47,6 +55,31 @@ heavy_worker(long * begin, long * end)
     light_worker(begin, end);
 }
 
+// Calls itself depth times, with a local array of frame_words longs in each stack frame.
+// The frames stay live until the whole call chain returns, so they are part of the thread context
+// for the work (and the migrations, if num_migrations > 0) at the bottom of the stack.
+noinline long
+deep_worker(long * begin, long * end, long depth, long frame_words, long num_migrations)
+{
+    volatile long frame[frame_words];
+    for (long i = 0; i < frame_words; ++i) { frame[i] = depth; }
+    long result;
+    if (depth > 1) {
+        result = deep_worker(begin, end, depth - 1, frame_words, num_migrations);
+    } else {
+        DO_WORK(begin, end);
+        // Loads alternate between nodelets 1 and 0, so each one migrates the thread
+        volatile long * nodelets = data.nodelets;
+        result = 0;
+        for (long i = 0; i < num_migrations; ++i) {
+            result += nodelets[1];
+            result += nodelets[0];
+        }
+    }
+    // Reading the frame after the call keeps it live, and brings the thread back to its stack
+    return result + frame[0];
+}
+
 // Recursive spawn, work function is inline
 noinline void
 recursive_spawn_inline_worker(long * begin, long * end, long grain)
@@ -109,6 +142,16 @@ serial_spawn_heavy_worker(long * begin, long * end, long grain)
     }
 }
 
+// Serial spawn, work function has a deep stack
+noinline void
+serial_spawn_deep_worker(long * begin, long * end, long grain, long num_migrations)
+{
+    for (long * first = begin; first < end; first += grain) {
+        long * last = first + grain <= end ? first + grain : end;
+        cilk_spawn deep_worker(first, last, data.call_depth, data.frame_words, num_migrations);
+    }
+}
+
 // Worker used by emu_c_utils
 noinline void
 library_inline_worker(long begin, long end, va_list args)
@@ -150,12 +193,16 @@ init(long n, long num_threads)
     data.num_threads = num_threads;
     data.array = malloc(n * sizeof(long));
     assert(data.array);
+    data.nodelets = mw_malloc1dlong(NODELETS());
+    assert(data.nodelets);
+    for (long i = 0; i < NODELETS(); ++i) { data.nodelets[i] = 0; }
 }
 
 void
 deinit()
 {
     free(data.array);
+    mw_free(data.nodelets);
 }
 
 void
@@ -164,22 +211,30 @@ clear()
     memset(data.array, 0, data.n * sizeof(long));
 }
 
-void
-validate()
+noinline void
+validate_worker(long begin, long end, va_list args)
 {
-    bool success = true;
-    for (long i = 0; i < data.n; ++i) {
-        if (data.array[i] != 1) {
-            success = false;
-            break;
+    long * array = va_arg(args, long*);
+    long * checksum = va_arg(args, long*);
+    long local_sum = 0;
+    for (long i = begin; i < end; ++i) {
+        if (array[i] != 1) {
+            LOG("FAILED\n");
+            exit(1);
         }
+        local_sum += array[i];
     }
-    if (success) {
-        LOG("PASSED\n");
-    } else {
-        LOG("FAILED\n");
-        exit(1);
-    }
+    REMOTE_ADD(checksum, local_sum);
+}
+
+// Check every element in parallel, returns the sum of all elements
+long
+validate()
+{
+    long checksum = 0;
+    emu_local_for(0, data.n, LOCAL_GRAIN(data.n), validate_worker, data.array, &checksum);
+    LOG("PASSED\n");
+    return checksum;
 }
 
 noinline void
@@ -227,6 +282,16 @@ do_recursive_spawn_heavy() {
     recursive_spawn_heavy_worker(data.array, data.array + data.n, data.n / data.num_threads);
 }
 
+noinline void
+do_deep_spawn() {
+    serial_spawn_deep_worker(data.array, data.array + data.n, data.n / data.num_threads, 0);
+}
+
+noinline void
+do_deep_migrate() {
+    serial_spawn_deep_worker(data.array, data.array + data.n, data.n / data.num_threads, data.num_migrations);
+}
+
 // Do the work with an emu_c_utils library call
 noinline void
 do_library_inline()
@@ -261,6 +326,25 @@ void run(const char * name, void (*benchmark)(), long num_trials)
     }
 }
 
+// Also reports the spawn rate and the migration rate, for the deep_* modes
+void run_deep(const char * name, void (*benchmark)(), long num_migrations, long num_trials)
+{
+    long num_spawned = (data.n + data.n / data.num_threads - 1) / (data.n / data.num_threads);
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        hooks_region_begin(name);
+        benchmark();
+        double time_ms = hooks_region_end();
+        double bytes_per_second = time_ms == 0 ? 0 :
+            (data.n * sizeof(long)) / (time_ms/1000);
+        double threads_per_second = time_ms == 0 ? 0 : num_spawned / (time_ms/1000);
+        double migrations_per_second = time_ms == 0 ? 0 :
+            (num_spawned * num_migrations * 2) / (time_ms/1000);
+        LOG("%3.2f MB/s, %3.2f K threads/s, %3.2f M migrations/s\n",
+            bytes_per_second / (1000000), threads_per_second / 1000, migrations_per_second / 1000000);
+    }
+}
+
 int main(int argc, char** argv)
 {
     struct {
@@ -268,10 +352,18 @@ int main(int argc, char** argv)
         long log2_num_elements;
         long num_threads;
         long num_trials;
+        long call_depth;
+        long frame_bytes;
+        long num_migrations;
     } args;
 
+    args.call_depth = take_long_option(&argc, argv, "call_depth", 1);
+    args.frame_bytes = take_long_option(&argc, argv, "frame_bytes", 0);
+    args.num_migrations = take_long_option(&argc, argv, "num_migrations", 16);
+
     if (argc != 5) {
-        LOG("Usage: %s mode log2_num_elements num_threads num_trials\n", argv[0]);
+        LOG("Usage: %s mode log2_num_elements num_threads num_trials "
+            "[--call_depth D] [--frame_bytes B] [--num_migrations M]\n", argv[0]);
         exit(1);
     } else {
         args.mode = argv[1];
@@ -282,14 +374,23 @@ int main(int argc, char** argv)
         if (args.log2_num_elements <= 0) { LOG("log2_num_elements must be > 0"); exit(1); }
         if (args.num_threads <= 0) { LOG("num_threads must be > 0"); exit(1); }
         if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+        if (args.call_depth <= 0) { LOG("call_depth must be > 0"); exit(1); }
+        if (args.frame_bytes < 0) { LOG("frame_bytes must be >= 0"); exit(1); }
+        if (args.num_migrations < 0) { LOG("num_migrations must be >= 0"); exit(1); }
     }
 
     long n = 1L << args.log2_num_elements;
+    // Every mode splits the array into n / num_threads elements per thread
+    if (args.num_threads > n) { LOG("num_threads must be <= 2^log2_num_elements"); exit(1); }
     LOG("Initializing array with %li elements each (%li MiB)\n",
         n, (n * sizeof(long)) / (1024*1024)); fflush(stdout);
 
     init(n, args.num_threads);
     clear();
+    data.call_depth = args.call_depth;
+    // Every frame holds at least one long, so it can't be optimized away
+    data.frame_words = args.frame_bytes > (long)sizeof(long) ? args.frame_bytes / sizeof(long) : 1;
+    data.num_migrations = args.num_migrations;
 
     LOG("Running with %s\n", args.mode);
 
@@ -298,6 +399,13 @@ int main(int argc, char** argv)
     hooks_set_attr_i64("num_threads", args.num_threads);
     hooks_set_attr_i64("num_nodelets", NODELETS());
     hooks_set_attr_i64("num_bytes_per_element", sizeof(long));
+    if (!strncmp(args.mode, "deep_", 5)) {
+        hooks_set_attr_i64("call_depth", args.call_depth);
+        hooks_set_attr_i64("frame_bytes", data.frame_words * sizeof(long));
+    }
+    if (!strcmp(args.mode, "deep_migrate")) {
+        hooks_set_attr_i64("num_migrations", args.num_migrations);
+    }
 
 #define RUN_BENCHMARK(X) run(args.mode, X, args.num_trials)
 
@@ -323,12 +431,20 @@ int main(int argc, char** argv)
         RUN_BENCHMARK(do_library_light);
     } else if (!strcmp(args.mode, "library_heavy")) {
         RUN_BENCHMARK(do_library_heavy);
+    } else if (!strcmp(args.mode, "deep_spawn")) {
+        run_deep(args.mode, do_deep_spawn, 0, args.num_trials);
+    } else if (!strcmp(args.mode, "deep_migrate")) {
+        run_deep(args.mode, do_deep_migrate, args.num_migrations, args.num_trials);
     } else {
         LOG("Mode %s not implemented!", args.mode);
     }
 #ifndef NO_VALIDATE
     LOG("Validating results...");
-    validate();
+    hooks_region_begin("validate");
+    long checksum = validate();
+    hooks_set_attr_i64("checksum", checksum);
+    hooks_region_end();
+    runtime_assert(checksum == data.n, "Checksum does not match");
     LOG("OK\n");
 #endif
     deinit();
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+#include <emu_c_utils/emu_c_utils.h>
+
+#include "common.h"
+#include "nodelet_timing.h"
+
+/*
+ * Goal: Find the real safe thread limit per nodelet.
+ * Each nodelet has a fixed number of hardware thread contexts (contexts_per_nodelet). This benchmark spawns
+ * 1x, 2x, 4x ... max_factor x that many threads on every nodelet and measures what happens when they run out.
+ * cilk_spawn has no way to report failure, so exhaustion shows up as stalls instead:
+ * - the time each spawning thread spends in its spawn loop
+ * - the latency from a spawn to the start of the spawned thread
+ * - the peak number of threads active at once on each nodelet
+ * Modes:
+ * - local_spawn  - remote spawn one thread per nodelet, which spawns that nodelet's threads locally
+ * - remote_spawn - a single thread on nodelet 0 spawns every thread directly on its nodelet with cilk_spawn_at
+ * Spawn latencies compare clocks on different nodelets in remote_spawn mode, which assumes the clocks are in sync.
+ */
+
+typedef struct thread_limit_data {
+    // Number of iterations of work done by each thread
+    long work;
+    long threads_per_nodelet;
+    // Striped arrays, one element per nodelet
+    long * scratch;
+    long * active;
+    long * peak_active;
+    long * num_started;
+    long * latency_sum;
+    long * latency_max;
+    long * spawn_loop_ticks;
+} thread_limit_data;
+
+replicated thread_limit_data data;
+
+void
+replicated_init_ptr(long ** ptr, long * val)
+{
+    mw_replicated_init((long*)ptr, (long)val);
+}
+
+void
+thread_limit_init(thread_limit_data * data, long work)
+{
+    mw_replicated_init(&data->work, work);
+    replicated_init_ptr(&data->scratch, mw_malloc1dlong(NODELETS()));
+    replicated_init_ptr(&data->active, mw_malloc1dlong(NODELETS()));
+    replicated_init_ptr(&data->peak_active, mw_malloc1dlong(NODELETS()));
+    replicated_init_ptr(&data->num_started, mw_malloc1dlong(NODELETS()));
+    replicated_init_ptr(&data->latency_sum, mw_malloc1dlong(NODELETS()));
+    replicated_init_ptr(&data->latency_max, mw_malloc1dlong(NODELETS()));
+    replicated_init_ptr(&data->spawn_loop_ticks, mw_malloc1dlong(NODELETS()));
+    runtime_assert(data->scratch && data->active && data->peak_active && data->num_started
+        && data->latency_sum && data->latency_max && data->spawn_loop_ticks,
+        "Failed to allocate per-nodelet counters");
+}
+
+void
+thread_limit_deinit(thread_limit_data * data)
+{
+    mw_free(data->scratch);
+    mw_free(data->active);
+    mw_free(data->peak_active);
+    mw_free(data->num_started);
+    mw_free(data->latency_sum);
+    mw_free(data->latency_max);
+    mw_free(data->spawn_loop_ticks);
+}
+
+void
+thread_limit_reset(thread_limit_data * data, long threads_per_nodelet)
+{
+    mw_replicated_init(&data->threads_per_nodelet, threads_per_nodelet);
+    for (long i = 0; i < NODELETS(); ++i) {
+        data->scratch[i] = i;
+        data->active[i] = 0;
+        data->peak_active[i] = 0;
+        data->num_started[i] = 0;
+        data->latency_sum[i] = 0;
+        data->latency_max[i] = 0;
+        data->spawn_loop_ticks[i] = 0;
+    }
+}
+
+static noinline void
+worker(thread_limit_data * data, long spawn_time)
+{
+    long start = timing_now();
+    long nlet = NODE_ID();
+    long latency = start - spawn_time;
+    long active = ATOMIC_ADDMS(&data->active[nlet], 1) + 1;
+    atomic_max_long(&data->peak_active[nlet], active);
+    REMOTE_ADD(&data->num_started[nlet], 1);
+    REMOTE_ADD(&data->latency_sum[nlet], latency);
+    atomic_max_long(&data->latency_max[nlet], latency);
+
+    // Local loads, so the thread holds its context for a while without migrating
+    volatile long * scratch = &data->scratch[nlet];
+    long sum = 0;
+    for (long i = 0; i < data->work; ++i) {
+        sum += *scratch;
+    }
+    if (sum == -1) { LOG("%li\n", sum); }
+
+    ATOMIC_ADDMS(&data->active[nlet], -1);
+}
+
+static noinline void
+local_spawner(thread_limit_data * data)
+{
+    long nlet = NODE_ID();
+    long begin = timing_now();
+    for (long i = 0; i < data->threads_per_nodelet; ++i) {
+        cilk_spawn worker(data, timing_now());
+    }
+    REMOTE_ADD(&data->spawn_loop_ticks[nlet], timing_now() - begin);
+    cilk_sync;
+}
+
+void
+thread_limit_local_spawn(thread_limit_data * data)
+{
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        cilk_spawn_at(&data->scratch[nlet]) local_spawner(data);
+    }
+    cilk_sync;
+}
+
+void
+thread_limit_remote_spawn(thread_limit_data * data)
+{
+    long begin = timing_now();
+    for (long i = 0; i < data->threads_per_nodelet; ++i) {
+        for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+            cilk_spawn_at(&data->scratch[nlet]) worker(data, timing_now());
+        }
+    }
+    data->spawn_loop_ticks[0] = timing_now() - begin;
+    cilk_sync;
+}
+
+void
+thread_limit_run(
+    thread_limit_data * data,
+    const char * name,
+    void (*benchmark)(thread_limit_data *),
+    long contexts_per_nodelet,
+    long max_factor,
+    long num_trials)
+{
+    LOG("factor, threads per nodelet, M threads/s, spawn loop (ms), spawn-to-start mean (us), max (us), peak active per nodelet\n");
+    for (long factor = 1; factor <= max_factor; factor *= 2) {
+        long threads_per_nodelet = factor * contexts_per_nodelet;
+        hooks_set_attr_i64("factor", factor);
+        hooks_set_attr_i64("threads_per_nodelet", threads_per_nodelet);
+        for (long trial = 0; trial < num_trials; ++trial) {
+            hooks_set_attr_i64("trial", trial);
+            thread_limit_reset(data, threads_per_nodelet);
+            hooks_region_begin(name);
+            benchmark(data);
+            double time_ms = hooks_region_end();
+
+            long num_started = 0, latency_sum = 0, latency_max = 0, peak_active = 0, spawn_loop_max = 0;
+            for (long i = 0; i < NODELETS(); ++i) {
+                num_started += data->num_started[i];
+                latency_sum += data->latency_sum[i];
+                if (data->latency_max[i] > latency_max) { latency_max = data->latency_max[i]; }
+                if (data->peak_active[i] > peak_active) { peak_active = data->peak_active[i]; }
+                if (data->spawn_loop_ticks[i] > spawn_loop_max) { spawn_loop_max = data->spawn_loop_ticks[i]; }
+            }
+            runtime_assert(num_started == threads_per_nodelet * NODELETS(), "Some threads never started");
+            double threads_per_second = time_ms == 0 ? 0 : num_started / (time_ms/1000);
+            double ticks_per_us = TIMING_TICKS_PER_MS / 1000;
+            LOG("%li, %li, %3.2f, %3.3f, %3.3f, %3.3f, %li\n",
+                factor, threads_per_nodelet, threads_per_second / 1e6,
+                spawn_loop_max / TIMING_TICKS_PER_MS,
+                (double)latency_sum / num_started / ticks_per_us, latency_max / ticks_per_us,
+                peak_active);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* mode;
+        long log2_work;
+        long num_trials;
+        long contexts_per_nodelet;
+        long max_factor;
+    } args;
+
+    // 64 hardware thread contexts per nodelet on the Emu Chick
+    args.contexts_per_nodelet = take_long_option(&argc, argv, "contexts_per_nodelet", 64);
+    args.max_factor = take_long_option(&argc, argv, "max_factor", 64);
+
+    if (argc != 4) {
+        LOG("Usage: %s mode log2_work num_trials [--contexts_per_nodelet C] [--max_factor F]\n", argv[0]);
+        exit(1);
+    } else {
+        args.mode = argv[1];
+        args.log2_work = atol(argv[2]);
+        args.num_trials = atol(argv[3]);
+
+        if (args.log2_work < 0) { LOG("log2_work must be >= 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+        if (args.contexts_per_nodelet <= 0) { LOG("contexts_per_nodelet must be > 0"); exit(1); }
+        if (args.max_factor <= 0) { LOG("max_factor must be > 0"); exit(1); }
+    }
+
+    hooks_set_attr_str("mode", args.mode);
+    hooks_set_attr_i64("log2_work", args.log2_work);
+    hooks_set_attr_i64("contexts_per_nodelet", args.contexts_per_nodelet);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+
+    thread_limit_init(&data, 1L << args.log2_work);
+    LOG("Spawning 1x to %lix %li threads per nodelet with %s\n",
+        args.max_factor, args.contexts_per_nodelet, args.mode);
+
+    #define RUN_BENCHMARK(X) thread_limit_run(&data, args.mode, X, \
+        args.contexts_per_nodelet, args.max_factor, args.num_trials)
+
+    if (!strcmp(args.mode, "local_spawn")) {
+        RUN_BENCHMARK(thread_limit_local_spawn);
+    } else if (!strcmp(args.mode, "remote_spawn")) {
+        RUN_BENCHMARK(thread_limit_remote_spawn);
+    } else {
+        LOG("Mode %s not implemented!\n", args.mode);
+        exit(1);
+    }
+
+    thread_limit_deinit(&data);
+    return 0;
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <stdio.h>
+#include <limits.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+#include "nodelet_timing.h"
+
+/*
+ * Timeline tracing of spawn trees (configure with -DENABLE_TRACING=ON).
+ *
+ * Instrumented threads record start, spawn, migrate and finish events into a ring buffer on the nodelet where
+ * each event happens. trace_dump() writes every buffer as a Chrome trace (open it in chrome://tracing or
+ * https://ui.perfetto.dev), with one process per nodelet and one track per thread. Spawns are drawn as arrows
+ * from the parent to the child, and a thread that migrates moves to the track of its new nodelet.
+ *
+ * Each instrumented function takes its trace ID as an extra parameter, which only exists when tracing is enabled:
+ *
+ *     void worker(long begin, long end TRACE_PARAM)
+ *     {
+ *         trace_thread self = trace_start(TRACE_ID, "worker");
+ *         long child = trace_spawn(&self);
+ *         cilk_spawn worker(begin, mid TRACE_ARG(child));
+ *         ...
+ *         trace_finish(&self);
+ *     }
+ *
+ * The root of the tree is called with TRACE_ARG(trace_root()), and a recursive call that doesn't spawn is passed
+ * TRACE_ARG(trace_nested(&self)), so it shows up as a nested slice on the same track.
+ * Migrations are noticed the next time the thread calls trace_spawn(), trace_nested(), trace_migrate() or
+ * trace_finish(). Only the last TRACE_EVENTS_PER_NODELET events on each nodelet are kept, and the TRACE_FILENAME
+ * environment variable overrides the file name passed to trace_dump().
+ * Timestamps from different nodelets are only comparable if their clocks are in sync.
+ * Without tracing, every call compiles to nothing.
+ */
+
+typedef struct trace_thread {
+    long id;
+    // Nodelet of the last event this thread recorded
+    long nlet;
+    const char * name;
+} trace_thread;
+
+#ifdef TRACING
+
+#ifndef TRACE_EVENTS_PER_NODELET
+#define TRACE_EVENTS_PER_NODELET 65536
+#endif
+
+#define TRACE_PARAM , long trace_id
+#define TRACE_ARG(ID) , (ID)
+#define TRACE_ID trace_id
+
+typedef enum trace_event_type {
+    TRACE_START,
+    TRACE_SPAWN,
+    TRACE_MIGRATE,
+    TRACE_FINISH,
+} trace_event_type;
+
+typedef struct trace_event {
+    long ts;
+    long type;
+    long id;
+    // 1 if a spawned thread for TRACE_START, child ID for TRACE_SPAWN, previous nodelet for TRACE_MIGRATE
+    long arg;
+    const char * name;
+} trace_event;
+
+typedef struct trace_state {
+    // Striped arrays, one element per nodelet
+    long * heads;
+    long * next_id;
+    // One ring buffer of TRACE_EVENTS_PER_NODELET events on each nodelet
+    trace_event ** rings;
+} trace_state;
+
+replicated trace_state trace;
+
+static inline void
+trace_init()
+{
+    mw_replicated_init((long*)&trace.heads, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&trace.next_id, (long)mw_malloc1dlong(NODELETS()));
+    mw_replicated_init((long*)&trace.rings,
+        (long)mw_malloc2d(NODELETS(), TRACE_EVENTS_PER_NODELET * sizeof(trace_event)));
+    runtime_assert(trace.heads && trace.next_id && trace.rings, "Failed to allocate trace buffers");
+    for (long i = 0; i < NODELETS(); ++i) {
+        trace.heads[i] = 0;
+        // Thread IDs are unique across nodelets
+        trace.next_id[i] = (i << 40) + 1;
+    }
+}
+
+static inline void
+trace_deinit()
+{
+    mw_free(trace.heads);
+    mw_free(trace.next_id);
+    mw_free(trace.rings);
+}
+
+static inline void
+trace_record(long nlet, long type, long id, long arg, const char * name)
+{
+    long i = ATOMIC_ADDMS(&trace.heads[nlet], 1) % TRACE_EVENTS_PER_NODELET;
+    trace_event * e = &trace.rings[nlet][i];
+    e->ts = timing_now();
+    e->type = type;
+    e->id = id;
+    e->arg = arg;
+    e->name = name;
+}
+
+// Returns a new thread ID, allocated on the current nodelet
+static inline long
+trace_new_id()
+{
+    return ATOMIC_ADDMS(&trace.next_id[NODE_ID()], 1);
+}
+
+// ID for the root of a tree, which wasn't spawned by a traced thread
+static inline long
+trace_root()
+{
+    return -trace_new_id();
+}
+
+static inline void
+trace_migrate(trace_thread * self)
+{
+    long nlet = NODE_ID();
+    if (nlet != self->nlet) {
+        trace_record(nlet, TRACE_MIGRATE, self->id, self->nlet, self->name);
+        self->nlet = nlet;
+    }
+}
+
+// Nested calls are passed the negated ID of their thread
+static inline trace_thread
+trace_start(long id, const char * name)
+{
+    bool nested = id < 0;
+    trace_thread self = { nested ? -id : id, NODE_ID(), name };
+    trace_record(self.nlet, TRACE_START, self.id, !nested, name);
+    return self;
+}
+
+static inline long
+trace_nested(trace_thread * self)
+{
+    trace_migrate(self);
+    return -self->id;
+}
+
+// Call right before spawning a child, and pass the returned ID to it with TRACE_ARG
+static inline long
+trace_spawn(trace_thread * self)
+{
+    trace_migrate(self);
+    long child = trace_new_id();
+    trace_record(self->nlet, TRACE_SPAWN, self->id, child, self->name);
+    return child;
+}
+
+static inline void
+trace_finish(trace_thread * self)
+{
+    trace_migrate(self);
+    trace_record(self->nlet, TRACE_FINISH, self->id, 0, self->name);
+}
+
+// Clears the buffers, so the next dump only covers what happens from now on
+static inline void
+trace_reset()
+{
+    for (long i = 0; i < NODELETS(); ++i) {
+        trace.heads[i] = 0;
+    }
+}
+
+static inline void
+trace_write_event(FILE * f, bool * first, const char * ph, long nlet, long tid, double us, const char * name)
+{
+    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%li,\"tid\":%li,\"ts\":%.3f}",
+        *first ? "" : ",", name, ph, nlet, tid, us);
+    *first = false;
+}
+
+// Writes the contents of every ring buffer as a Chrome trace JSON file
+static inline void
+trace_dump(const char * filename)
+{
+    const char * env = getenv("TRACE_FILENAME");
+    if (env) { filename = env; }
+    FILE * f = fopen(filename, "w");
+    if (f == NULL) {
+        LOG_WARN("WARNING: could not open %s, skipping trace dump\n", filename);
+        return;
+    }
+    const double ticks_per_us = TIMING_TICKS_PER_MS / 1000;
+    // Timestamps are relative to the earliest event
+    long t0 = LONG_MAX;
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        long count = trace.heads[nlet] < TRACE_EVENTS_PER_NODELET ? trace.heads[nlet] : TRACE_EVENTS_PER_NODELET;
+        for (long i = 0; i < count; ++i) {
+            if (trace.rings[nlet][i].ts < t0) { t0 = trace.rings[nlet][i].ts; }
+        }
+    }
+
+    bool first = true;
+    long num_events = 0;
+    fprintf(f, "{\"traceEvents\":[");
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        fprintf(f, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%li,\"args\":{\"name\":\"Nodelet %li\"}}",
+            first ? "" : ",", nlet, nlet);
+        first = false;
+        long head = trace.heads[nlet];
+        long count = head < TRACE_EVENTS_PER_NODELET ? head : TRACE_EVENTS_PER_NODELET;
+        // Oldest event first
+        for (long j = head - count; j < head; ++j) {
+            trace_event * e = &trace.rings[nlet][j % TRACE_EVENTS_PER_NODELET];
+            double us = (e->ts - t0) / ticks_per_us;
+            switch (e->type) {
+                case TRACE_START:
+                    trace_write_event(f, &first, "B", nlet, e->id, us, e->name);
+                    // End of the arrow from the spawn
+                    if (e->arg) {
+                        fprintf(f, ",\n{\"name\":\"spawn\",\"cat\":\"spawn\",\"ph\":\"f\",\"bp\":\"e\","
+                            "\"id\":%li,\"pid\":%li,\"tid\":%li,\"ts\":%.3f}", e->id, nlet, e->id, us);
+                    }
+                    break;
+                case TRACE_SPAWN:
+                    fprintf(f, ",\n{\"name\":\"spawn\",\"cat\":\"spawn\",\"ph\":\"s\","
+                        "\"id\":%li,\"pid\":%li,\"tid\":%li,\"ts\":%.3f}", e->arg, nlet, e->id, us);
+                    break;
+                case TRACE_MIGRATE:
+                    trace_write_event(f, &first, "E", e->arg, e->id, us, e->name);
+                    trace_write_event(f, &first, "B", nlet, e->id, us, e->name);
+                    break;
+                case TRACE_FINISH:
+                    trace_write_event(f, &first, "E", nlet, e->id, us, e->name);
+                    break;
+            }
+            num_events += 1;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    LOG("Wrote %li trace events to %s\n", num_events, filename);
+}
+
+#else
+
+#define TRACE_PARAM
+#define TRACE_ARG(ID)
+#define TRACE_ID 0
+
+static inline void trace_init() {}
+static inline void trace_deinit() {}
+static inline long trace_new_id() { return 0; }
+static inline long trace_root() { return 0; }
+static inline void trace_migrate(trace_thread * self) { (void)self; }
+static inline trace_thread trace_start(long id, const char * name) { trace_thread self = { id, 0, name }; return self; }
+static inline long trace_spawn(trace_thread * self) { (void)self; return 0; }
+static inline long trace_nested(trace_thread * self) { (void)self; return 0; }
+static inline void trace_finish(trace_thread * self) { (void)self; }
+static inline void trace_reset() {}
+static inline void trace_dump(const char * filename) { (void)filename; }
+
+#endif
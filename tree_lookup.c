@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <cilk/cilk.h>
+#include <assert.h>
+#include <string.h>
+
+#include <emu_c_utils/emu_c_utils.h>
+#include "common.h"
+#include "rng.h"
+
+/*
+ * Goal: Measure dependent-load lookups into a static search tree spread across nodelets.
+ * The tree is a complete B-tree with num_levels levels, where each node holds fanout-1 sorted keys
+ * followed by fanout child pointers (fanout 2 is a binary search tree).
+ * Many threads do lookups concurrently, each migrating down the tree to the nodelet holding the next node.
+ * Placements:
+ * - random           - each node is placed on a pseudo-random nodelet
+ * - replicated_top   - the top replicated_levels levels are replicated on every nodelet (mw_mallocrepl),
+ *                      the rest are placed randomly
+ * - subtree          - each subtree below the first level with at least NODELETS() nodes lives on a single
+ *                      nodelet, the levels above it are on nodelet 0
+ */
+
+enum placement {
+    RANDOM,
+    REPLICATED_TOP,
+    SUBTREE
+};
+
+typedef struct tree_lookup_data {
+    // Root of the tree
+    long * root;
+    long fanout;
+    long num_levels;
+    // Number of keys in the tree, keys are 0 through num_keys-1
+    long num_keys;
+    // The top levels of the tree are replicated on every nodelet
+    long replicated_levels;
+    // Level at which each subtree gets its own nodelet, for the subtree placement
+    long split_level;
+    long placement;
+    // One element on each nodelet, used to allocate a node on a particular nodelet
+    long * anchors;
+    // Striped arrays of keys to look up and the values found
+    long * keys;
+    long * out;
+    long n;
+    long num_threads;
+} tree_lookup_data;
+
+replicated tree_lookup_data data;
+
+// Random streams for the keys, and for the node placement on each level
+#define STREAM_KEYS 0
+#define STREAM_PLACEMENT 1
+
+// Each node is fanout-1 keys followed by fanout child pointers
+static inline long
+node_words(tree_lookup_data * data)
+{
+    return 2 * data->fanout - 1;
+}
+
+static inline long
+ipow(long base, long exp)
+{
+    long result = 1;
+    for (long i = 0; i < exp; ++i) { result *= base; }
+    return result;
+}
+
+static inline bool
+is_replicated_level(tree_lookup_data * data, long level)
+{
+    return data->placement == REPLICATED_TOP && level < data->replicated_levels;
+}
+
+// Which nodelet holds the idx'th node on this level
+static long
+node_nodelet(tree_lookup_data * data, long level, long idx)
+{
+    switch (data->placement) {
+        case SUBTREE:
+            if (level < data->split_level) { return 0; }
+            // Index of the ancestor on the split level
+            return (idx / ipow(data->fanout, level - data->split_level)) % NODELETS();
+        case RANDOM:
+        case REPLICATED_TOP:
+        default:
+            return rng_below(rng_at(0, STREAM_PLACEMENT + level, idx), NODELETS());
+    }
+}
+
+/*
+ * Builds the subtree rooted at the idx'th node of this level, containing keys [lo, lo + fanout^(num_levels-level) - 1),
+ * and stores the pointer to it in *slot.
+ * Keys are numbered in order, so the j'th key of a node comes after all the keys under its first j+1 children.
+ */
+static void
+tree_build(tree_lookup_data * data, long level, long idx, long lo, long ** slot)
+{
+    const long fanout = data->fanout;
+    const long words = node_words(data);
+    bool repl = is_replicated_level(data, level);
+    long * node;
+    if (repl) {
+        node = mw_mallocrepl(words * sizeof(long));
+    } else {
+        long nlet = node_nodelet(data, level, idx);
+        node = mw_localmalloc(words * sizeof(long), &data->anchors[nlet]);
+    }
+    runtime_assert(node != NULL, "Failed to allocate tree node");
+    long * local = repl ? mw_get_nth(node, 0) : node;
+
+    // Number of keys under each child
+    long child_keys = ipow(fanout, data->num_levels - level - 1) - 1;
+    for (long j = 0; j < fanout - 1; ++j) {
+        local[j] = lo + (j + 1) * child_keys + j;
+    }
+    long ** children = (long**)(local + fanout - 1);
+    if (level == data->num_levels - 1) {
+        for (long j = 0; j < fanout; ++j) { children[j] = NULL; }
+    } else {
+        for (long j = 0; j < fanout; ++j) {
+            cilk_spawn tree_build(data, level + 1, idx * fanout + j, lo + j * (child_keys + 1), &children[j]);
+        }
+        cilk_sync;
+    }
+    if (repl) {
+        for (long i = 1; i < NODELETS(); ++i) {
+            memcpy(mw_get_nth(node, i), local, words * sizeof(long));
+        }
+    }
+    *slot = node;
+}
+
+static void
+tree_free(tree_lookup_data * data, long level, long * node)
+{
+    bool repl = is_replicated_level(data, level);
+    long * local = repl ? mw_get_nth(node, 0) : node;
+    if (level < data->num_levels - 1) {
+        long ** children = (long**)(local + data->fanout - 1);
+        for (long j = 0; j < data->fanout; ++j) {
+            tree_free(data, level + 1, children[j]);
+        }
+    }
+    if (repl) {
+        mw_free(node);
+    } else {
+        mw_localfree(node);
+    }
+}
+
+void
+replicated_init_ptr(long ** ptr, long * val)
+{
+    mw_replicated_init((long*)ptr, (long)val);
+}
+
+static void
+keys_init_worker(long * array, long begin, long end, va_list args)
+{
+    tree_lookup_data * data = va_arg(args, tree_lookup_data *);
+    const long nodelets = NODELETS();
+    for (long i = begin; i < end; i += nodelets) {
+        data->keys[i] = rng_below(rng_at(0, STREAM_KEYS, i), data->num_keys);
+        data->out[i] = -1;
+    }
+}
+
+void
+tree_lookup_init(tree_lookup_data * data, enum placement placement, long fanout, long num_levels,
+    long replicated_levels, long n, long num_threads)
+{
+    mw_replicated_init(&data->fanout, fanout);
+    mw_replicated_init(&data->num_levels, num_levels);
+    mw_replicated_init(&data->num_keys, ipow(fanout, num_levels) - 1);
+    mw_replicated_init(&data->replicated_levels, replicated_levels);
+    mw_replicated_init(&data->placement, placement);
+    mw_replicated_init(&data->n, n);
+    mw_replicated_init(&data->num_threads, num_threads);
+    long split_level = 0;
+    while (ipow(fanout, split_level) < NODELETS()) { split_level += 1; }
+    mw_replicated_init(&data->split_level, split_level);
+
+    replicated_init_ptr(&data->anchors, mw_malloc1dlong(NODELETS()));
+    replicated_init_ptr(&data->keys, mw_malloc1dlong(n));
+    replicated_init_ptr(&data->out, mw_malloc1dlong(n));
+    runtime_assert(data->anchors && data->keys && data->out, "Failed to allocate arrays");
+
+    long * root;
+    tree_build(data, 0, 0, 0, &root);
+    replicated_init_ptr(&data->root, root);
+
+    emu_1d_array_apply(data->keys, n, GLOBAL_GRAIN(n),
+        keys_init_worker, data
+    );
+}
+
+void
+tree_lookup_deinit(tree_lookup_data * data)
+{
+    tree_free(data, 0, data->root);
+    mw_free(data->anchors);
+    mw_free(data->keys);
+    mw_free(data->out);
+}
+
+// Returns the value stored with key (the key itself), or -1 if it is not in the tree
+static inline long
+tree_find(tree_lookup_data * data, long key)
+{
+    const long fanout = data->fanout;
+    long * node = data->root;
+    for (long level = 0; node != NULL; ++level) {
+        // Read the copy of a replicated node on this nodelet
+        if (is_replicated_level(data, level)) {
+            node = mw_get_nth(node, NODE_ID());
+        }
+        long j = 0;
+        while (j < fanout - 1 && node[j] < key) { ++j; }
+        if (j < fanout - 1 && node[j] == key) { return node[j]; }
+        node = ((long**)(node + fanout - 1))[j];
+    }
+    return -1;
+}
+
+static noinline void
+lookup_worker(long * array, long begin, long end, va_list args)
+{
+    (void)array;
+    tree_lookup_data * data = va_arg(args, tree_lookup_data *);
+    const long nodelets = NODELETS();
+    for (long i = begin; i < end; i += nodelets) {
+        data->out[i] = tree_find(data, data->keys[i]);
+    }
+}
+
+noinline void
+tree_lookup_run_lookups(tree_lookup_data * data)
+{
+    long grain = data->n / data->num_threads;
+    emu_1d_array_apply(data->keys, data->n, grain > 0 ? grain : 1,
+        lookup_worker, data
+    );
+}
+
+static void
+validate_worker(long * array, long begin, long end, va_list args)
+{
+    tree_lookup_data * data = va_arg(args, tree_lookup_data *);
+    long * checksum = va_arg(args, long*);
+    const long nodelets = NODELETS();
+    long local_sum = 0;
+    for (long i = begin; i < end; i += nodelets) {
+        if (data->out[i] != data->keys[i]) {
+            LOG_ERROR("VALIDATION ERROR: lookup of %li returned %li\n", data->keys[i], data->out[i]);
+            exit(1);
+        }
+        local_sum += data->out[i];
+    }
+    REMOTE_ADD(checksum, local_sum);
+}
+
+// Check every lookup in parallel, returns the sum of all values found
+long
+tree_lookup_validate(tree_lookup_data * data)
+{
+    long checksum = 0;
+    emu_1d_array_apply(data->out, data->n, GLOBAL_GRAIN_MIN(data->n, 64),
+        validate_worker, data, &checksum
+    );
+    return checksum;
+}
+
+void
+tree_lookup_run(tree_lookup_data * data, const char * name, long num_trials)
+{
+    for (long trial = 0; trial < num_trials; ++trial) {
+        hooks_set_attr_i64("trial", trial);
+        hooks_region_begin(name);
+        tree_lookup_run_lookups(data);
+        double time_ms = hooks_region_end();
+        double lookups_per_second = time_ms == 0 ? 0 : data->n / (time_ms/1000);
+        LOG("%3.2f M lookups/s\n", lookups_per_second / 1000000);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct {
+        const char* mode;
+        long fanout;
+        long num_levels;
+        long log2_num_lookups;
+        long num_threads;
+        long num_trials;
+        long replicated_levels;
+    } args;
+
+    args.replicated_levels = take_long_option(&argc, argv, "replicated_levels", -1);
+
+    if (argc != 7) {
+        LOG("Usage: %s mode fanout num_levels log2_num_lookups num_threads num_trials [--replicated_levels R]\n", argv[0]);
+        exit(1);
+    } else {
+        args.mode = argv[1];
+        args.fanout = atol(argv[2]);
+        args.num_levels = atol(argv[3]);
+        args.log2_num_lookups = atol(argv[4]);
+        args.num_threads = atol(argv[5]);
+        args.num_trials = atol(argv[6]);
+
+        if (args.fanout < 2) { LOG("fanout must be >= 2"); exit(1); }
+        if (args.num_levels <= 0) { LOG("num_levels must be > 0"); exit(1); }
+        if (args.log2_num_lookups <= 0) { LOG("log2_num_lookups must be > 0"); exit(1); }
+        if (args.num_threads <= 0) { LOG("num_threads must be > 0"); exit(1); }
+        if (args.num_trials <= 0) { LOG("num_trials must be > 0"); exit(1); }
+        // Keep the number of keys well within a long
+        double num_keys = 1;
+        for (long i = 0; i < args.num_levels; ++i) { num_keys *= args.fanout; }
+        if (num_keys > (double)(1L << 40)) { LOG("fanout^num_levels is too large"); exit(1); }
+    }
+
+    enum placement placement;
+    if (!strcmp(args.mode, "random")) {
+        placement = RANDOM;
+    } else if (!strcmp(args.mode, "replicated_top")) {
+        placement = REPLICATED_TOP;
+    } else if (!strcmp(args.mode, "subtree")) {
+        placement = SUBTREE;
+    } else {
+        LOG("Mode %s not implemented!\n", args.mode);
+        exit(1);
+    }
+    // By default, replicate the levels that have fewer nodes than there are nodelets
+    if (args.replicated_levels < 0) {
+        args.replicated_levels = 0;
+        while (ipow(args.fanout, args.replicated_levels) < NODELETS()) { args.replicated_levels += 1; }
+    }
+    if (args.replicated_levels > args.num_levels) { args.replicated_levels = args.num_levels; }
+
+    hooks_set_attr_str("mode", args.mode);
+    hooks_set_attr_i64("fanout", args.fanout);
+    hooks_set_attr_i64("num_levels", args.num_levels);
+    hooks_set_attr_i64("log2_num_lookups", args.log2_num_lookups);
+    hooks_set_attr_i64("replicated_levels", placement == REPLICATED_TOP ? args.replicated_levels : 0);
+    hooks_set_attr_i64("num_threads", args.num_threads);
+    hooks_set_attr_i64("num_nodelets", NODELETS());
+    hooks_set_attr_i64("num_bytes_per_element", (2 * args.fanout - 1) * sizeof(long));
+
+    long n = 1L << args.log2_num_lookups;
+    long num_nodes = (ipow(args.fanout, args.num_levels) - 1) / (args.fanout - 1);
+    LOG("Building %s tree with fanout %li, %li levels, %li nodes (%li MiB)\n",
+        args.mode, args.fanout, args.num_levels, num_nodes,
+        (num_nodes * (2 * args.fanout - 1) * sizeof(long)) / (1024*1024));
+    hooks_region_begin("init");
+    tree_lookup_init(&data, placement, args.fanout, args.num_levels, args.replicated_levels,
+        n, args.num_threads);
+    hooks_region_end();
+
+    LOG("Doing %li lookups with %li threads\n", n, args.num_threads);
+    tree_lookup_run(&data, args.mode, args.num_trials);
+
+#ifndef NO_VALIDATE
+    LOG("Validating results...");
+    hooks_region_begin("validate");
+    long checksum = tree_lookup_validate(&data);
+    hooks_set_attr_i64("checksum", checksum);
+    hooks_region_end();
+    LOG("OK\n");
+#endif
+
+    tree_lookup_deinit(&data);
+    return 0;
+}